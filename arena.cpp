@@ -0,0 +1,132 @@
+#include "arena.h"
+#include <cassert>
+#include <cstdint>
+
+namespace coro
+{
+arena::arena(size_t chunk_size)
+	: current(nullptr)
+	, position(nullptr)
+	, end(nullptr)
+	, chunk_size(chunk_size)
+	, allocated(0)
+{
+}
+arena::~arena()
+{
+	while (current)
+	{
+		chunk * previous = current->previous;
+		::operator delete(current);
+		current = previous;
+	}
+}
+
+static unsigned char * align_pointer(unsigned char * pointer, size_t alignment)
+{
+	assert(alignment && !(alignment & (alignment - 1)));
+	return reinterpret_cast<unsigned char *>((reinterpret_cast<uintptr_t>(pointer) + alignment - 1) & ~(alignment - 1));
+}
+
+void * arena::allocate(size_t size, size_t alignment)
+{
+	unsigned char * aligned = align_pointer(position, alignment);
+	if (!current || aligned + size > end) return allocate_from_new_chunk(size, alignment);
+	position = aligned + size;
+	allocated += size;
+	return aligned;
+}
+void * arena::allocate_from_new_chunk(size_t size, size_t alignment)
+{
+	size_t new_size = size + alignment > chunk_size ? size + alignment : chunk_size;
+	chunk * new_chunk = static_cast<chunk *>(::operator new(sizeof(chunk) + new_size));
+	new_chunk->previous = current;
+	new_chunk->size = new_size;
+	current = new_chunk;
+	position = align_pointer(chunk_begin(new_chunk), alignment);
+	end = chunk_begin(new_chunk) + new_size;
+	void * result = position;
+	position += size;
+	allocated += size;
+	return result;
+}
+
+void arena::release()
+{
+	if (!current) return;
+	while (current->previous)
+	{
+		chunk * previous = current->previous->previous;
+		::operator delete(current->previous);
+		current->previous = previous;
+	}
+	position = chunk_begin(current);
+	allocated = 0;
+}
+
+size_t arena::bytes_allocated() const
+{
+	return allocated;
+}
+
+unsigned char * arena::chunk_begin(chunk * c)
+{
+	return reinterpret_cast<unsigned char *>(c + 1);
+}
+}
+
+
+#ifndef DISABLE_GTEST
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+#include <cstring>
+
+TEST(arena, alignment)
+{
+	coro::arena memory(64);
+	for (size_t alignment = 1; alignment <= 16; alignment *= 2)
+	{
+		void * allocated = memory.allocate(3, alignment);
+		EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(allocated) % alignment);
+	}
+	// bigger than a chunk
+	void * big = memory.allocate(1000, 8);
+	EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(big) % 8);
+	memset(big, 0, 1000);
+}
+
+TEST(arena, release)
+{
+	coro::arena memory(128);
+	for (int i = 0; i < 100; ++i)
+	{
+		memory.allocate(16, 8);
+	}
+	EXPECT_EQ(16u * 100, memory.bytes_allocated());
+	memory.release();
+	EXPECT_EQ(0u, memory.bytes_allocated());
+	// the chunk that was kept is reused
+	void * after_release = memory.allocate(16, 8);
+	memory.release();
+	EXPECT_EQ(after_release, memory.allocate(16, 8));
+}
+
+TEST(arena, containers)
+{
+	coro::arena memory;
+	typedef std::basic_string<char, std::char_traits<char>, coro::arena_allocator<char> > arena_string;
+	std::vector<arena_string, coro::arena_allocator<arena_string> > strings(&memory);
+	for (int i = 0; i < 100; ++i)
+	{
+		strings.emplace_back("a string that is too long for the small string optimization", &memory);
+	}
+	EXPECT_EQ(100u, strings.size());
+	EXPECT_EQ(strings.front(), strings.back());
+	EXPECT_LT(0u, memory.bytes_allocated());
+
+	// default constructed allocators use the heap
+	arena_string on_heap("a string that is too long for the small string optimization");
+	EXPECT_EQ(strings.front(), on_heap);
+}
+#endif
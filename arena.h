@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+namespace coro
+{
+/**
+ * a bump allocator. allocations are never freed individually, instead
+ * release() frees everything at once. use this for many short lived
+ * allocations that all die at the same time
+ */
+struct arena
+{
+	explicit arena(size_t chunk_size = 4096);
+	~arena();
+
+	void * allocate(size_t size, size_t alignment);
+	// frees everything that was allocated from this arena. the most recent
+	// chunk is kept so that the next round of allocations doesn't need to
+	// go to the heap again
+	void release();
+
+	// the number of bytes handed out since the last release
+	size_t bytes_allocated() const;
+
+private:
+	struct chunk
+	{
+		chunk * previous;
+		size_t size;
+	};
+	chunk * current;
+	unsigned char * position;
+	unsigned char * end;
+	size_t chunk_size;
+	size_t allocated;
+
+	void * allocate_from_new_chunk(size_t size, size_t alignment);
+	static unsigned char * chunk_begin(chunk * c);
+
+	// intentionally not implemented
+	arena(const arena &);
+	arena & operator=(const arena &);
+};
+
+/**
+ * an allocator for standard containers that allocates from an arena.
+ * a default constructed arena_allocator uses the global heap, so that
+ * the same container type can be used with and without an arena
+ */
+template<typename T>
+struct arena_allocator
+{
+	typedef T value_type;
+
+	arena_allocator()
+		: memory(nullptr)
+	{
+	}
+	arena_allocator(arena * memory)
+		: memory(memory)
+	{
+	}
+	template<typename U>
+	arena_allocator(const arena_allocator<U> & other)
+		: memory(other.get_arena())
+	{
+	}
+
+	T * allocate(size_t count)
+	{
+		if (memory) return static_cast<T *>(memory->allocate(count * sizeof(T), std::alignment_of<T>::value));
+		else return static_cast<T *>(::operator new(count * sizeof(T)));
+	}
+	void deallocate(T * to_free, size_t)
+	{
+		// memory from the arena is freed in arena::release
+		if (!memory) ::operator delete(to_free);
+	}
+
+	arena * get_arena() const
+	{
+		return memory;
+	}
+
+private:
+	arena * memory;
+};
+template<typename T, typename U>
+bool operator==(const arena_allocator<T> & lhs, const arena_allocator<U> & rhs)
+{
+	return lhs.get_arena() == rhs.get_arena();
+}
+template<typename T, typename U>
+bool operator!=(const arena_allocator<T> & lhs, const arena_allocator<U> & rhs)
+{
+	return !(lhs == rhs);
+}
+}
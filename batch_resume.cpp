@@ -0,0 +1,79 @@
+#include "batch_resume.h"
+
+
+#ifndef DISABLE_GTEST
+#include <gtest/gtest.h>
+#include <memory>
+#include <vector>
+
+TEST(batch_resume, resume_all)
+{
+	using namespace coro;
+	std::vector<int> order;
+	std::vector<std::unique_ptr<coroutine<void ()> > > coroutines;
+	for (int i = 0; i < 10; ++i)
+	{
+		coroutines.emplace_back(new coroutine<void ()>([&order, i](coroutine<void ()>::self & self)
+		{
+			for (int j = 0; j < i; ++j)
+			{
+				order.push_back(i);
+				self.yield();
+			}
+		}));
+	}
+	std::vector<coroutine<void ()> *> pointers;
+	for (const std::unique_ptr<coroutine<void ()> > & c : coroutines)
+	{
+		pointers.push_back(c.get());
+	}
+	EXPECT_EQ(9u, resume_batch(pointers.data(), pointers.size()));
+	ASSERT_EQ(9u, order.size());
+	for (int i = 0; i < 9; ++i)
+	{
+		EXPECT_EQ(i + 1, order[i]);
+	}
+	size_t rounds = 1;
+	while (resume_batch(pointers.data(), pointers.size()))
+	{
+		++rounds;
+	}
+	EXPECT_EQ(9u, rounds);
+	EXPECT_EQ(45u, order.size());
+	EXPECT_EQ(0u, resume_batch(pointers.data(), pointers.size()));
+}
+
+#ifdef CORO_RUN_BENCHMARKS
+#include "benchmark.h"
+#include <iostream>
+
+TEST(benchmark, batch_resume)
+{
+	using namespace coro;
+	static const size_t NUM_COROUTINES = 16 * 1024;
+	std::vector<std::unique_ptr<coroutine<void ()> > > coroutines;
+	std::vector<coroutine<void ()> *> pointers;
+	for (size_t i = 0; i < NUM_COROUTINES; ++i)
+	{
+		coroutines.emplace_back(new coroutine<void ()>([](coroutine<void ()>::self & self)
+		{
+			for (;;) self.yield();
+		}, 16 * 1024));
+		pointers.push_back(coroutines.back().get());
+	}
+	double loop = run_benchmark("resume 16k coroutines in a loop", 100, [&pointers]
+	{
+		for (coroutine<void ()> * c : pointers)
+		{
+			(*c)();
+		}
+	});
+	double batch = run_benchmark("resume 16k coroutines with resume_batch", 100, [&pointers]
+	{
+		resume_batch(pointers.data(), pointers.size());
+	});
+	std::cout << "switches per second in a loop: " << NUM_COROUTINES * 1e9 / loop << std::endl;
+	std::cout << "switches per second with resume_batch: " << NUM_COROUTINES * 1e9 / batch << std::endl;
+}
+#endif
+#endif
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "coroutine.h"
+#include <cstddef>
+
+namespace coro
+{
+/**
+ * resumes every coroutine that hasn't finished yet once, in order, and
+ * returns how many of them are still running afterwards. this is faster
+ * than a plain loop when there are so many coroutines that they don't fit
+ * in the cache: while one coroutine runs, the memory that is needed to
+ * switch into the next ones is prefetched. the coroutines have to take no
+ * arguments. if one of them throws, the exception is passed on and the
+ * coroutines after it are not resumed
+ */
+template<typename Coroutine>
+size_t resume_batch(Coroutine * const * coroutines, size_t count)
+{
+	size_t still_running = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		// switching into a coroutine needs three cache lines, each found
+		// through the one before it, so prefetch in three stages
+		if (i + 3 < count) stack::prefetch(coroutines[i + 3]);
+		if (i + 2 < count) coroutines[i + 2]->prefetch_context();
+		if (i + 1 < count) coroutines[i + 1]->prefetch_saved_registers();
+		Coroutine & to_resume = *coroutines[i];
+		if (!to_resume) continue;
+		to_resume();
+		if (to_resume) ++still_running;
+	}
+	return still_running;
+}
+}
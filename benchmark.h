@@ -0,0 +1,99 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#ifdef __linux__
+#	include <linux/perf_event.h>
+#	include <sys/ioctl.h>
+#	include <sys/syscall.h>
+#	include <unistd.h>
+#	include <cstring>
+#endif
+
+namespace coro
+{
+/**
+ * runs the function the given number of times and prints how long one
+ * iteration took. returns the nanoseconds per iteration. the benchmarks
+ * are tests that only get compiled if CORO_RUN_BENCHMARKS is defined
+ */
+template<typename Func>
+double run_benchmark(const char * name, size_t iterations, Func && func)
+{
+	// warm up caches and the branch predictor
+	for (size_t i = 0; i < iterations / 10; ++i)
+	{
+		func();
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < iterations; ++i)
+	{
+		func();
+	}
+	std::chrono::duration<double, std::nano> duration = std::chrono::steady_clock::now() - start;
+	double nanoseconds = duration.count() / iterations;
+	std::cout << name << ": " << nanoseconds << " ns per iteration" << std::endl;
+	return nanoseconds;
+}
+
+/**
+ * counts the instructions that this thread retires in user space between
+ * start() and stop(). this uses perf events, so it only works on linux and
+ * only if perf events are allowed. check is_available() first
+ */
+struct instruction_counter
+{
+	instruction_counter()
+		: file_descriptor(-1)
+	{
+#ifdef __linux__
+		perf_event_attr attributes;
+		memset(&attributes, 0, sizeof(attributes));
+		attributes.type = PERF_TYPE_HARDWARE;
+		attributes.size = sizeof(attributes);
+		attributes.config = PERF_COUNT_HW_INSTRUCTIONS;
+		attributes.disabled = 1;
+		attributes.exclude_kernel = 1;
+		attributes.exclude_hv = 1;
+		file_descriptor = static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+#endif
+	}
+	~instruction_counter()
+	{
+#ifdef __linux__
+		if (file_descriptor >= 0) close(file_descriptor);
+#endif
+	}
+
+	bool is_available() const
+	{
+		return file_descriptor >= 0;
+	}
+	void start()
+	{
+#ifdef __linux__
+		ioctl(file_descriptor, PERF_EVENT_IOC_RESET, 0);
+		ioctl(file_descriptor, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+	}
+	// returns the number of instructions since start()
+	uint64_t stop()
+	{
+		uint64_t count = 0;
+#ifdef __linux__
+		ioctl(file_descriptor, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(file_descriptor, &count, sizeof(count)) != sizeof(count)) count = 0;
+#endif
+		return count;
+	}
+
+private:
+	int file_descriptor;
+
+	// intentionally not implemented
+	instruction_counter(const instruction_counter &);
+	instruction_counter & operator=(const instruction_counter &);
+};
+}
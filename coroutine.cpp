@@ -1,43 +1,134 @@
 #include "coroutine.h"
+#include <algorithm>
 #include <cassert>
+#include <new>
 #include <stdexcept>
+#include <type_traits>
+#ifdef CORO_MEASURE_STACK_USAGE
+#	include "stack_usage.h"
+#endif
+#ifdef CORO_TRACE_SWITCHES
+#	include "switch_trace.h"
+#endif
 
 namespace coro
 {
+namespace
+{
+	// the stack_context is never destroyed, it just goes away with the stack
+	static_assert(std::is_trivially_destructible<stack::stack_context>::value, "the stack_context has to be trivially destructible");
+
+	unsigned char * align_down(unsigned char * pointer)
+	{
+		static const size_t ALIGNMENT = 16;
+		return pointer - reinterpret_cast<size_t>(pointer) % ALIGNMENT;
+	}
+
+	// puts the arena at the top of the stack and the stack_context below it.
+	// the coroutine gets the rest of the stack
+	stack::stack_context * create_context_on_stack(unsigned char * stack, size_t stack_size, arena *& local_arena, void (*coroutine_call)(void *), void * initial_argument)
+	{
+		assert(stack_size > sizeof(arena) + sizeof(stack::stack_context) + 32);
+		unsigned char * arena_memory = align_down(stack + stack_size - sizeof(arena));
+		local_arena = new (arena_memory) arena(CORO_ARENA_CHUNK_SIZE);
+		unsigned char * context = align_down(arena_memory - sizeof(stack::stack_context));
+		return new (context) stack::stack_context(stack, context - stack, coroutine_call, initial_argument);
+	}
+}
+
+thread_local basic_coroutine * basic_coroutine::current_coroutine = nullptr;
+
+basic_coroutine * basic_coroutine::current()
+{
+	return current_coroutine;
+}
+
 basic_coroutine::basic_coroutine(size_t stack_size, void (*coroutine_call)(void *), void * initial_argument)
-	: stack(new unsigned char[stack_size])
+	: basic_coroutine(stack_memory(), stack_size, coroutine_call, initial_argument)
+{
+}
+basic_coroutine::basic_coroutine(stack_memory stack, size_t stack_size, void (*coroutine_call)(void *), void * initial_argument)
+	// the node is only looked up once, so that it is the node of the stack
+	// even if the thread moves to a different node in the meantime
+	: stack_numa_node(current_numa_node())
+	, stack(stack ? std::move(stack) : allocate_on_numa_node(stack_size, stack_numa_node))
 	, stack_size(stack_size)
-	, stack_context(new stack::stack_context(stack.get(), stack_size, reinterpret_cast<void (*)(void *)>(coroutine_call), initial_argument))
+	, stack_context(create_context_on_stack(this->stack.get(), stack_size, local_arena, coroutine_call, initial_argument))
+#	ifdef CORO_KEEP_FUNCTION_NAME
+		, function_name("unknown")
+		, function_address(nullptr)
+#	endif
+#	ifdef CORO_TRACE_SWITCHES
+		, run_time_ticks(0)
+		, switch_count(0)
+#	endif
 	, started(false)
 	, returned(false)
+	, cancelled(false)
 {
+	std::fill(local_slots, local_slots + CORO_LOCAL_STORAGE_SLOTS, nullptr);
 }
 basic_coroutine::basic_coroutine(basic_coroutine && other)
-	: stack(std::move(other.stack))
+	: stack_numa_node(other.stack_numa_node)
+	, stack(std::move(other.stack))
 	, stack_size(std::move(other.stack_size))
-	, stack_context(std::move(other.stack_context))
+	, stack_context(other.stack_context)
+	, local_arena(other.local_arena)
 #	ifndef CORO_NO_EXCEPTIONS
 		, exception(std::move(other.exception))
+#	endif
+#	ifdef CORO_KEEP_FUNCTION_NAME
+		, function_name(other.function_name)
+		, function_address(other.function_address)
+#	endif
+#	ifdef CORO_TRACE_SWITCHES
+		, run_time_ticks(other.run_time_ticks)
+		, switch_count(other.switch_count)
 #	endif
 	, started(std::move(other.started))
 	, returned(std::move(other.returned))
+	, cancelled(other.cancelled)
 {
 	assert(!other.is_running());
+	other.stack_context = nullptr;
+	other.local_arena = nullptr;
+	std::copy(other.local_slots, other.local_slots + CORO_LOCAL_STORAGE_SLOTS, local_slots);
 }
 basic_coroutine & basic_coroutine::operator=(basic_coroutine && other)
 {
 	assert(!other.is_running());
+	// the arena lives in the old stack
+	if (local_arena) local_arena->~arena();
 	stack = std::move(other.stack);
 	stack_size = std::move(other.stack_size);
-	stack_context = std::move(other.stack_context);
+	stack_numa_node = other.stack_numa_node;
+	stack_context = other.stack_context;
+	other.stack_context = nullptr;
+	local_arena = other.local_arena;
+	other.local_arena = nullptr;
+	std::copy(other.local_slots, other.local_slots + CORO_LOCAL_STORAGE_SLOTS, local_slots);
 #	ifndef CORO_NO_EXCEPTIONS
 		exception = std::move(other.exception);
+#	endif
+#	ifdef CORO_KEEP_FUNCTION_NAME
+		function_name = other.function_name;
+		function_address = other.function_address;
+#	endif
+#	ifdef CORO_TRACE_SWITCHES
+		run_time_ticks = other.run_time_ticks;
+		switch_count = other.switch_count;
 #	endif
 	started = std::move(other.started);
 	returned = std::move(other.returned);
+	cancelled = other.cancelled;
 	return *this;
 }
 
+basic_coroutine::~basic_coroutine()
+{
+	if (local_arena) local_arena->~arena();
+}
+
 void basic_coroutine::operator()()
 {
 #	ifdef CORO_NO_EXCEPTIONS
@@ -47,7 +138,26 @@ void basic_coroutine::operator()()
 		if (returned) throw std::runtime_error("You tried to call a coroutine that has already finished");
 #	endif
 
+#	ifdef CORO_TRACE_SWITCHES
+		detail::thread_trace_buffer & trace_buffer = detail::get_thread_trace_buffer();
+		uint64_t resume_time = trace_switch(trace_buffer, SWITCH_RESUME, this, function_name);
+#	endif
+
+	// yield() doesn't have to touch current_coroutine because the only way
+	// back into this coroutine is through this function
+	basic_coroutine * caller = current_coroutine;
+	current_coroutine = this;
 	stack_context->switch_into(); // will continue here if yielded or returned
+	current_coroutine = caller;
+
+#	ifdef CORO_TRACE_SWITCHES
+		run_time_ticks += trace_switch(trace_buffer, returned ? SWITCH_FINISH : SWITCH_YIELD, this, function_name) - resume_time;
+		++switch_count;
+#	endif
+	if (returned) local_arena->release();
+#	ifdef CORO_MEASURE_STACK_USAGE
+		if (returned) record_stack_usage(function_name, function_address, stack_context->max_stack_usage(), stack_size);
+#	endif
 
 #		ifndef CORO_NO_EXCEPTIONS
 		if (exception)
@@ -60,6 +170,38 @@ void basic_coroutine::operator()()
 void basic_coroutine::yield()
 {
 	stack_context->switch_out_of();
+#	ifndef CORO_NO_EXCEPTIONS
+		if (cancelled) throw coroutine_cancelled();
+#	endif
+}
+void basic_coroutine::cancel()
+{
+	if (returned) return;
+	cancelled = true;
+#	ifdef CORO_NO_EXCEPTIONS
+		returned = true;
+		// nothing on the stack is ever destroyed in this mode, so nothing
+		// can still use the arena
+		local_arena->release();
+#	else
+		if (!started)
+		{
+			returned = true;
+			return;
+		}
+		// the coroutine might catch the exception and yield again, in which
+		// case yield() throws again
+		while (!returned)
+		{
+			try
+			{
+				(*this)();
+			}
+			catch(const coroutine_cancelled &)
+			{
+			}
+		}
+#	endif
 }
 bool basic_coroutine::is_running() const
 {
@@ -69,10 +211,61 @@ bool basic_coroutine::has_finished() const
 {
 	return returned;
 }
+void basic_coroutine::reinitialize(void (*coroutine_call)(void *), void * initial_argument)
+{
+#	ifdef CORO_NO_EXCEPTIONS
+		assert(current_coroutine != this);
+#	else
+		if (current_coroutine == this) throw std::logic_error("You tried to reset a coroutine from inside of itself");
+#	endif
+	if (!stack)
+	{
+		// this coroutine was moved from
+		stack_numa_node = current_numa_node();
+		stack = allocate_on_numa_node(stack_size, stack_numa_node);
+		stack_context = create_context_on_stack(stack.get(), stack_size, local_arena, coroutine_call, initial_argument);
+	}
+	else
+	{
+		stack_context->reset(stack.get(), reinterpret_cast<unsigned char *>(stack_context) - stack.get(), coroutine_call, initial_argument);
+		local_arena->release();
+	}
+	std::fill(local_slots, local_slots + CORO_LOCAL_STORAGE_SLOTS, nullptr);
+#	ifndef CORO_NO_EXCEPTIONS
+		exception = nullptr;
+#	endif
+#	ifdef CORO_TRACE_SWITCHES
+		run_time_ticks = 0;
+		switch_count = 0;
+#	endif
+	started = false;
+	returned = false;
+	cancelled = false;
+}
+size_t basic_coroutine::numa_node() const
+{
+	return stack_numa_node;
+}
 basic_coroutine::operator bool() const
 {
 	return !has_finished() && stack;
 }
+#ifdef CORO_MEASURE_STACK_USAGE
+size_t basic_coroutine::max_stack_usage() const
+{
+	return stack_context->max_stack_usage();
+}
+#endif
+#ifdef CORO_TRACE_SWITCHES
+uint64_t basic_coroutine::run_time() const
+{
+	return run_time_ticks;
+}
+uint64_t basic_coroutine::num_switches() const
+{
+	return switch_count;
+}
+#endif
 
 
 }
@@ -80,6 +273,8 @@ basic_coroutine::operator bool() const
 
 #ifndef DISABLE_GTEST
 #include <gtest/gtest.h>
+#include <cstdlib>
+#include <thread>
 
 TEST(coroutine, simple)
 {
@@ -338,4 +533,268 @@ TEST(coroutine, exception)
 }
 #endif
 
+TEST(coroutine, local)
+{
+	using namespace coro;
+	typedef coroutine_local<int, 0> request_id;
+	EXPECT_EQ(nullptr, basic_coroutine::current());
+	EXPECT_EQ(nullptr, request_id::get());
+	coroutine<void (int *)> outer([](coroutine<void (int *)>::self & self, int * id)
+	{
+		EXPECT_EQ(&self, basic_coroutine::current());
+		EXPECT_EQ(nullptr, request_id::get());
+		request_id::set(id);
+		coroutine<void ()> inner([](coroutine<void ()>::self & self)
+		{
+			EXPECT_EQ(nullptr, request_id::get());
+			int inner_id = 2;
+			request_id::set(&inner_id);
+			self.yield();
+			EXPECT_EQ(2, *request_id::get());
+		});
+		inner();
+		EXPECT_EQ(&self, basic_coroutine::current());
+		EXPECT_EQ(1, *request_id::get());
+		self.yield();
+		inner();
+		EXPECT_EQ(1, *request_id::get());
+	});
+	int id = 1;
+	outer(&id);
+	EXPECT_EQ(nullptr, basic_coroutine::current());
+	EXPECT_EQ(nullptr, request_id::get());
+	outer(nullptr);
+	EXPECT_FALSE(outer);
+	EXPECT_EQ(nullptr, basic_coroutine::current());
+}
+
+TEST(coroutine, local_on_other_thread)
+{
+	using namespace coro;
+	typedef coroutine_local<int, 0> request_id;
+	int id = 3;
+	coroutine<void ()> moves([&id](coroutine<void ()>::self & self)
+	{
+		request_id::set(&id);
+		for (int i = 0; i < 3; ++i)
+		{
+			self.yield();
+			// resumed on a different thread each time
+			EXPECT_EQ(&self, basic_coroutine::current());
+			EXPECT_EQ(&id, request_id::get());
+		}
+	});
+	while (moves)
+	{
+		std::thread([&moves]
+		{
+			moves();
+			EXPECT_EQ(nullptr, basic_coroutine::current());
+		}).join();
+	}
+}
+
+TEST(coroutine, reset)
+{
+	using namespace coro;
+	const void * first_stack = nullptr;
+	coroutine<int (int)> worker([&first_stack](coroutine<int (int)>::self &, int i)
+	{
+		int on_stack = i;
+		first_stack = &on_stack;
+		return on_stack;
+	});
+	EXPECT_EQ(1, worker(1));
+	EXPECT_FALSE(worker);
+	for (int job = 0; job < 3; ++job)
+	{
+		const void * stack = nullptr;
+		worker = [&stack](coroutine<int (int)>::self & self, int i)
+		{
+			int on_stack = i;
+			stack = &on_stack;
+			return std::get<0>(self.yield(on_stack)) * 2;
+		};
+		EXPECT_TRUE(worker);
+		EXPECT_EQ(job, worker(job));
+		// the frames of the two functions differ a little, but they are on
+		// the same stack
+		EXPECT_GT(1024, std::abs(static_cast<const char *>(stack) - static_cast<const char *>(first_stack)));
+		if (job == 1) continue; // reset while suspended
+		EXPECT_EQ(10, worker(5));
+		EXPECT_FALSE(worker);
+	}
+}
+
+#ifndef CORO_NO_EXCEPTIONS
+TEST(coroutine, reset_from_inside)
+{
+	using namespace coro;
+	bool thrown = false;
+	coroutine<void ()> resets_itself([&thrown](coroutine<void ()>::self & self)
+	{
+		try
+		{
+			self.reset([](coroutine<void ()>::self &){});
+		}
+		catch(const std::logic_error &)
+		{
+			thrown = true;
+		}
+	});
+	resets_itself();
+	EXPECT_TRUE(thrown);
+	EXPECT_FALSE(resets_itself);
+}
+#endif
+
+TEST(coroutine, static_coroutine)
+{
+	using namespace coro;
+	typedef static_coroutine<int (int), 8 * 1024> connection;
+	static const size_t NUM_CONNECTIONS = 1000;
+	// reserved once, the coroutines are constructed into it
+	std::unique_ptr<typename std::aligned_storage<sizeof(connection), alignof(connection)>::type[]> memory(new typename std::aligned_storage<sizeof(connection), alignof(connection)>::type[NUM_CONNECTIONS]);
+	connection * connections = reinterpret_cast<connection *>(memory.get());
+	for (size_t i = 0; i < NUM_CONNECTIONS; ++i)
+	{
+		new (connections + i) connection([](connection::self & self, int i)
+		{
+			int on_stack = i;
+			i = std::get<0>(self.yield(on_stack));
+			return i + on_stack;
+		});
+	}
+	for (size_t i = 0; i < NUM_CONNECTIONS; ++i)
+	{
+		EXPECT_EQ(int(i), connections[i](int(i)));
+	}
+	for (size_t i = 0; i < NUM_CONNECTIONS; ++i)
+	{
+		EXPECT_EQ(int(i) * 2, connections[i](int(i)));
+		EXPECT_FALSE(connections[i]);
+	}
+	// the stack is inside of the object
+	const char * stack = nullptr;
+	connections[0] = [&stack](connection::self &, int i)
+	{
+		int on_stack = i;
+		stack = reinterpret_cast<const char *>(&on_stack);
+		return on_stack;
+	};
+	EXPECT_EQ(3, connections[0](3));
+	EXPECT_LE(reinterpret_cast<const char *>(connections), stack);
+	EXPECT_GT(reinterpret_cast<const char *>(connections + 1), stack);
+	for (size_t i = 0; i < NUM_CONNECTIONS; ++i)
+	{
+		connections[i].~connection();
+	}
+}
+
+TEST(coroutine, cancel)
+{
+	using namespace coro;
+	struct count_destruction
+	{
+		~count_destruction()
+		{
+			++destroyed;
+		}
+		int & destroyed;
+	};
+	int destroyed = 0;
+	bool after_yield = false;
+	coroutine<int ()> to_cancel([&](coroutine<int ()>::self & self)
+	{
+		count_destruction on_stack = { destroyed };
+		self.yield(1);
+		after_yield = true;
+		return 2;
+	});
+	EXPECT_EQ(1, to_cancel());
+	to_cancel.cancel();
+	EXPECT_FALSE(to_cancel);
+	EXPECT_FALSE(after_yield);
+#	ifndef CORO_NO_EXCEPTIONS
+		EXPECT_EQ(1, destroyed);
+#	endif
+
+	coroutine<void ()> not_started([&after_yield](coroutine<void ()>::self &)
+	{
+		after_yield = true;
+	});
+	not_started.cancel();
+	EXPECT_FALSE(not_started);
+	EXPECT_FALSE(after_yield);
+}
+
+TEST(coroutine, arena)
+{
+	using namespace coro;
+	EXPECT_EQ(nullptr, current_arena());
+	typedef std::basic_string<char, std::char_traits<char>, arena_allocator<char> > arena_string;
+	size_t allocated = 0;
+	coroutine<void ()> uses_arena([&allocated](coroutine<void ()>::self & self)
+	{
+		std::vector<arena_string, arena_allocator<arena_string> > strings(coroutine_allocator<arena_string>());
+		for (int i = 0; i < 10; ++i)
+		{
+			strings.emplace_back("a string that is too long for the small string optimization", coroutine_allocator<char>());
+		}
+		allocated = current_arena()->bytes_allocated();
+		self.yield();
+	});
+	uses_arena();
+	EXPECT_LT(10u * 60, allocated);
+	EXPECT_EQ(allocated, uses_arena.get_arena().bytes_allocated());
+	uses_arena();
+	EXPECT_FALSE(uses_arena);
+	EXPECT_EQ(0u, uses_arena.get_arena().bytes_allocated());
+
+	uses_arena.reset([](coroutine<void ()>::self &)
+	{
+		EXPECT_EQ(0u, current_arena()->bytes_allocated());
+		current_arena()->allocate(16, 16);
+	});
+	uses_arena();
+	EXPECT_EQ(0u, uses_arena.get_arena().bytes_allocated());
+}
+
+TEST(coroutine, arena_released_on_cancel)
+{
+	using namespace coro;
+	coroutine<void ()> uses_arena([](coroutine<void ()>::self & self)
+	{
+		std::vector<int, arena_allocator<int> > values(100, 5, coroutine_allocator<int>());
+		self.yield();
+	});
+	uses_arena();
+	EXPECT_LT(0u, uses_arena.get_arena().bytes_allocated());
+	uses_arena.cancel();
+	EXPECT_FALSE(uses_arena);
+	EXPECT_EQ(0u, uses_arena.get_arena().bytes_allocated());
+}
+
+#ifdef CORO_RUN_BENCHMARKS
+#include "benchmark.h"
+
+TEST(benchmark, coroutine_reset)
+{
+	using namespace coro;
+	int sum = 0;
+	run_benchmark("create a new coroutine per job", 100000, [&sum]
+	{
+		coroutine<void ()> job([&sum](coroutine<void ()>::self &){ ++sum; });
+		job();
+	});
+	coroutine<void ()> worker([](coroutine<void ()>::self &){});
+	run_benchmark("reset one coroutine per job", 100000, [&sum, &worker]
+	{
+		worker.reset([&sum](coroutine<void ()>::self &){ ++sum; });
+		worker();
+	});
+	EXPECT_LT(0, sum);
+}
+#endif
+
 #endif
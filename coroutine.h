@@ -1,6 +1,10 @@
 #pragma once
 
 #include "stack_swap.h"
+#include "arena.h"
+#include "numa.h"
+#include "stack_arena.h"
+#include <cassert>
 #include <tuple>
 #include <functional>
 #include <memory>
@@ -11,9 +15,31 @@
 #ifndef CORO_DEFAULT_STACK_SIZE
 #define CORO_DEFAULT_STACK_SIZE 64 * 1024
 #endif
+#ifndef CORO_LOCAL_STORAGE_SLOTS
+#define CORO_LOCAL_STORAGE_SLOTS 8
+#endif
+#ifndef CORO_ARENA_CHUNK_SIZE
+#define CORO_ARENA_CHUNK_SIZE 4096
+#endif
+
+#if defined(CORO_MEASURE_STACK_USAGE) || defined(CORO_TRACE_SWITCHES)
+#	define CORO_KEEP_FUNCTION_NAME
+#endif
+#ifdef CORO_TRACE_SWITCHES
+#	include <cstdint>
+#endif
 
 namespace coro
 {
+#ifndef CORO_NO_EXCEPTIONS
+// thrown out of yield() in a coroutine that is being cancelled. this
+// intentionally doesn't derive from std::exception, so that it doesn't get
+// caught by accident. if you catch it anyway, rethrow it
+struct coroutine_cancelled
+{
+};
+#endif
+
 /**
  * the basic_coroutine is a minimal implementation of a coroutine. it is used
  * by the coroutine class below, and I recommend that you use that one instead
@@ -21,28 +47,161 @@ namespace coro
 struct basic_coroutine
 {
 	basic_coroutine(size_t stack_size, void (*coroutine_call)(void *), void * initial_argument);
+	// runs on the given stack, for example one from a stack_arena. if the
+	// stack is empty, one is allocated on the NUMA node of the calling thread
+	basic_coroutine(stack_memory stack, size_t stack_size, void (*coroutine_call)(void *), void * initial_argument);
 	// use this only to create from a coroutine that's not already running
 	basic_coroutine(basic_coroutine && other);
 	// use this only to assign to or from a coroutine that's not already running
 	basic_coroutine & operator=(basic_coroutine && other);
+	~basic_coroutine();
 
 	bool is_running() const;
 	bool has_finished() const;
+	// the NUMA node of the thread that created the coroutine. unless the
+	// stack came from somewhere else, it was placed on this node. a scheduler should prefer to resume
+	// the coroutine on a thread of this node. see numa.h
+	size_t numa_node() const;
 	// will return true if you can call this coroutine
 	operator bool() const;
 
 	void operator()();
 	void yield();
+	// finishes the coroutine without running it to the end. the coroutine is
+	// resumed one more time and yield() throws coroutine_cancelled, so that
+	// the objects on its stack get destroyed. if CORO_NO_EXCEPTIONS is
+	// defined, the coroutine is just marked as finished and the objects on
+	// its stack are never destroyed
+	void cancel();
+
+	// used by resume_batch in batch_resume.h. the context is in a different
+	// cache line than the coroutine, and the saved registers are in yet
+	// another one. each of these needs the one before it to be in the cache
+	void prefetch_context() const
+	{
+		if (stack_context) stack::prefetch(stack_context);
+	}
+	void prefetch_saved_registers() const
+	{
+		if (stack_context) stack_context->prefetch_saved_registers();
+	}
+
+	// the coroutine that is currently running on this thread, or nullptr
+	// if this thread is not inside of a coroutine. a coroutine can be
+	// resumed on a different thread after it yielded, so this must not be
+	// inlined. otherwise the compiler could keep using the address of the
+	// thread_local variable of the thread that the coroutine ran on before
+	CORO_NO_INSTRUMENT CORO_NO_INLINE static basic_coroutine * current();
+	// for allocations that only live as long as the coroutine runs. the
+	// arena is released when the coroutine returns, and its last chunk is
+	// kept for when the coroutine is reset. use current_arena() and
+	// coroutine_allocator() below to get at it from inside the coroutine
+	arena & get_arena()
+	{
+		return *local_arena;
+	}
+	// storage for pointers that is local to this coroutine. all slots start
+	// off as nullptr. use coroutine_local below instead of this
+	void * & local_slot(size_t index)
+	{
+		return local_slots[index];
+	}
+
+#	ifdef CORO_MEASURE_STACK_USAGE
+		// the most stack that this coroutine has used so far. when the
+		// coroutine finishes, this is also recorded in the stack usage
+		// histograms. see stack_usage.h
+		size_t max_stack_usage() const;
+#	endif
+#	ifdef CORO_TRACE_SWITCHES
+		// the time stamp counter ticks spent inside of this coroutine,
+		// including any coroutines that were called from it. see switch_trace.h
+		uint64_t run_time() const;
+		// the number of times that this coroutine was resumed
+		uint64_t num_switches() const;
+#	endif
 
 protected:
-	std::unique_ptr<unsigned char[]> stack;
+	// before the stack, because the stack is allocated on this node
+	size_t stack_numa_node;
+	stack_memory stack;
 	size_t stack_size;
-	std::unique_ptr<stack::stack_context> stack_context;
+	// lives at the top of the stack memory, so that creating a coroutine
+	// doesn't need a separate allocation for it
+	stack::stack_context * stack_context;
+	// lives above the stack_context
+	arena * local_arena;
+	void * local_slots[CORO_LOCAL_STORAGE_SLOTS];
 #	ifndef CORO_NO_EXCEPTIONS
 		std::exception_ptr exception;
+#	endif
+#	ifdef CORO_KEEP_FUNCTION_NAME
+		// the type name of the function that this coroutine runs. used
+		// to group stack usage and to label traces
+		const char * function_name;
+		// all plain function pointers have the same type name, so for
+		// those this is the address of the function. nullptr otherwise
+		const void * function_address;
+#	endif
+#	ifdef CORO_TRACE_SWITCHES
+		uint64_t run_time_ticks;
+		uint64_t switch_count;
 #	endif
 	bool started;
 	bool returned;
+	bool cancelled;
+
+	// makes this coroutine start over with a new function, on the same
+	// stack. nothing is allocated. if the coroutine was suspended, the
+	// objects on its stack are not destroyed. must not be called from
+	// inside of this coroutine
+	void reinitialize(void (*coroutine_call)(void *), void * initial_argument);
+
+private:
+	// set by operator() for as long as this coroutine runs
+	static thread_local basic_coroutine * current_coroutine;
+};
+
+// the arena of the coroutine that is running on this thread, or nullptr if
+// this thread is not inside of a coroutine
+inline arena * current_arena()
+{
+	basic_coroutine * current = basic_coroutine::current();
+	return current ? &current->get_arena() : nullptr;
+}
+// an allocator for standard containers that allocates from the arena of
+// the running coroutine. outside of a coroutine it uses the heap. don't
+// let anything that uses it outlive the coroutine
+template<typename T>
+arena_allocator<T> coroutine_allocator()
+{
+	return arena_allocator<T>(current_arena());
+}
+
+/**
+ * a coroutine_local is like a thread_local variable, except that every
+ * coroutine gets its own value. the slot index is chosen at compile time
+ * so that a lookup is only a call to basic_coroutine::current() and a
+ * load of the slot. the value is a pointer to an object that the coroutine owns,
+ * for example a tracing id on the coroutine's stack. using the same slot
+ * for two different purposes is an error. outside of a coroutine get()
+ * returns nullptr and set() must not be called
+ */
+template<typename T, size_t Slot>
+struct coroutine_local
+{
+	static_assert(Slot < CORO_LOCAL_STORAGE_SLOTS, "increase CORO_LOCAL_STORAGE_SLOTS");
+
+	static T * get()
+	{
+		basic_coroutine * current = basic_coroutine::current();
+		return current ? static_cast<T *>(current->local_slot(Slot)) : nullptr;
+	}
+	static void set(T * value)
+	{
+		assert(basic_coroutine::current());
+		basic_coroutine::current()->local_slot(Slot) = value;
+	}
 };
 namespace detail
 {
@@ -184,8 +343,8 @@ namespace detail
 		}
 
 	protected:
-		coroutine_yielder_base(size_t stack_size, void (*coroutine_call)(void *), void * initial_argument)
-			: basic_coroutine(stack_size, coroutine_call, initial_argument)
+		coroutine_yielder_base(stack_memory stack, size_t stack_size, void (*coroutine_call)(void *), void * initial_argument)
+			: basic_coroutine(std::move(stack), stack_size, coroutine_call, initial_argument)
 		{
 		}
 		coroutine_yielder_base & operator=(coroutine_yielder_base && other)
@@ -208,8 +367,8 @@ namespace detail
 	struct coroutine_yielder
 		: coroutine_yielder_base<Result, Arguments...>
 	{
-		coroutine_yielder(size_t stack_size, void (*coroutine_call)(void *), void * initial_argument)
-			: coroutine_yielder_base<Result, Arguments...>(stack_size, coroutine_call, initial_argument)
+		coroutine_yielder(stack_memory stack, size_t stack_size, void (*coroutine_call)(void *), void * initial_argument)
+			: coroutine_yielder_base<Result, Arguments...>(std::move(stack), stack_size, coroutine_call, initial_argument)
 		{
 		}
 		coroutine_yielder & operator=(coroutine_yielder && other)
@@ -228,8 +387,8 @@ namespace detail
 	struct coroutine_yielder<void, Arguments...>
 		: coroutine_yielder_base<void, Arguments...>
 	{
-		coroutine_yielder(size_t stack_size, void (*coroutine_call)(void *), void * initial_argument)
-			: coroutine_yielder_base<void, Arguments...>(stack_size, coroutine_call, initial_argument)
+		coroutine_yielder(stack_memory stack, size_t stack_size, void (*coroutine_call)(void *), void * initial_argument)
+			: coroutine_yielder_base<void, Arguments...>(std::move(stack), stack_size, coroutine_call, initial_argument)
 		{
 		}
 		coroutine_yielder & operator=(coroutine_yielder && other)
@@ -282,19 +441,37 @@ namespace detail
 		}
 
 	protected:
-		coroutine_preparer(std::function<Result (Self &, Arguments...)> func, size_t stack_size, Self * self)
-			: Super(stack_size, reinterpret_cast<void (*)(void *)>(&Returner::coroutine_start), self), func(std::move(func))
+		coroutine_preparer(std::function<Result (Self &, Arguments...)> func, stack_memory stack, size_t stack_size, Self * self)
+			: Super(std::move(stack), stack_size, reinterpret_cast<void (*)(void *)>(&Returner::coroutine_start), self), func(std::move(func))
 		{
+#			ifdef CORO_KEEP_FUNCTION_NAME
+				remember_function();
+#			endif
 		}
-		void recreate(std::function<Result (Self &, Arguments...)> func, size_t stack_size, Self * self)
+		void recreate(std::function<Result (Self &, Arguments...)> func, Self * self)
 		{
-			Super::operator=(Super(stack_size, reinterpret_cast<void (*)(void *)>(&Returner::coroutine_start), self));
+			this->reinitialize(reinterpret_cast<void (*)(void *)>(&Returner::coroutine_start), self);
+			this->result = any_storage<Result>();
+			this->arguments = std::tuple<any_storage<Arguments>...>();
 			this->func = std::move(func);
+#			ifdef CORO_KEEP_FUNCTION_NAME
+				remember_function();
+#			endif
 		}
 
 	private:
 		std::function<Result (Self &, Arguments...)> func;
 
+#		ifdef CORO_KEEP_FUNCTION_NAME
+			void remember_function()
+			{
+				typedef Result (* function_pointer)(Self &, Arguments...);
+				this->function_name = func.target_type().name();
+				const function_pointer * pointer = func.template target<function_pointer>();
+				this->function_address = pointer ? reinterpret_cast<const void *>(*pointer) : nullptr;
+			}
+#		endif
+
 		/**
 		 * The caller calls the provided std::function. it is responsible for
 		 * unrolling the arguments tuple. it is being called by the returner
@@ -395,14 +572,32 @@ private:
 public:
 
 	coroutine(std::function<Result (self &, Arguments...)> func, size_t stack_size = CORO_DEFAULT_STACK_SIZE)
-		: Super(std::move(func), stack_size, this)
+		: Super(std::move(func), stack_memory(), stack_size, this)
+	{
+	}
+	// takes a stack from the arena. the arena has to outlive the coroutine
+	coroutine(std::function<Result (self &, Arguments...)> func, stack_arena & arena)
+		: Super(std::move(func), arena.allocate(), arena.stack_size(), this)
 	{
 	}
+	// runs on the given memory. see unowned_stack_memory() in stack_memory.h
+	// for memory that the coroutine shouldn't free
+	coroutine(std::function<Result (self &, Arguments...)> func, stack_memory stack, size_t stack_size)
+		: Super(std::move(func), std::move(stack), stack_size, this)
+	{
+	}
+	// same as reset()
 	coroutine & operator=(std::function<Result (self &, Arguments...)> func)
 	{
-		Super::recreate(std::move(func), this->stack_size, this);
+		reset(std::move(func));
 		return *this;
 	}
+	// runs the new function from the start, reusing the stack. this doesn't
+	// allocate, unless std::function has to allocate to store func
+	void reset(std::function<Result (self &, Arguments...)> func)
+	{
+		Super::recreate(std::move(func), this);
+	}
 
 private:
 	// intentionally not implemented
@@ -410,4 +605,44 @@ private:
 	coroutine & operator=(const coroutine &);
 };
 
+namespace detail
+{
+	template<size_t StackBytes>
+	struct inline_stack
+	{
+		// the context and the arena live at the top of the stack, and
+		// starting the coroutine needs a few frames below them
+		static_assert(StackBytes >= sizeof(stack::stack_context) + sizeof(arena) + 1024, "the stack is too small for the context switch and the coroutine start");
+		alignas(16) unsigned char stack_bytes[StackBytes];
+	};
+}
+
+/**
+ * a coroutine that has its stack inside of the object, so creating one
+ * doesn't allocate from the heap, unless the std::function has to. the
+ * stack is inside of the object, so it can't be copied or moved. to keep
+ * many of them next to each other, construct them in place, for example in
+ * a std::deque or with placement new into reserved memory
+ */
+template<typename Signature, size_t StackBytes = 16 * 1024>
+struct static_coroutine;
+
+template<typename Result, typename... Arguments, size_t StackBytes>
+struct static_coroutine<Result (Arguments...), StackBytes>
+	: private detail::inline_stack<StackBytes>
+	, public coroutine<Result (Arguments...)>
+{
+	// the coroutine is constructed after the inline_stack base, so the
+	// stack exists by the time that it is used
+	explicit static_coroutine(std::function<Result (typename coroutine<Result (Arguments...)>::self &, Arguments...)> func)
+		: coroutine<Result (Arguments...)>(std::move(func), unowned_stack_memory(this->stack_bytes, StackBytes), StackBytes)
+	{
+	}
+	static_coroutine & operator=(std::function<Result (typename coroutine<Result (Arguments...)>::self &, Arguments...)> func)
+	{
+		this->reset(std::move(func));
+		return *this;
+	}
+};
+
 }
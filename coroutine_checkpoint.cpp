@@ -0,0 +1,489 @@
+#include "coroutine_checkpoint.h"
+#include <cassert>
+#include <cstddef>
+#include <ostream>
+#include <utility>
+
+namespace
+{
+	struct CapturedState
+	{
+		uint64_t checkpoint_id;
+		unsigned version;
+		size_t num_values;
+	};
+	struct CapturedValue
+	{
+		const char * name;
+		const char * type_tag;
+		void (* store)(std::ostream &, const void *);
+		const CoroutineState::CreatedValue::CaptureInfo * capture;
+	};
+
+	static const size_t STATE_ALIGNMENT = std::alignment_of<std::max_align_t>::value;
+
+	size_t Align(size_t offset, size_t alignment)
+	{
+		return (offset + alignment - 1) / alignment * alignment;
+	}
+	// returns the offset of the value and advances offset past it
+	size_t AdvancePastValue(size_t & offset, const CoroutineState::CreatedValue::CaptureInfo & capture)
+	{
+		offset = Align(offset, std::alignment_of<CapturedValue>::value) + sizeof(CapturedValue);
+		size_t value_offset = Align(offset, capture.alignment);
+		offset = value_offset + capture.size;
+		return value_offset;
+	}
+}
+
+CoroutineCheckpointer::CoroutineCheckpointer(Sink sink, size_t buffer_size)
+	: sink(std::move(sink))
+	, buffer_size(buffer_size)
+	, capturing(CreateBuffer(buffer_size))
+	, num_handed_off(0)
+	, num_written(0)
+	, stopping(false)
+{
+	free_buffers.push_back(CreateBuffer(buffer_size));
+	writer = std::thread([this]{ WriterThread(); });
+}
+CoroutineCheckpointer::~CoroutineCheckpointer()
+{
+#	ifndef CORO_NO_EXCEPTIONS
+		try
+		{
+			Flush();
+		}
+		catch(...)
+		{
+		}
+#	else
+		Flush();
+#	endif
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	condition.notify_all();
+	writer.join();
+}
+
+void CoroutineCheckpointer::Capture(const CoroutineState & state, uint64_t checkpoint_id)
+{
+	size_t size = sizeof(CapturedState);
+	size_t num_values = 0;
+	for (const CoroutineState::CreatedValue * value = state.created_values_head; value; value = value->next, ++num_values)
+	{
+		assert(value->capture->alignment <= STATE_ALIGNMENT);
+		AdvancePastValue(size, *value->capture);
+	}
+
+	std::unique_lock<std::mutex> capture_lock(capture_mutex);
+	Buffer * buffer = &capturing;
+	size_t begin = Align(buffer->size, STATE_ALIGNMENT);
+	if (begin + size > buffer->capacity && buffer->size)
+	{
+		HandOff(capture_lock);
+		begin = 0;
+	}
+	if (size > buffer->capacity)
+	{
+		// the buffer is empty so there are no values in it that would need to be moved
+		buffer->memory.reset(new unsigned char[size]);
+		buffer->capacity = size;
+	}
+
+	unsigned char * memory = buffer->memory.get() + begin;
+	CapturedState captured = { checkpoint_id, state.version, num_values };
+	new (memory) CapturedState(captured);
+	size_t offset = sizeof(CapturedState);
+#	ifndef CORO_NO_EXCEPTIONS
+		size_t num_copied = 0;
+		try
+		{
+#	endif
+			for (const CoroutineState::CreatedValue * value = state.created_values_head; value; value = value->next)
+			{
+				size_t header_offset = Align(offset, std::alignment_of<CapturedValue>::value);
+				size_t value_offset = AdvancePastValue(offset, *value->capture);
+				CapturedValue header = { value->name, value->type_tag, value->store, value->capture };
+				new (memory + header_offset) CapturedValue(header);
+				value->capture->copy(memory + value_offset, value->value);
+#				ifndef CORO_NO_EXCEPTIONS
+					++num_copied;
+#				endif
+			}
+#	ifndef CORO_NO_EXCEPTIONS
+		}
+		catch(...)
+		{
+			// the state doesn't end up in the buffer, so nobody else would
+			// destroy the values that were already copied
+			offset = sizeof(CapturedState);
+			const CoroutineState::CreatedValue * value = state.created_values_head;
+			for (size_t i = 0; i < num_copied; ++i, value = value->next)
+			{
+				value->capture->destroy(memory + AdvancePastValue(offset, *value->capture));
+			}
+			throw;
+		}
+#	endif
+	buffer->size = begin + size;
+}
+
+void CoroutineCheckpointer::Flush()
+{
+	std::unique_lock<std::mutex> capture_lock(capture_mutex);
+	if (capturing.size) HandOff(capture_lock);
+	std::unique_lock<std::mutex> lock(mutex);
+	uint64_t wait_for = num_handed_off;
+	// Capture() can continue while the sink runs
+	capture_lock.unlock();
+	condition.wait(lock, [this, wait_for]{ return num_written >= wait_for; });
+#	ifndef CORO_NO_EXCEPTIONS
+		if (exception) std::rethrow_exception(std::exchange(exception, nullptr));
+#	endif
+}
+
+void CoroutineCheckpointer::HandOff(std::unique_lock<std::mutex> & capture_lock)
+{
+	assert(capture_lock.owns_lock()); static_cast<void>(capture_lock);
+	Buffer next;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		to_write.push_back(std::move(capturing));
+		++num_handed_off;
+		if (!free_buffers.empty())
+		{
+			next = std::move(free_buffers.back());
+			free_buffers.pop_back();
+		}
+	}
+	condition.notify_all();
+	// only allocates if the background thread has fallen behind
+	capturing = next.memory ? std::move(next) : CreateBuffer(buffer_size);
+}
+
+void CoroutineCheckpointer::WriterThread()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;)
+	{
+		condition.wait(lock, [this]{ return !to_write.empty() || stopping; });
+		if (to_write.empty()) return;
+		Buffer buffer = std::move(to_write.front());
+		to_write.pop_front();
+		lock.unlock();
+		Write(buffer);
+		lock.lock();
+		++num_written;
+		free_buffers.push_back(std::move(buffer));
+		condition.notify_all();
+	}
+}
+
+#ifndef CORO_NO_EXCEPTIONS
+void CoroutineCheckpointer::KeepException()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!exception) exception = std::current_exception();
+}
+#endif
+
+CoroutineCheckpointer::Buffer CoroutineCheckpointer::CreateBuffer(size_t capacity)
+{
+	Buffer buffer;
+	buffer.memory.reset(new unsigned char[capacity]);
+	buffer.capacity = capacity;
+	buffer.size = 0;
+	return buffer;
+}
+
+void CoroutineCheckpointer::Write(Buffer & buffer)
+{
+	// this runs on the background thread, so the allocations of the
+	// stream and of the string for the sink don't slow down Capture()
+	std::ostringstream stored;
+	for (size_t offset = 0; offset < buffer.size;)
+	{
+		offset = Align(offset, STATE_ALIGNMENT);
+		unsigned char * memory = buffer.memory.get() + offset;
+		const CapturedState & state = *reinterpret_cast<const CapturedState *>(memory);
+		stored.str(std::string());
+		if (state.version) CoroutineState::WriteVersionHeader(stored, state.version);
+		size_t state_offset = sizeof(CapturedState);
+#		ifndef CORO_NO_EXCEPTIONS
+			// after an exception the remaining values of the state are only
+			// destroyed, and the state isn't passed to the sink
+			bool failed = false;
+#		endif
+		for (size_t i = 0; i < state.num_values; ++i)
+		{
+			const CapturedValue & value = *reinterpret_cast<const CapturedValue *>(memory + Align(state_offset, std::alignment_of<CapturedValue>::value));
+			void * value_memory = memory + AdvancePastValue(state_offset, *value.capture);
+#			ifndef CORO_NO_EXCEPTIONS
+			if (!failed)
+			{
+				try
+				{
+#			endif
+					stored << value.name;
+					if (state.version && value.type_tag) stored << ':' << value.type_tag;
+					CoroutineState::CreatedValue::WriteSeparator(stored);
+					value.store(stored, value_memory);
+#			ifndef CORO_NO_EXCEPTIONS
+				}
+				catch(...)
+				{
+					failed = true;
+					KeepException();
+				}
+			}
+#			endif
+			value.capture->destroy(value_memory);
+		}
+#		ifndef CORO_NO_EXCEPTIONS
+		if (!failed)
+		{
+			try
+			{
+#		endif
+				sink(state.checkpoint_id, stored.str());
+#		ifndef CORO_NO_EXCEPTIONS
+			}
+			catch(...)
+			{
+				KeepException();
+			}
+		}
+#		endif
+		offset += state_offset;
+	}
+	buffer.size = 0;
+}
+
+
+#ifndef DISABLE_GTEST
+#include <gtest/gtest.h>
+#include "coroutine.h"
+#include <map>
+
+TEST(coroutine_checkpoint, matches_store)
+{
+	using namespace coro;
+	std::map<uint64_t, std::string> written;
+	std::stringstream expected;
+	{
+		CoroutineCheckpointer checkpointer([&written](uint64_t checkpoint_id, const std::string & stored)
+		{
+			written[checkpoint_id] = stored;
+		});
+		std::stringstream old_state;
+		CoroutineState state(old_state);
+		coroutine<int (CoroutineState &)> to_call([](coroutine<int (CoroutineState &)>::self & self, CoroutineState & state) -> int
+		{
+			CORO_SERIALIZABLE(state, int, i, 0);
+			CORO_SERIALIZABLE(state, std::string, text, "hello");
+			for (;;)
+			{
+				self.yield(++i);
+			}
+		});
+		EXPECT_EQ(1, to_call(state));
+		state.Store(expected);
+		checkpointer.Capture(state, 7);
+		// changes after the capture must not show up in the checkpoint
+		EXPECT_EQ(2, to_call(state));
+		checkpointer.Flush();
+		ASSERT_EQ(1u, written.count(7));
+		EXPECT_EQ(expected.str(), written[7]);
+		checkpointer.Capture(state, 8);
+	}
+	ASSERT_EQ(1u, written.count(8));
+	EXPECT_NE(expected.str(), written[8]);
+}
+
+TEST(coroutine_checkpoint, many_captures)
+{
+	using namespace coro;
+	std::map<uint64_t, std::string> written;
+	CoroutineStateMigrations migrations(1);
+	std::stringstream old_state;
+	CoroutineState state(old_state, migrations);
+	int value = 0;
+	auto scope = state.KeepReference("value", value);
+	{
+		// small buffer to force hand offs between the buffers
+		CoroutineCheckpointer checkpointer([&written](uint64_t checkpoint_id, const std::string & stored)
+		{
+			written[checkpoint_id] = stored;
+		}, 64);
+		for (; value < 1000; ++value)
+		{
+			checkpointer.Capture(state, value);
+		}
+	}
+	ASSERT_EQ(1000u, written.size());
+	for (int i = 0; i < 1000; ++i)
+	{
+		std::stringstream stored(written[i]);
+		CoroutineState restored(stored, migrations);
+		ASSERT_TRUE(restored.AdvanceToValue("value", CoroutineStateTypeTag<int>::tag()));
+		EXPECT_EQ(i, restored.GetNextValue<int>());
+	}
+}
+
+TEST(coroutine_checkpoint, capture_doesnt_wait_for_sink)
+{
+	std::mutex sink_mutex;
+	std::condition_variable sink_released;
+	bool is_released = false;
+	size_t num_written = 0;
+	std::stringstream old_state;
+	CoroutineState state(old_state);
+	int value = 0;
+	auto scope = state.KeepReference("value", value);
+	{
+		CoroutineCheckpointer checkpointer([&](uint64_t, const std::string &)
+		{
+			std::unique_lock<std::mutex> lock(sink_mutex);
+			sink_released.wait(lock, [&]{ return is_released; });
+			++num_written;
+		}, 64);
+		// the sink is stuck, so these fill many buffers
+		for (; value < 100; ++value)
+		{
+			checkpointer.Capture(state, value);
+		}
+		{
+			std::lock_guard<std::mutex> lock(sink_mutex);
+			is_released = true;
+		}
+		sink_released.notify_all();
+	}
+	EXPECT_EQ(100u, num_written);
+}
+
+TEST(coroutine_checkpoint, flush_doesnt_block_capture)
+{
+	std::mutex sink_mutex;
+	std::condition_variable sink_released;
+	bool is_released = false;
+	std::stringstream old_state;
+	CoroutineState state(old_state);
+	int value = 0;
+	auto scope = state.KeepReference("value", value);
+	CoroutineCheckpointer checkpointer([&](uint64_t, const std::string &)
+	{
+		std::unique_lock<std::mutex> lock(sink_mutex);
+		sink_released.wait(lock, [&]{ return is_released; });
+	});
+	checkpointer.Capture(state, 0);
+	std::thread flushing([&]{ checkpointer.Flush(); });
+	// the sink is stuck, so the Flush() above doesn't return until it is
+	// released. these captures must not wait for that
+	for (value = 1; value < 10; ++value)
+	{
+		checkpointer.Capture(state, value);
+	}
+	{
+		std::lock_guard<std::mutex> lock(sink_mutex);
+		is_released = true;
+	}
+	sink_released.notify_all();
+	flushing.join();
+}
+
+#ifndef CORO_NO_EXCEPTIONS
+TEST(coroutine_checkpoint, sink_throws)
+{
+	std::vector<uint64_t> written;
+	std::stringstream old_state;
+	CoroutineState state(old_state);
+	std::string text = "a string that is too long for the small string optimization";
+	auto scope = state.KeepReference("text", text);
+	CoroutineCheckpointer checkpointer([&written](uint64_t checkpoint_id, const std::string &)
+	{
+		if (checkpoint_id == 1) throw std::runtime_error("sink failed");
+		written.push_back(checkpoint_id);
+	});
+	for (uint64_t i = 0; i < 3; ++i)
+	{
+		checkpointer.Capture(state, i);
+	}
+	EXPECT_THROW(checkpointer.Flush(), std::runtime_error);
+	EXPECT_EQ((std::vector<uint64_t>{ 0, 2 }), written);
+	// the exception is only reported once
+	checkpointer.Capture(state, 3);
+	checkpointer.Flush();
+	EXPECT_EQ((std::vector<uint64_t>{ 0, 2, 3 }), written);
+}
+#endif
+
+#ifndef CORO_NO_EXCEPTIONS
+namespace
+{
+	struct ThrowingCopy
+	{
+		static int num_alive;
+		// the copy after this many copies throws. negative to never throw
+		static int copies_until_throw;
+
+		ThrowingCopy()
+			: text("a string that is too long for the small string optimization")
+		{
+			++num_alive;
+		}
+		ThrowingCopy(const ThrowingCopy & other)
+			: text(other.text)
+		{
+			if (copies_until_throw == 0) throw std::runtime_error("copy failed");
+			if (copies_until_throw > 0) --copies_until_throw;
+			++num_alive;
+		}
+		~ThrowingCopy()
+		{
+			--num_alive;
+		}
+
+		std::string text;
+	};
+	int ThrowingCopy::num_alive = 0;
+	int ThrowingCopy::copies_until_throw = -1;
+
+	std::ostream & operator<<(std::ostream & lhs, const ThrowingCopy & rhs)
+	{
+		return lhs << rhs.text;
+	}
+}
+
+TEST(coroutine_checkpoint, copy_throws)
+{
+	std::vector<uint64_t> written;
+	std::stringstream old_state;
+	CoroutineState state(old_state);
+	ThrowingCopy first;
+	ThrowingCopy second;
+	auto first_scope = state.KeepReference("first", first);
+	auto second_scope = state.KeepReference("second", second);
+	{
+		CoroutineCheckpointer checkpointer([&written](uint64_t checkpoint_id, const std::string &)
+		{
+			written.push_back(checkpoint_id);
+		});
+		checkpointer.Capture(state, 0);
+		// the first value was already copied when the second one throws,
+		// so the copy of the first one has to be destroyed again
+		ThrowingCopy::copies_until_throw = 1;
+		EXPECT_THROW(checkpointer.Capture(state, 1), std::runtime_error);
+		ThrowingCopy::copies_until_throw = -1;
+		checkpointer.Capture(state, 2);
+		checkpointer.Flush();
+		EXPECT_EQ((std::vector<uint64_t>{ 0, 2 }), written);
+		EXPECT_EQ(2, ThrowingCopy::num_alive);
+	}
+	EXPECT_EQ(2, ThrowingCopy::num_alive);
+}
+#endif
+
+#endif
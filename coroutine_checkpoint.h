@@ -0,0 +1,87 @@
+#pragma once
+
+#include "coroutine_state.h"
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+/**
+ * the CoroutineCheckpointer stores CoroutineStates on a background thread.
+ * Capture() only copies the values of the state into a buffer, which is
+ * cheap, and the background thread does the formatting and hands the
+ * result to the sink. Capture() fills one buffer while the background
+ * thread writes the buffers that are full. when a buffer is full and the
+ * background thread is still busy, Capture() doesn't wait but continues in
+ * a new buffer. so if the sink is slower than the captures for a long
+ * time, the memory grows until it catches up
+ */
+class CoroutineCheckpointer
+{
+public:
+	// will be called on the background thread with the same data that
+	// CoroutineState::Store would have written
+	typedef std::function<void (uint64_t checkpoint_id, const std::string & stored)> Sink;
+
+	CoroutineCheckpointer(Sink sink, size_t buffer_size = 1024 * 1024);
+	// writes everything that has been captured before returning. an
+	// exception from the sink that Flush() didn't report is dropped
+	~CoroutineCheckpointer();
+
+	// copies the current values of the state. the checkpoint_id will be passed
+	// to the sink so that you know which state was stored. can be called from
+	// multiple threads
+	void Capture(const CoroutineState & state, uint64_t checkpoint_id);
+	// blocks until the sink has been called for everything captured so far.
+	// Capture() doesn't wait for this. if the sink or storing a value threw
+	// since the last Flush(), the first of those exceptions is rethrown.
+	// that state was not written, but all others were
+	void Flush();
+
+private:
+	struct Buffer
+	{
+		std::unique_ptr<unsigned char[]> memory;
+		size_t capacity;
+		size_t size;
+	};
+
+	Sink sink;
+	size_t buffer_size;
+	// the buffer that Capture() writes to
+	Buffer capturing;
+	// full buffers for the background thread, oldest first
+	std::deque<Buffer> to_write;
+	// buffers that have been written and can be filled again
+	std::vector<Buffer> free_buffers;
+	// Flush() waits until all buffers that were handed off have been
+	// written. buffers are written in order
+	uint64_t num_handed_off;
+	uint64_t num_written;
+	bool stopping;
+#ifndef CORO_NO_EXCEPTIONS
+	// the first exception from the background thread since the last Flush()
+	std::exception_ptr exception;
+#endif
+	std::mutex capture_mutex;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::thread writer;
+
+	void HandOff(std::unique_lock<std::mutex> & capture_lock);
+	void WriterThread();
+	void Write(Buffer & buffer);
+#ifndef CORO_NO_EXCEPTIONS
+	// remembers the exception that is being handled, if it's the first one
+	void KeepException();
+#endif
+	Buffer CreateBuffer(size_t capacity);
+
+	// intentionally not implemented
+	CoroutineCheckpointer(const CoroutineCheckpointer &);
+	CoroutineCheckpointer & operator=(const CoroutineCheckpointer &);
+};
@@ -4,11 +4,31 @@
 #include <ostream>
 #include <iterator>
 #include <cassert>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#ifdef __AVX2__
+#	include <immintrin.h>
+#endif
 
-CoroutineState::CoroutineState(std::istream & stored_values)
-	: stored_values(stored_values)
+CoroutineState::CoroutineState(std::istream & stored_values, coro::arena * memory)
+	: memory(memory)
+	, stored_values(stored_values)
+	, memory_input(dynamic_cast<MemoryStreamBuffer *>(this->stored_values.rdbuf()))
+	, created_values_head(nullptr)
+	, created_values_last(nullptr)
+	, version(0)
+	, name_record(coro::arena_allocator<char>(memory))
+{
+}
+CoroutineState::CoroutineState(std::istream & stored_values, const CoroutineStateMigrations & migrations, coro::arena * memory)
+	: memory(memory)
+	, stored_values(PrepareStream(stored_values, migrations, memory, migrating_buffer, migrated_values))
+	, memory_input(dynamic_cast<MemoryStreamBuffer *>(this->stored_values.rdbuf()))
 	, created_values_head(nullptr)
 	, created_values_last(nullptr)
+	, version(migrations.CurrentVersion())
+	, name_record(coro::arena_allocator<char>(memory))
 {
 }
 
@@ -67,54 +87,338 @@ InputIterator AdvancePastRange(InputIterator begin, InputIterator end, ForwardIt
 }
 
 #define CORO_STATE_SEPARATOR "\n\n\n"
+// can not collide with a field name because those are identifiers
+#define CORO_STATE_VERSION_KEY "#version"
 namespace
 {
 	static const char * const separator_begin = CORO_STATE_SEPARATOR;
 	static const char * const separator_end = separator_begin + strlen(separator_begin);
+	static const size_t separator_length = separator_end - separator_begin;
+
+	void ThrowOrAssert(const char * message)
+	{
+#		ifdef CORO_NO_EXCEPTIONS
+			static_cast<void>(message);
+			assert(!"CoroutineState error");
+#		else
+			throw std::runtime_error(message);
+#		endif
+	}
+
+	// returns the beginning of the first separator in the range, or end if
+	// there is none. this has to find the same separator as AdvancePastRange
+	const char * FindSeparator(const char * begin, const char * end)
+	{
+		static_assert(sizeof(CORO_STATE_SEPARATOR) == 4, "the search below assumes that the separator is three newlines");
+#		ifdef __AVX2__
+			// compare three overlapping loads so that a bit is only set
+			// where three newlines start
+			const __m256i newline = _mm256_set1_epi8('\n');
+			for (; end - begin >= 34; begin += 32)
+			{
+				__m256i first = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin)), newline);
+				__m256i second = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin + 1)), newline);
+				__m256i third = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin + 2)), newline);
+				unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(first, second), third)));
+				if (mask)
+				{
+#					ifdef _MSC_VER
+						unsigned long index;
+						_BitScanForward(&index, mask);
+						return begin + index;
+#					else
+						return begin + __builtin_ctz(mask);
+#					endif
+				}
+			}
+#		endif
+		// memchr is vectorized by the standard library
+		while (end - begin >= 3)
+		{
+			const char * found = static_cast<const char *>(memchr(begin, '\n', end - begin - 2));
+			if (!found) return end;
+			if (found[1] != '\n') begin = found + 2;
+			else if (found[2] != '\n') begin = found + 3;
+			else return found;
+		}
+		return end;
+	}
+}
+
+MemoryStreamBuffer::MemoryStreamBuffer(const char * begin, const char * end)
+{
+	// the get area is never written to, the const_cast is only needed
+	// because std::streambuf doesn't have a const interface
+	char * mutable_begin = const_cast<char *>(begin);
+	setg(mutable_begin, mutable_begin, const_cast<char *>(end));
+}
+const char * MemoryStreamBuffer::Position() const
+{
+	return gptr();
+}
+const char * MemoryStreamBuffer::End() const
+{
+	return egptr();
+}
+void MemoryStreamBuffer::SetPosition(const char * position)
+{
+	setg(eback(), const_cast<char *>(position), egptr());
+}
+
+template<typename String>
+bool CoroutineState::ReadRecord(std::istream & in, String & record)
+{
+	record.clear();
+	std::streambuf * buffer = in.rdbuf();
+	for (;;)
+	{
+		std::char_traits<char>::int_type c = buffer->sbumpc();
+		if (c == std::char_traits<char>::eof())
+		{
+			in.setstate(std::ios_base::eofbit);
+			return false;
+		}
+		record.push_back(std::char_traits<char>::to_char_type(c));
+		if (record.size() >= separator_length && std::equal(separator_begin, separator_end, record.end() - separator_length))
+		{
+			record.resize(record.size() - separator_length);
+			return true;
+		}
+	}
 }
 
 void CoroutineState::AdvanceToNextStoredValue()
 {
+	if (memory_input)
+	{
+		const char * separator = FindSeparator(memory_input->Position(), memory_input->End());
+		memory_input->SetPosition(separator == memory_input->End() ? separator : separator + separator_length);
+		return;
+	}
 	AdvancePastRange(std::istreambuf_iterator<char>(stored_values), std::istreambuf_iterator<char>(), separator_begin, separator_end);
 }
-bool CoroutineState::AdvanceToValue(const char * name)
+// reads the version header if there is one. returns false if the header is malformed
+bool CoroutineState::ReadVersionHeader(std::istream & in, std::string & record, unsigned & version)
+{
+	version = 0;
+	if (in.peek() != CORO_STATE_VERSION_KEY[0]) return true;
+	if (!ReadRecord(in, record) || record != CORO_STATE_VERSION_KEY) return false;
+	if (!ReadRecord(in, record)) return false;
+	std::istringstream parse(record);
+	return static_cast<bool>(parse >> version) && version > 0;
+}
+void CoroutineState::WriteVersionHeader(std::ostream & out, unsigned version)
 {
+	out << CORO_STATE_VERSION_KEY CORO_STATE_SEPARATOR << version << CORO_STATE_SEPARATOR;
+}
+
+bool CoroutineState::AdvanceToValue(const char * name, const char * type_tag)
+{
+	size_t length = strlen(name);
 	for (;;)
 	{
-		size_t num_read = 0;
-		size_t length = strlen(name);
-		char read = '\0';
-		for (const char * c = name; c != name + length; ++c, ++num_read)
+		const char * record_begin;
+		const char * record_end;
+		if (memory_input)
 		{
-			read = static_cast<char>(stored_values.get());
-			if (read != *c) break;
+			// compare the name in place without copying it
+			record_begin = memory_input->Position();
+			record_end = FindSeparator(record_begin, memory_input->End());
+			if (record_end == memory_input->End())
+			{
+				memory_input->SetPosition(record_end);
+				stored_values.setstate(std::ios_base::eofbit);
+				return false;
+			}
+			memory_input->SetPosition(record_end + separator_length);
 		}
-		if (read == std::char_traits<char>::eof()) return false;
-		// always unget one character in case we have started reading the
-		// separator. the next line will skip past the ungotten char anyway
-		stored_values.unget();
-
-		AdvanceToNextStoredValue();
-		if (num_read == length) return true;
+		else
+		{
+			if (!ReadRecord(stored_values, name_record)) return false;
+			record_begin = name_record.data();
+			record_end = record_begin + name_record.size();
+		}
+		if (RecordMatchesName(record_begin, record_end, name, length, type_tag)) return true;
 		AdvanceToNextStoredValue();
 	}
 }
+bool CoroutineState::RecordMatchesName(const char * record_begin, const char * record_end, const char * name, size_t length, const char * type_tag) const
+{
+	size_t record_length = record_end - record_begin;
+	// the name may be followed by ':' and the type tag
+	if (record_length < length || memcmp(record_begin, name, length) != 0) return false;
+	if (record_length == length) return true;
+	if (record_begin[length] != ':') return false;
+	if (type_tag && (record_length - length - 1 != strlen(type_tag) || memcmp(record_begin + length + 1, type_tag, record_length - length - 1) != 0))
+	{
+		ThrowOrAssert("A stored value has a different type than the value that's reading it. Register a migration for it");
+		return false;
+	}
+	return true;
+}
 
-void CoroutineState::CreatedValue::Store(std::ostream & lhs) const
+void CoroutineState::CreatedValue::Store(std::ostream & lhs, bool with_type_tag) const
 {
 	lhs << name;
+	if (with_type_tag && type_tag) lhs << ':' << type_tag;
 	WriteSeparator(lhs);
 	store(lhs, value);
 }
 
 void CoroutineState::Store(std::ostream & lhs) const
 {
+	if (version) WriteVersionHeader(lhs, version);
 	for (const CreatedValue * value = created_values_head; value; value = value->next)
 	{
-		value->Store(lhs);
+		value->Store(lhs, version != 0);
 	}
 }
 
+std::istream & CoroutineState::PrepareStream(std::istream & stored_values, const CoroutineStateMigrations & migrations, coro::arena * memory, std::unique_ptr<MigratingStreamBuffer> & migrating_buffer, std::unique_ptr<std::istream> & migrated_values)
+{
+	std::string record;
+	unsigned stored_version = 0;
+	if (!ReadVersionHeader(stored_values, record, stored_version))
+	{
+		ThrowOrAssert("The stored state has a malformed version header");
+		stored_version = migrations.CurrentVersion();
+	}
+	if (stored_version == migrations.CurrentVersion()) return stored_values;
+	if (stored_version > migrations.CurrentVersion())
+	{
+		ThrowOrAssert("The stored state is newer than this binary");
+		return stored_values;
+	}
+	migrating_buffer.reset(new MigratingStreamBuffer(stored_values, migrations, stored_version, memory));
+	migrated_values.reset(new std::istream(migrating_buffer.get()));
+	return *migrated_values;
+}
+
+MigratingStreamBuffer::MigratingStreamBuffer(std::istream & old_state, const CoroutineStateMigrations & migrations, unsigned stored_version, coro::arena * memory)
+	: old_state(old_state)
+	, migrations(migrations)
+	, stored_version(stored_version)
+	, migrated(coro::arena_allocator<char>(memory))
+{
+}
+MigratingStreamBuffer::int_type MigratingStreamBuffer::underflow()
+{
+	migrated.clear();
+	while (migrated.empty())
+	{
+		if (!CoroutineStateMigrations::ReadField(old_state, name_record, field))
+		{
+			// this is called from inside of the reads of the CoroutineState
+			// so the exception reaches whoever is reading the value
+			if (!name_record.empty()) ThrowOrAssert("Failed to migrate the stored state");
+			return traits_type::eof();
+		}
+		if (!migrations.Migrate(field, stored_version)) continue;
+		migrated.append(field.name.data(), field.name.size());
+		if (!field.type_tag.empty())
+		{
+			migrated += ':';
+			migrated.append(field.type_tag.data(), field.type_tag.size());
+		}
+		migrated += CORO_STATE_SEPARATOR;
+		migrated.append(field.value.data(), field.value.size());
+		migrated += CORO_STATE_SEPARATOR;
+	}
+	char * begin = &migrated[0];
+	setg(begin, begin, begin + migrated.size());
+	return traits_type::to_int_type(*begin);
+}
+
+CoroutineStateMigrations::CoroutineStateMigrations(unsigned current_version)
+	: current_version(current_version)
+	, migrations(current_version)
+{
+	// version zero is used for states without a version header
+	assert(current_version > 0);
+}
+unsigned CoroutineStateMigrations::CurrentVersion() const
+{
+	return current_version;
+}
+void CoroutineStateMigrations::Add(unsigned from_version, Migration migration)
+{
+	assert(from_version < current_version);
+	migrations[from_version].push_back(std::move(migration));
+}
+void CoroutineStateMigrations::Rename(unsigned from_version, std::string old_name, std::string new_name)
+{
+	Add(from_version, [old_name, new_name](CoroutineStateField & field)
+	{
+		if (field.name == old_name) field.name = new_name;
+		return true;
+	});
+}
+const char * CoroutineStateMigrations::NonNullTag(const char * tag)
+{
+	return tag ? tag : "";
+}
+void CoroutineStateMigrations::ParseFailed(const CoroutineStateField & field)
+{
+	std::string message = "The stored value of " + field.name + " could not be parsed as the type that Retype converts from";
+	ThrowOrAssert(message.c_str());
+}
+
+bool CoroutineStateMigrations::Migrate(CoroutineStateField & field, unsigned stored_version) const
+{
+	for (unsigned version = stored_version; version < current_version; ++version)
+	{
+		for (const Migration & migration : migrations[version])
+		{
+			if (!migration(field)) return false;
+		}
+	}
+	return true;
+}
+
+bool CoroutineStateMigrations::Migrate(std::istream & old_state, std::ostream & new_state) const
+{
+	std::string record;
+	unsigned stored_version = 0;
+	if (!CoroutineState::ReadVersionHeader(old_state, record, stored_version) || stored_version > current_version) return false;
+	CoroutineState::WriteVersionHeader(new_state, current_version);
+	return MigrateFields(old_state, new_state, stored_version);
+}
+
+bool CoroutineStateMigrations::ReadField(std::istream & in, std::string & name_record, CoroutineStateField & field)
+{
+	if (!CoroutineState::ReadRecord(in, name_record)) return false;
+	if (!CoroutineState::ReadRecord(in, field.value)) return false;
+	size_t colon = name_record.find(':');
+	if (colon == std::string::npos)
+	{
+		field.name.assign(name_record);
+		field.type_tag.clear();
+	}
+	else
+	{
+		field.name.assign(name_record, 0, colon);
+		field.type_tag.assign(name_record, colon + 1, std::string::npos);
+	}
+	return true;
+}
+
+bool CoroutineStateMigrations::MigrateFields(std::istream & old_state, std::ostream & new_state, unsigned stored_version) const
+{
+	// the field and the record are reused for every field so that a
+	// migration doesn't allocate once the buffers have grown large enough
+	CoroutineStateField field;
+	std::string name_record;
+	while (ReadField(old_state, name_record, field))
+	{
+		if (!Migrate(field, stored_version)) continue;
+		new_state << field.name;
+		if (!field.type_tag.empty()) new_state << ':' << field.type_tag;
+		new_state << CORO_STATE_SEPARATOR << field.value << CORO_STATE_SEPARATOR;
+	}
+	// a partial record at the end means that the state was truncated
+	return name_record.empty();
+}
+
 void CoroutineState::CreatedValue::WriteSeparator(std::ostream & lhs)
 {
 	lhs << CORO_STATE_SEPARATOR;
@@ -318,4 +622,191 @@ TEST(coroutine_state, remove_head_of_list)
 	}
 }
 
+TEST(coroutine_state, versioned_store)
+{
+	using namespace coro;
+	CoroutineStateMigrations migrations(2);
+	std::stringstream old_state;
+	CoroutineState state(old_state, migrations);
+	coroutine<int (CoroutineState &)> to_call([](coroutine<int (CoroutineState &)>::self & self, CoroutineState & state) -> int
+	{
+		CORO_SERIALIZABLE(state, int, i, 5);
+		self.yield(i);
+		return i;
+	});
+	EXPECT_EQ(5, to_call(state));
+	std::stringstream stored;
+	state.Store(stored);
+	EXPECT_EQ("#version" CORO_STATE_SEPARATOR "2" CORO_STATE_SEPARATOR "i:int" CORO_STATE_SEPARATOR "5" CORO_STATE_SEPARATOR, stored.str());
+	// versioned states can still be read without migrations
+	CoroutineState unversioned(stored);
+	EXPECT_TRUE(unversioned.AdvanceToValue("i"));
+	EXPECT_EQ(5, unversioned.GetNextValue<int>());
+}
+
+namespace
+{
+double int_to_half(int i)
+{
+	return i / 2.0;
+}
+}
+
+TEST(coroutine_state, migrate_rename_and_retype)
+{
+	using namespace coro;
+	CoroutineStateMigrations migrations(3);
+	migrations.Rename(0, "count", "i");
+	migrations.Retype(1, "i", &int_to_half);
+	migrations.Add(2, [](CoroutineStateField & field)
+	{
+		return field.name != "obsolete";
+	});
+	std::stringstream old_state("count" CORO_STATE_SEPARATOR "3" CORO_STATE_SEPARATOR "obsolete" CORO_STATE_SEPARATOR "1" CORO_STATE_SEPARATOR);
+	{
+		std::stringstream migrated;
+		ASSERT_TRUE(migrations.Migrate(old_state, migrated));
+		EXPECT_EQ("#version" CORO_STATE_SEPARATOR "3" CORO_STATE_SEPARATOR "i:double" CORO_STATE_SEPARATOR "1.5" CORO_STATE_SEPARATOR, migrated.str());
+	}
+	old_state.clear();
+	old_state.seekg(0);
+	CoroutineState state(old_state, migrations);
+	coroutine<double (CoroutineState &)> to_call([](coroutine<double (CoroutineState &)>::self &, CoroutineState & state) -> double
+	{
+		CORO_SERIALIZABLE(state, double, i, 0.0);
+		return i;
+	});
+	EXPECT_DOUBLE_EQ(1.5, to_call(state));
+}
+
+TEST(coroutine_state, migrate_while_reading)
+{
+	using namespace coro;
+	CoroutineStateMigrations migrations(2);
+	size_t num_migrated = 0;
+	migrations.Add(1, [&num_migrated](CoroutineStateField & field)
+	{
+		++num_migrated;
+		return field.name != "dropped";
+	});
+	std::stringstream old_state("#version" CORO_STATE_SEPARATOR "1" CORO_STATE_SEPARATOR "a" CORO_STATE_SEPARATOR "1" CORO_STATE_SEPARATOR
+		"dropped" CORO_STATE_SEPARATOR "2" CORO_STATE_SEPARATOR "b" CORO_STATE_SEPARATOR "3" CORO_STATE_SEPARATOR "c" CORO_STATE_SEPARATOR "4" CORO_STATE_SEPARATOR);
+	CoroutineState state(old_state, migrations);
+	// nothing is migrated before it is read
+	EXPECT_EQ(0u, num_migrated);
+	ASSERT_TRUE(state.AdvanceToValue("a"));
+	EXPECT_EQ(1, state.GetNextValue<int>());
+	EXPECT_EQ(1u, num_migrated);
+	ASSERT_TRUE(state.AdvanceToValue("b"));
+	EXPECT_EQ(3, state.GetNextValue<int>());
+	EXPECT_EQ(3u, num_migrated);
+	ASSERT_TRUE(state.AdvanceToValue("c"));
+	EXPECT_EQ(4, state.GetNextValue<int>());
+	EXPECT_FALSE(state.AdvanceToValue("d"));
+}
+
+#ifndef CORO_NO_EXCEPTIONS
+TEST(coroutine_state, migration_errors)
+{
+	using namespace coro;
+	CoroutineStateMigrations migrations(2);
+	migrations.Retype(1, "i", &int_to_half);
+	std::stringstream not_an_int("#version" CORO_STATE_SEPARATOR "1" CORO_STATE_SEPARATOR "i" CORO_STATE_SEPARATOR "1.5" CORO_STATE_SEPARATOR);
+	CoroutineState retyped(not_an_int, migrations);
+	EXPECT_THROW(retyped.AdvanceToValue("i"), std::runtime_error);
+	std::stringstream truncated("#version" CORO_STATE_SEPARATOR "1" CORO_STATE_SEPARATOR "a" CORO_STATE_SEPARATOR "1" CORO_STATE_SEPARATOR "b" CORO_STATE_SEPARATOR "2");
+	CoroutineState cut_off(truncated, migrations);
+	ASSERT_TRUE(cut_off.AdvanceToValue("a"));
+	EXPECT_EQ(1, cut_off.GetNextValue<int>());
+	EXPECT_THROW(cut_off.AdvanceToValue("b"), std::runtime_error);
+}
+
+TEST(coroutine_state, type_mismatch)
+{
+	std::stringstream stored("#version" CORO_STATE_SEPARATOR "1" CORO_STATE_SEPARATOR "i:int" CORO_STATE_SEPARATOR "5" CORO_STATE_SEPARATOR);
+	CoroutineStateMigrations migrations(1);
+	CoroutineState state(stored, migrations);
+	EXPECT_THROW(state.AdvanceToValue("i", CoroutineStateTypeTag<double>::tag()), std::runtime_error);
+}
+#endif
+
+TEST(coroutine_state, restore_into_arena)
+{
+	using namespace coro;
+	auto callable = [](coroutine<size_t (CoroutineState &)>::self & self, CoroutineState & state) -> size_t
+	{
+		CORO_SERIALIZABLE(state, CoroutineStateString, text, "a_string_that_is_longer_than_the_small_string_buffer");
+		self.yield(text.size());
+		text += "_and_more";
+		return text.size();
+	};
+	std::stringstream storage;
+	{
+		std::stringstream old_state;
+		CoroutineState state(old_state);
+		coroutine<size_t (CoroutineState &)> to_call(callable);
+		to_call(state);
+		state.Store(storage);
+	}
+	arena memory;
+	{
+		CoroutineStateMigrations migrations(1);
+		CoroutineState state(storage, migrations, &memory);
+		coroutine<size_t (CoroutineState &)> to_call(callable);
+		EXPECT_EQ(strlen("a_string_that_is_longer_than_the_small_string_buffer"), to_call(state));
+		EXPECT_LT(0u, memory.bytes_allocated());
+		EXPECT_EQ(strlen("a_string_that_is_longer_than_the_small_string_buffer_and_more"), to_call(state));
+	}
+	memory.release();
+	EXPECT_EQ(0u, memory.bytes_allocated());
+}
+
+TEST(coroutine_state, find_separator)
+{
+	// compare against the generic implementation for separators in every
+	// position relative to the vector width
+	for (size_t prefix = 0; prefix < 70; ++prefix)
+	{
+		for (size_t newlines = 0; newlines < 5; ++newlines)
+		{
+			std::string text = std::string(prefix, 'a') + std::string(newlines, '\n') + "b\nc\n\nd" + std::string(40, 'e');
+			const char * begin = text.data();
+			const char * end = begin + text.size();
+			const char * expected = std::search(begin, end, separator_begin, separator_end);
+			EXPECT_EQ(expected, FindSeparator(begin, end)) << prefix << " " << newlines;
+		}
+	}
+}
+
+TEST(coroutine_state, read_from_memory)
+{
+	using namespace coro;
+	std::string large_value(100000, 'x');
+	std::string stored = "skipped" CORO_STATE_SEPARATOR + large_value + CORO_STATE_SEPARATOR
+		+ "i:int" CORO_STATE_SEPARATOR "5" CORO_STATE_SEPARATOR
+		+ "s" CORO_STATE_SEPARATOR "text" CORO_STATE_SEPARATOR;
+	MemoryStreamBuffer buffer(stored.data(), stored.data() + stored.size());
+	std::istream stream(&buffer);
+	CoroutineState state(stream);
+	ASSERT_TRUE(state.AdvanceToValue("i", CoroutineStateTypeTag<int>::tag()));
+	EXPECT_EQ(5, state.GetNextValue<int>());
+	ASSERT_TRUE(state.AdvanceToValue("s"));
+	EXPECT_EQ("text", state.GetNextValue<std::string>());
+	EXPECT_FALSE(state.AdvanceToValue("missing"));
+
+	// has to give the same results as reading from a stream
+	std::string with_newlines = "some_name" CORO_STATE_SEPARATOR "a\n\nb" CORO_STATE_SEPARATOR "i" CORO_STATE_SEPARATOR "7" CORO_STATE_SEPARATOR;
+	std::stringstream slow_stream(with_newlines);
+	CoroutineState slow(slow_stream);
+	MemoryStreamBuffer fast_buffer(with_newlines.data(), with_newlines.data() + with_newlines.size());
+	std::istream fast_stream(&fast_buffer);
+	CoroutineState fast(fast_stream);
+	ASSERT_TRUE(slow.AdvanceToValue("i"));
+	ASSERT_TRUE(fast.AdvanceToValue("i"));
+	EXPECT_EQ(7, slow.GetNextValue<int>());
+	EXPECT_EQ(7, fast.GetNextValue<int>());
+	EXPECT_FALSE(slow.AdvanceToValue("i"));
+	EXPECT_FALSE(fast.AdvanceToValue("i"));
+}
+
 #endif
@@ -1,6 +1,14 @@
 #pragma once
 
 #include <iosfwd>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include "arena.h"
 
 #ifdef _MSC_VER
 #define MULTILINE_MACRO_BEGIN \
@@ -24,17 +32,179 @@ __pragma(warning(pop))
 #endif
 
 
+/**
+ * the type tag is written next to the name of every field in a versioned
+ * state, so that a field which changed its type between two versions of a
+ * binary is detected instead of being parsed as garbage. types without a
+ * tag are stored without one and are never checked
+ */
+template<typename T>
+struct CoroutineStateTypeTag
+{
+	static const char * tag() { return nullptr; }
+};
+#define CORO_STATE_TYPE_TAG(type, tag_name)\
+	template<>\
+	struct CoroutineStateTypeTag<type>\
+	{\
+		static const char * tag() { return tag_name; }\
+	}
+CORO_STATE_TYPE_TAG(bool, "bool");
+CORO_STATE_TYPE_TAG(char, "char");
+CORO_STATE_TYPE_TAG(int, "int");
+CORO_STATE_TYPE_TAG(unsigned, "unsigned");
+CORO_STATE_TYPE_TAG(long, "long");
+CORO_STATE_TYPE_TAG(unsigned long, "unsigned long");
+CORO_STATE_TYPE_TAG(long long, "long long");
+CORO_STATE_TYPE_TAG(unsigned long long, "unsigned long long");
+CORO_STATE_TYPE_TAG(float, "float");
+CORO_STATE_TYPE_TAG(double, "double");
+CORO_STATE_TYPE_TAG(std::string, "string");
+
+// a string that will be allocated from the arena of the CoroutineState when
+// it is restored. see the CoroutineState constructor
+typedef std::basic_string<char, std::char_traits<char>, coro::arena_allocator<char> > CoroutineStateString;
+CORO_STATE_TYPE_TAG(CoroutineStateString, "string");
+
+/**
+ * a single stored field as seen by a migration
+ */
+struct CoroutineStateField
+{
+	std::string name;
+	// empty if the field was stored without a type tag
+	std::string type_tag;
+	std::string value;
+};
+
+/**
+ * holds the current version of the state format and the migrations that
+ * upgrade older states to it. migrations are applied one field at a time
+ * while streaming through the old state, so a state never has to be loaded
+ * as a whole
+ */
+class CoroutineStateMigrations
+{
+public:
+	// return false to drop the field
+	typedef std::function<bool (CoroutineStateField &)> Migration;
+
+	explicit CoroutineStateMigrations(unsigned current_version);
+
+	unsigned CurrentVersion() const;
+
+	// the migration will be run on every field of a state that was stored
+	// with version from_version, to upgrade it to version from_version + 1
+	void Add(unsigned from_version, Migration migration);
+	void Rename(unsigned from_version, std::string old_name, std::string new_name);
+	// if the stored value can't be parsed as a From, this throws, or asserts
+	// with CORO_NO_EXCEPTIONS. if asserts are disabled the field is dropped
+	template<typename From, typename To>
+	void Retype(unsigned from_version, std::string name, To (*convert)(From))
+	{
+		Add(from_version, [name, convert](CoroutineStateField & field)
+		{
+			if (field.name != name) return true;
+			From parsed = From();
+			if (!ParseValue(field.value, parsed))
+			{
+				ParseFailed(field);
+				return false;
+			}
+			field.type_tag = NonNullTag(CoroutineStateTypeTag<To>::tag());
+			field.value = FormatValue<To>(convert(parsed));
+			return true;
+		});
+	}
+
+	// applies all migrations for a state that was stored with the given version
+	bool Migrate(CoroutineStateField & field, unsigned stored_version) const;
+	// reads a stored state from the input and writes the upgraded state to
+	// the output. returns false if the input is not a valid state
+	bool Migrate(std::istream & old_state, std::ostream & new_state) const;
+
+private:
+	friend class CoroutineState;
+	friend struct MigratingStreamBuffer;
+
+	bool MigrateFields(std::istream & old_state, std::ostream & new_state, unsigned stored_version) const;
+	// reads the name record and the value of the next field. returns false
+	// at the end of the state. if name_record is not empty after that, the
+	// state was cut off in the middle of a field
+	static bool ReadField(std::istream & in, std::string & name_record, CoroutineStateField & field);
+
+	unsigned current_version;
+	// indexed by from_version
+	std::vector<std::vector<Migration> > migrations;
+
+	static const char * NonNullTag(const char * tag);
+	static void ParseFailed(const CoroutineStateField & field);
+	// returns false unless the whole value could be parsed
+	template<typename T>
+	static bool ParseValue(const std::string & value, T & result);
+	template<typename T>
+	static std::string FormatValue(const T & value);
+};
+
+/**
+ * a std::streambuf that reads from memory without copying it. if a
+ * CoroutineState reads from a stream that uses this buffer, it searches
+ * through the memory directly instead of reading one character at a time
+ */
+struct MemoryStreamBuffer
+	: std::streambuf
+{
+	MemoryStreamBuffer(const char * begin, const char * end);
+
+	const char * Position() const;
+	const char * End() const;
+	void SetPosition(const char * position);
+};
+
+/**
+ * used by a CoroutineState that reads an old state. this runs the
+ * migrations on one field at a time as the state reads them, so the old
+ * state never has to be copied as a whole
+ */
+struct MigratingStreamBuffer
+	: std::streambuf
+{
+	MigratingStreamBuffer(std::istream & old_state, const CoroutineStateMigrations & migrations, unsigned stored_version, coro::arena * memory);
+
+protected:
+	int_type underflow() override;
+
+private:
+	std::istream & old_state;
+	const CoroutineStateMigrations & migrations;
+	unsigned stored_version;
+	// reused for every field
+	CoroutineStateField field;
+	std::string name_record;
+	// the migrated field that is being read
+	CoroutineStateString migrated;
+};
+
 class CoroutineState
 {
 public:
-	CoroutineState(std::istream & stored_values);
+	// if you provide an arena, the buffers needed for restoring and all
+	// restored values that use a coro::arena_allocator (like a
+	// CoroutineStateString) will be allocated from it. the arena has to
+	// outlive those values. when restoring many states at once, use one
+	// arena for the whole batch and release it when the batch is done
+	CoroutineState(std::istream & stored_values, coro::arena * memory = nullptr);
+	// use this to read and write versioned states. older states will be
+	// upgraded using the migrations while the values are read, so the
+	// migrations have to outlive this
+	CoroutineState(std::istream & stored_values, const CoroutineStateMigrations & migrations, coro::arena * memory = nullptr);
 
-	bool AdvanceToValue(const char * name);
+	bool AdvanceToValue(const char * name, const char * type_tag = nullptr);
 
 	template<typename T>
 	T GetNextValue()
 	{
-		T to_return;
+		T to_return(CreateValue<T>(std::uses_allocator<T, coro::arena_allocator<char> >()));
 		stored_values >> to_return;
 		AdvanceToNextStoredValue();
 		return to_return;
@@ -45,9 +215,10 @@ public:
 		const char * const name;
 		template<typename T>
 		inline CreatedValue(CoroutineState & parent, const char * name, const T & value)
-			: name(name), value(&value), store(&StoreValue<T>)
+			: name(name)
 			, previous_next(parent.created_values_head ? &parent.created_values_last->next : &parent.created_values_head)
 			, next(nullptr)
+			, value(&value), type_tag(CoroutineStateTypeTag<T>::tag()), store(&StoreValue<T>), capture(&CaptureInfoFor<T>::info)
 		{
 			*previous_next = this;
 			parent.created_values_last = this;
@@ -57,14 +228,27 @@ public:
 			*previous_next = nullptr;
 		}
 
-		void Store(std::ostream & lhs) const;
+		void Store(std::ostream & lhs, bool with_type_tag) const;
+
+		// describes how to copy a value so that it can be stored later
+		// on a different thread. see CoroutineCheckpointer
+		struct CaptureInfo
+		{
+			size_t size;
+			size_t alignment;
+			void (* copy)(void * destination, const void * source);
+			void (* destroy)(void * value);
+		};
 
 	private:
 		friend class CoroutineState;
+		friend class CoroutineCheckpointer;
 		CreatedValue ** previous_next;
 		CreatedValue * next;
 		const void * const value;
+		const char * const type_tag;
 		void (* const store)(std::ostream &, const void *);
+		const CaptureInfo * const capture;
 
 		static void WriteSeparator(std::ostream & lhs);
 
@@ -75,6 +259,21 @@ public:
 			lhs << value;
 			WriteSeparator(lhs);
 		}
+
+		template<typename T>
+		struct CaptureInfoFor
+		{
+			static const CaptureInfo info;
+
+			static void Copy(void * destination, const void * source)
+			{
+				new (destination) T(*static_cast<const T *>(source));
+			}
+			static void Destroy(void * value)
+			{
+				static_cast<T *>(value)->~T();
+			}
+		};
 	};
 
 
@@ -86,18 +285,74 @@ public:
 	void Store(std::ostream &) const;
 
 private:
+	friend class CoroutineStateMigrations;
+	friend class CoroutineCheckpointer;
+
 	void AdvanceToNextStoredValue();
+	bool RecordMatchesName(const char * record_begin, const char * record_end, const char * name, size_t length, const char * type_tag) const;
 
+	template<typename T>
+	T CreateValue(std::true_type)
+	{
+		return T(coro::arena_allocator<char>(memory));
+	}
+	template<typename T>
+	T CreateValue(std::false_type)
+	{
+		return T();
+	}
+
+	template<typename String>
+	static bool ReadRecord(std::istream & in, String & record);
+	static bool ReadVersionHeader(std::istream & in, std::string & record, unsigned & version);
+	static void WriteVersionHeader(std::ostream & out, unsigned version);
+	static std::istream & PrepareStream(std::istream & stored_values, const CoroutineStateMigrations & migrations, coro::arena * memory, std::unique_ptr<MigratingStreamBuffer> & migrating_buffer, std::unique_ptr<std::istream> & migrated_values);
+
+	coro::arena * memory;
+	// only set if the stored state has an older version
+	std::unique_ptr<MigratingStreamBuffer> migrating_buffer;
+	std::unique_ptr<std::istream> migrated_values;
 	std::istream & stored_values;
+	// set if stored_values reads from memory
+	MemoryStreamBuffer * memory_input;
 	CreatedValue * created_values_head;
 	CreatedValue * created_values_last;
+	// zero if this state is not versioned
+	unsigned version;
+	CoroutineStateString name_record;
+};
+
+template<typename T>
+const CoroutineState::CreatedValue::CaptureInfo CoroutineState::CreatedValue::CaptureInfoFor<T>::info =
+{
+	sizeof(T),
+	std::alignment_of<T>::value,
+	&CoroutineState::CreatedValue::CaptureInfoFor<T>::Copy,
+	&CoroutineState::CreatedValue::CaptureInfoFor<T>::Destroy
 };
 
+template<typename T>
+bool CoroutineStateMigrations::ParseValue(const std::string & value, T & result)
+{
+	std::istringstream stream(value);
+	if (!(stream >> result)) return false;
+	// "1.5" must not turn into 1 when read as an int
+	stream >> std::ws;
+	return stream.eof();
+}
+template<typename T>
+std::string CoroutineStateMigrations::FormatValue(const T & value)
+{
+	std::ostringstream stream;
+	stream << value;
+	return stream.str();
+}
+
 #define CORO_CONCAT2(x, y) x ## y
 #define CORO_CONCAT(x, y) CORO_CONCAT2(x, y)
 #define CORO_SERIALIZABLE2(state, type, name, initial_value)\
 	CoroutineState & CORO_CONCAT(_state_, name) = state;\
-	type name = CORO_CONCAT(_state_, name).AdvanceToValue(#name) ? CORO_CONCAT(_state_, name).GetNextValue<type>() : initial_value;\
+	type name = CORO_CONCAT(_state_, name).AdvanceToValue(#name, CoroutineStateTypeTag<type>::tag()) ? CORO_CONCAT(_state_, name).GetNextValue<type>() : initial_value;\
 	auto CORO_CONCAT(_scope_, name) = CORO_CONCAT(_state_, name).KeepReference(#name, name)
 #define CORO_SERIALIZABLE(state, type, name, initial_value) CORO_SERIALIZABLE2(state, type, name, initial_value)
 
@@ -0,0 +1,350 @@
+#include "coroutine_state_archive.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#ifndef CORO_NO_EXCEPTIONS
+#	include <exception>
+#endif
+
+void CoroutineStateArchive::Write(std::ostream & archive, uint64_t id, const std::string & stored)
+{
+	archive << id << ' ' << stored.size() << '\n';
+	archive.write(stored.data(), stored.size());
+}
+
+namespace
+{
+	// parses the decimal number at the start of [position, end) and moves
+	// position past it. the archive may come from anywhere, so this doesn't
+	// use strtoull: the contents aren't null terminated, and strtoull would
+	// skip whitespace, including newlines, and accept a sign
+	bool parse_archive_number(const char *& position, const char * end, uint64_t & result)
+	{
+		const char * begin = position;
+		uint64_t number = 0;
+		for (; position != end && *position >= '0' && *position <= '9'; ++position)
+		{
+			uint64_t digit = static_cast<uint64_t>(*position - '0');
+			if (number > (UINT64_MAX - digit) / 10) return false;
+			number = number * 10 + digit;
+		}
+		result = number;
+		return position != begin;
+	}
+}
+
+bool CoroutineStateArchive::Read(std::istream & archive)
+{
+	contents.assign(std::istreambuf_iterator<char>(archive), std::istreambuf_iterator<char>());
+	entries.clear();
+	const char * position = contents.data();
+	const char * end = position + contents.size();
+	while (position != end)
+	{
+		// the header is "<id> <size>\n"
+		const char * newline = static_cast<const char *>(memchr(position, '\n', end - position));
+		if (!newline) return false;
+		Entry entry;
+		if (!parse_archive_number(position, newline, entry.id)) return false;
+		if (position == newline || *position != ' ') return false;
+		++position;
+		uint64_t size = 0;
+		if (!parse_archive_number(position, newline, size) || position != newline) return false;
+		if (size > static_cast<uint64_t>(end - (newline + 1))) return false;
+		entry.begin = newline + 1;
+		entry.end = entry.begin + size;
+		entries.push_back(entry);
+		position = entry.end;
+	}
+	return true;
+}
+
+const std::vector<CoroutineStateArchive::Entry> & CoroutineStateArchive::Entries() const
+{
+	return entries;
+}
+
+ArchivedCoroutineState::ArchivedCoroutineState(const CoroutineStateArchive::Entry & entry, const CoroutineStateMigrations * migrations)
+	: buffer(entry.begin, entry.end)
+	, stream(&buffer)
+	, id(entry.id)
+	, state(migrations ? CoroutineState(stream, *migrations) : CoroutineState(stream))
+{
+}
+
+BulkRestoreOptions::BulkRestoreOptions()
+	: num_threads(0)
+	, progress_interval_milliseconds(1000)
+	, migrations(nullptr)
+{
+}
+
+namespace
+{
+	// entries are handed out to the threads in batches of this size
+	static const size_t BULK_RESTORE_BATCH_SIZE = 64;
+}
+
+BulkRestoreProgress BulkRestore(const CoroutineStateArchive & archive, RestoreFunction restore, const BulkRestoreOptions & options)
+{
+	const std::vector<CoroutineStateArchive::Entry> & entries = archive.Entries();
+	std::atomic<size_t> next_entry(0);
+	std::atomic<size_t> num_restored(0);
+	std::atomic<size_t> bytes_restored(0);
+	std::mutex mutex;
+	std::condition_variable all_done;
+	size_t num_threads_running = 0;
+#	ifndef CORO_NO_EXCEPTIONS
+		std::exception_ptr exception;
+#	endif
+
+	auto worker = [&]
+	{
+		for (;;)
+		{
+			size_t begin = next_entry.fetch_add(BULK_RESTORE_BATCH_SIZE);
+			if (begin >= entries.size()) break;
+			size_t end = std::min(begin + BULK_RESTORE_BATCH_SIZE, entries.size());
+			// only counts the entries whose restore function returned
+			size_t num_succeeded = 0;
+			size_t bytes = 0;
+			for (size_t i = begin; i != end; ++i)
+			{
+#				ifndef CORO_NO_EXCEPTIONS
+				try
+				{
+#				endif
+					restore(std::unique_ptr<ArchivedCoroutineState>(new ArchivedCoroutineState(entries[i], options.migrations)));
+#				ifndef CORO_NO_EXCEPTIONS
+				}
+				catch(...)
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					if (!exception) exception = std::current_exception();
+					// stop handing out more entries, and skip the rest of
+					// this batch
+					next_entry = entries.size();
+					break;
+				}
+#				endif
+				++num_succeeded;
+				bytes += entries[i].end - entries[i].begin;
+			}
+			num_restored += num_succeeded;
+			bytes_restored += bytes;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--num_threads_running == 0) all_done.notify_all();
+	};
+
+	size_t num_threads = options.num_threads ? options.num_threads : std::max(1u, std::thread::hardware_concurrency());
+	num_threads = std::min(num_threads, (entries.size() + BULK_RESTORE_BATCH_SIZE - 1) / BULK_RESTORE_BATCH_SIZE);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	auto get_progress = [&]
+	{
+		BulkRestoreProgress progress;
+		progress.num_restored = num_restored;
+		progress.num_total = entries.size();
+		progress.bytes_restored = bytes_restored;
+		progress.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		progress.states_per_second = progress.seconds > 0.0 ? progress.num_restored / progress.seconds : 0.0;
+		progress.bytes_per_second = progress.seconds > 0.0 ? progress.bytes_restored / progress.seconds : 0.0;
+		return progress;
+	};
+
+	std::vector<std::thread> threads;
+	threads.reserve(num_threads);
+	num_threads_running = num_threads;
+	for (size_t i = 0; i < num_threads; ++i)
+	{
+		threads.emplace_back(worker);
+	}
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (num_threads_running)
+		{
+			all_done.wait_for(lock, std::chrono::milliseconds(options.progress_interval_milliseconds));
+			if (num_threads_running && options.progress)
+			{
+				lock.unlock();
+				options.progress(get_progress());
+				lock.lock();
+			}
+		}
+	}
+	for (std::thread & thread : threads)
+	{
+		thread.join();
+	}
+	BulkRestoreProgress result = get_progress();
+	if (options.progress) options.progress(result);
+#	ifndef CORO_NO_EXCEPTIONS
+		if (exception) std::rethrow_exception(exception);
+#	endif
+	return result;
+}
+
+
+#ifndef DISABLE_GTEST
+#include <gtest/gtest.h>
+#include "coroutine.h"
+#include <sstream>
+
+namespace
+{
+	int archive_test_coroutine(coro::coroutine<int (CoroutineState &)>::self & self, CoroutineState & state)
+	{
+		CORO_SERIALIZABLE(state, int, i, 0);
+		for (;;)
+		{
+			self.yield(++i);
+		}
+	}
+}
+
+TEST(coroutine_state_archive, read_and_write)
+{
+	std::stringstream stored;
+	CoroutineStateArchive::Write(stored, 5, "hello");
+	CoroutineStateArchive::Write(stored, 7, "");
+	CoroutineStateArchive::Write(stored, 3, "multiple\nlines");
+	CoroutineStateArchive archive;
+	ASSERT_TRUE(archive.Read(stored));
+	ASSERT_EQ(3u, archive.Entries().size());
+	EXPECT_EQ(5u, archive.Entries()[0].id);
+	EXPECT_EQ("hello", std::string(archive.Entries()[0].begin, archive.Entries()[0].end));
+	EXPECT_EQ(7u, archive.Entries()[1].id);
+	EXPECT_EQ(archive.Entries()[1].begin, archive.Entries()[1].end);
+	EXPECT_EQ("multiple\nlines", std::string(archive.Entries()[2].begin, archive.Entries()[2].end));
+
+	std::stringstream truncated(stored.str().substr(0, stored.str().size() - 1));
+	EXPECT_FALSE(archive.Read(truncated));
+	EXPECT_EQ(2u, archive.Entries().size());
+}
+
+TEST(coroutine_state_archive, malformed)
+{
+	const char * malformed[] =
+	{
+		"\n5 5\nhello",
+		"5 5\nhello\n \n",
+		"5 5\nhello  \n",
+		"-5 5\nhello",
+		"5 -5\nhello",
+		"+5 5\nhello",
+		" 5 5\nhello",
+		"5  5\nhello",
+		"5 5 \nhello",
+		"5\t5\nhello",
+		"5\n5\nhello",
+		"5 \nhello",
+		"5 99999999999999999999\nhello",
+		"99999999999999999999 5\nhello",
+		"5 18446744073709551615\nhello",
+	};
+	for (const char * contents : malformed)
+	{
+		std::stringstream stored(contents);
+		CoroutineStateArchive archive;
+		EXPECT_FALSE(archive.Read(stored)) << contents;
+	}
+	std::stringstream valid("18446744073709551615 5\nhello");
+	CoroutineStateArchive archive;
+	ASSERT_TRUE(archive.Read(valid));
+	ASSERT_EQ(1u, archive.Entries().size());
+	EXPECT_EQ(UINT64_MAX, archive.Entries()[0].id);
+}
+
+TEST(coroutine_state_archive, bulk_restore)
+{
+	using namespace coro;
+	typedef coroutine<int (CoroutineState &)> coroutine_t;
+	static const int num_states = 1000;
+	std::stringstream stored;
+	for (int i = 0; i < num_states; ++i)
+	{
+		std::stringstream empty;
+		CoroutineState state(empty);
+		coroutine_t to_store(&archive_test_coroutine);
+		for (int j = 0; j <= i % 10; ++j)
+		{
+			to_store(state);
+		}
+		std::stringstream single;
+		state.Store(single);
+		CoroutineStateArchive::Write(stored, i, single.str());
+	}
+	CoroutineStateArchive archive;
+	ASSERT_TRUE(archive.Read(stored));
+
+	struct Restored
+	{
+		std::unique_ptr<ArchivedCoroutineState> state;
+		std::unique_ptr<coroutine_t> coroutine;
+		int first_yield;
+	};
+	std::vector<Restored> restored(num_states);
+	BulkRestoreOptions options;
+	options.num_threads = 4;
+	size_t num_progress_calls = 0;
+	options.progress = [&num_progress_calls](const BulkRestoreProgress &)
+	{
+		++num_progress_calls;
+	};
+	BulkRestoreProgress progress = BulkRestore(archive, [&restored](std::unique_ptr<ArchivedCoroutineState> state)
+	{
+		Restored & to_fill = restored[state->id];
+		to_fill.coroutine.reset(new coroutine_t(&archive_test_coroutine));
+		to_fill.first_yield = (*to_fill.coroutine)(state->state);
+		to_fill.state = std::move(state);
+	}, options);
+	EXPECT_EQ(static_cast<size_t>(num_states), progress.num_restored);
+	EXPECT_EQ(static_cast<size_t>(num_states), progress.num_total);
+	EXPECT_LE(1u, num_progress_calls);
+	for (int i = 0; i < num_states; ++i)
+	{
+		EXPECT_EQ(i % 10 + 2, restored[i].first_yield);
+		// coroutines can be continued on a different thread
+		EXPECT_EQ(i % 10 + 3, (*restored[i].coroutine)(restored[i].state->state));
+	}
+}
+
+#ifndef CORO_NO_EXCEPTIONS
+TEST(coroutine_state_archive, bulk_restore_exception)
+{
+	std::stringstream stored;
+	for (int i = 0; i < 200; ++i)
+	{
+		CoroutineStateArchive::Write(stored, i, "");
+	}
+	CoroutineStateArchive archive;
+	ASSERT_TRUE(archive.Read(stored));
+	EXPECT_THROW(BulkRestore(archive, [](std::unique_ptr<ArchivedCoroutineState> state)
+	{
+		if (state->id == 100) throw std::runtime_error("failed");
+	}), std::runtime_error);
+
+	// the progress only counts the entries that were restored
+	BulkRestoreOptions options;
+	options.num_threads = 1;
+	BulkRestoreProgress last_progress = BulkRestoreProgress();
+	options.progress = [&last_progress](const BulkRestoreProgress & progress)
+	{
+		last_progress = progress;
+	};
+	EXPECT_THROW(BulkRestore(archive, [](std::unique_ptr<ArchivedCoroutineState> state)
+	{
+		if (state->id == 100) throw std::runtime_error("failed");
+	}, options), std::runtime_error);
+	EXPECT_EQ(100u, last_progress.num_restored);
+	EXPECT_EQ(200u, last_progress.num_total);
+}
+#endif
+
+#endif
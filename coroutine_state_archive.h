@@ -0,0 +1,92 @@
+#pragma once
+
+#include "coroutine_state.h"
+#include <cstdint>
+#include <istream>
+#include <functional>
+#include <memory>
+#include <vector>
+
+/**
+ * an archive holds many stored CoroutineStates, each with an id. the
+ * entries are written as "<id> <size>\n" followed by size bytes of the
+ * stored state, so that the archive can be split up without parsing the
+ * states themselves
+ */
+class CoroutineStateArchive
+{
+public:
+	struct Entry
+	{
+		uint64_t id;
+		const char * begin;
+		const char * end;
+	};
+
+	// appends a stored state to the archive. this can be used as the sink
+	// of a CoroutineCheckpointer
+	static void Write(std::ostream & archive, uint64_t id, const std::string & stored);
+
+	// reads the whole archive into memory. returns false if the archive is
+	// malformed, in which case the entries before the error are still usable
+	bool Read(std::istream & archive);
+
+	const std::vector<Entry> & Entries() const;
+
+private:
+	std::vector<char> contents;
+	std::vector<Entry> entries;
+};
+
+/**
+ * a CoroutineState that reads from an entry of an archive. the archive has
+ * to outlive this
+ */
+struct ArchivedCoroutineState
+{
+	ArchivedCoroutineState(const CoroutineStateArchive::Entry & entry, const CoroutineStateMigrations * migrations);
+
+private:
+	MemoryStreamBuffer buffer;
+	std::istream stream;
+
+public:
+	const uint64_t id;
+	CoroutineState state;
+};
+
+struct BulkRestoreProgress
+{
+	size_t num_restored;
+	size_t num_total;
+	size_t bytes_restored;
+	double seconds;
+	double states_per_second;
+	double bytes_per_second;
+};
+
+struct BulkRestoreOptions
+{
+	BulkRestoreOptions();
+
+	// zero means one thread per core
+	size_t num_threads;
+	// will be called on the thread that called BulkRestore
+	std::function<void (const BulkRestoreProgress &)> progress;
+	size_t progress_interval_milliseconds;
+	// if set, the states are read as versioned states. the migrations run
+	// while the values are read, so they have to outlive the states
+	const CoroutineStateMigrations * migrations;
+};
+
+// the restore function will be called once for every entry in the archive,
+// concurrently on several threads. it should create the coroutine, run it
+// until it yields for the first time, and then keep the coroutine and the
+// state around
+typedef std::function<void (std::unique_ptr<ArchivedCoroutineState> state)> RestoreFunction;
+// restores all states in the archive in parallel. returns once all states
+// have been restored. if the restore function throws, no further entries
+// are restored, and the first exception is rethrown after all threads have
+// finished. the last progress that is reported before that only counts
+// the entries whose restore function returned
+BulkRestoreProgress BulkRestore(const CoroutineStateArchive & archive, RestoreFunction restore, const BulkRestoreOptions & options = BulkRestoreOptions());
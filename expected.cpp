@@ -0,0 +1,80 @@
+#include "expected.h"
+
+
+#ifndef DISABLE_GTEST
+#include <gtest/gtest.h>
+#include "coroutine.h"
+#include <string>
+
+TEST(expected, value_and_error)
+{
+	using namespace coro;
+	expected<std::string> value(std::string("hello"));
+	EXPECT_TRUE(value.has_value());
+	EXPECT_EQ("hello", value.value());
+	expected<std::string> error = unexpected(std::make_error_code(std::errc::invalid_argument));
+	EXPECT_FALSE(error);
+	EXPECT_EQ(std::errc::invalid_argument, error.error());
+#	ifndef CORO_NO_EXCEPTIONS
+		EXPECT_THROW(error.value(), std::logic_error);
+#	endif
+	error = value;
+	EXPECT_EQ("hello", error.value());
+	expected<void, int> void_error = unexpected(5);
+	EXPECT_EQ(5, void_error.error());
+	EXPECT_TRUE(expected<void>());
+}
+
+TEST(expected, coroutine)
+{
+	using namespace coro;
+	typedef coroutine<expected<int> (int)> coroutine_t;
+	coroutine_t divider([](coroutine_t::self & self, int divisor) -> expected<int>
+	{
+		for (;;)
+		{
+			if (divisor == 0) std::tie(divisor) = self.yield(unexpected(std::make_error_code(std::errc::invalid_argument)));
+			else std::tie(divisor) = self.yield(100 / divisor);
+		}
+	});
+	EXPECT_EQ(50, divider(2).value());
+	EXPECT_EQ(std::errc::invalid_argument, divider(0).error());
+	// unlike after an exception, the coroutine can keep going
+	EXPECT_EQ(25, divider(4).value());
+}
+
+#ifdef CORO_RUN_BENCHMARKS
+#include "benchmark.h"
+
+TEST(benchmark, exception_vs_expected)
+{
+	using namespace coro;
+	static const size_t iterations = 100000;
+	static const size_t stack_size = 16 * 1024;
+#	ifndef CORO_NO_EXCEPTIONS
+		run_benchmark("coroutine.exception", iterations, []
+		{
+			coroutine<void ()> thrower([](coroutine<void ()>::self &)
+			{
+				throw 10;
+			}, stack_size);
+			try
+			{
+				thrower();
+			}
+			catch(int)
+			{
+			}
+		});
+#	endif
+	run_benchmark("coroutine.expected", iterations, []
+	{
+		coroutine<expected<void, int> ()> returner([](coroutine<expected<void, int> ()>::self &) -> expected<void, int>
+		{
+			return unexpected(10);
+		}, stack_size);
+		EXPECT_FALSE(returner());
+	});
+}
+#endif
+#endif
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cassert>
+#include <new>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#ifndef CORO_NO_EXCEPTIONS
+#	include <stdexcept>
+#endif
+
+namespace coro
+{
+// use unexpected(error) to create an expected that holds an error
+template<typename E>
+struct unexpected_type
+{
+	explicit unexpected_type(E error)
+		: error(std::move(error))
+	{
+	}
+	E error;
+};
+template<typename E>
+unexpected_type<typename std::decay<E>::type> unexpected(E && error)
+{
+	return unexpected_type<typename std::decay<E>::type>(std::forward<E>(error));
+}
+
+/**
+ * expected holds either a value or an error. return this from a
+ * coroutine instead of throwing an exception if errors happen often:
+ * it is passed through the same any_storage as any other result, while
+ * an exception has to be allocated, stored in an std::exception_ptr and
+ * then rethrown by the caller
+ */
+template<typename T, typename E = std::error_code>
+struct expected
+{
+	// assignment destroys the old state before it moves in the new one. if
+	// that move threw, there would be nothing valid left to destroy
+	static_assert(std::is_nothrow_move_constructible<T>::value, "expected needs a value type that can be moved without throwing");
+	static_assert(std::is_nothrow_move_constructible<E>::value, "expected needs an error type that can be moved without throwing");
+
+	// default constructs the value. this is needed because the result of
+	// a coroutine is default constructed before it is first assigned
+	expected()
+		: holds_value(true)
+	{
+		new (&stored_value) T();
+	}
+	expected(T value)
+		: holds_value(true)
+	{
+		new (&stored_value) T(std::move(value));
+	}
+	expected(unexpected_type<E> error)
+		: holds_value(false)
+	{
+		new (&stored_error) E(std::move(error.error));
+	}
+	expected(const expected & other)
+		: holds_value(other.holds_value)
+	{
+		if (holds_value) new (&stored_value) T(other.stored_value);
+		else new (&stored_error) E(other.stored_error);
+	}
+	expected(expected && other)
+		: holds_value(other.holds_value)
+	{
+		if (holds_value) new (&stored_value) T(std::move(other.stored_value));
+		else new (&stored_error) E(std::move(other.stored_error));
+	}
+	expected & operator=(expected other)
+	{
+		destroy();
+		holds_value = other.holds_value;
+		if (holds_value) new (&stored_value) T(std::move(other.stored_value));
+		else new (&stored_error) E(std::move(other.stored_error));
+		return *this;
+	}
+	~expected()
+	{
+		destroy();
+	}
+
+	bool has_value() const
+	{
+		return holds_value;
+	}
+	explicit operator bool() const
+	{
+		return holds_value;
+	}
+
+	T & value()
+	{
+		check_has_value();
+		return stored_value;
+	}
+	const T & value() const
+	{
+		check_has_value();
+		return stored_value;
+	}
+	E & error()
+	{
+		assert(!holds_value);
+		return stored_error;
+	}
+	const E & error() const
+	{
+		assert(!holds_value);
+		return stored_error;
+	}
+
+private:
+	bool holds_value;
+	union
+	{
+		T stored_value;
+		E stored_error;
+	};
+
+	void destroy()
+	{
+		if (holds_value) stored_value.~T();
+		else stored_error.~E();
+	}
+	void check_has_value() const
+	{
+#		ifdef CORO_NO_EXCEPTIONS
+			assert(holds_value);
+#		else
+			if (!holds_value) throw std::logic_error("You tried to access the value of an expected that holds an error");
+#		endif
+	}
+};
+
+// specialization for void
+template<typename E>
+struct expected<void, E>
+{
+	expected()
+		: holds_value(true), stored_error()
+	{
+	}
+	expected(unexpected_type<E> error)
+		: holds_value(false), stored_error(std::move(error.error))
+	{
+	}
+
+	bool has_value() const
+	{
+		return holds_value;
+	}
+	explicit operator bool() const
+	{
+		return holds_value;
+	}
+	E & error()
+	{
+		assert(!holds_value);
+		return stored_error;
+	}
+	const E & error() const
+	{
+		assert(!holds_value);
+		return stored_error;
+	}
+
+private:
+	bool holds_value;
+	E stored_error;
+};
+}
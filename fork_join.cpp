@@ -0,0 +1,669 @@
+#include "fork_join.h"
+#include <algorithm>
+#include <deque>
+#include <random>
+
+namespace coro
+{
+namespace detail
+{
+	struct fork_join_task
+	{
+		typedef coro::coroutine<void ()> task_coroutine;
+
+		fork_join_task(fork_join_pool & pool, size_t stack_size)
+			: pool(pool)
+			, coroutine([](task_coroutine::self &){}, stack_size)
+			, group(nullptr)
+		{
+		}
+
+		void start(std::function<void ()> to_run, task_group * spawned_by)
+		{
+			func = std::move(to_run);
+			group = spawned_by;
+			fork_join_task * self = this;
+			coroutine.reset([self](task_coroutine::self &)
+			{
+				self->run();
+			});
+		}
+
+		fork_join_pool & pool;
+		task_coroutine coroutine;
+		std::function<void ()> func;
+		// the group that spawned this task. nullptr for the task that was
+		// passed to fork_join_pool::run()
+		task_group * group;
+
+	private:
+		void run()
+		{
+#			ifdef CORO_NO_EXCEPTIONS
+				func();
+#			else
+				try
+				{
+					func();
+				}
+				catch(...)
+				{
+					std::lock_guard<std::mutex> lock(pool.exception_mutex);
+					if (!pool.exception) pool.exception = std::current_exception();
+				}
+#			endif
+			func = nullptr;
+		}
+	};
+
+	struct fork_join_worker
+	{
+		enum task_action
+		{
+			ACTION_NONE,
+			ACTION_SPAWN,
+			ACTION_SYNC
+		};
+
+		fork_join_worker(fork_join_pool & pool, size_t index)
+			: pool(pool)
+			, index(index)
+			, running(nullptr)
+			, action(ACTION_NONE)
+			, spawned(nullptr)
+			, syncing(nullptr)
+			, random(static_cast<unsigned>(index + 1))
+		{
+		}
+
+		void run();
+		fork_join_task * allocate_task();
+		void free_task(fork_join_task * task);
+		void push_continuation(fork_join_task * task);
+		static bool is_running_task(fork_join_worker * worker);
+		// this tells the worker what to do after the running task yielded
+		void request(task_action to_do, fork_join_task * to_spawn, task_group * to_sync);
+
+		fork_join_pool & pool;
+		size_t index;
+		fork_join_task * running;
+
+	private:
+		std::mutex continuations_mutex;
+		// the newest continuation is at the back
+		std::deque<fork_join_task *> continuations;
+		std::vector<fork_join_task *> free_tasks;
+		task_action action;
+		fork_join_task * spawned;
+		task_group * syncing;
+		std::minstd_rand random;
+
+		fork_join_task * pop_continuation();
+		fork_join_task * steal();
+		void execute(fork_join_task * task);
+		fork_join_task * finish(fork_join_task * task);
+	};
+
+	namespace
+	{
+		thread_local fork_join_worker * current_worker = nullptr;
+
+#		ifndef CORO_NO_EXCEPTIONS
+			bool is_unwinding()
+			{
+#				ifdef __cpp_lib_uncaught_exceptions
+					return std::uncaught_exceptions() > 0;
+#				else
+					return std::uncaught_exception();
+#				endif
+			}
+#		endif
+	}
+	// a task can continue on a different thread after it yielded. see
+	// basic_coroutine::current()
+	CORO_NO_INLINE fork_join_worker * get_current_worker()
+	{
+		return current_worker;
+	}
+
+	bool fork_join_worker::is_running_task(fork_join_worker * worker)
+	{
+		// spawn() and sync() can only switch out the task itself, not some
+		// other coroutine that the task is running
+		return worker && worker->running && basic_coroutine::current() == &worker->running->coroutine;
+	}
+
+	void fork_join_worker::request(task_action to_do, fork_join_task * to_spawn, task_group * to_sync)
+	{
+		action = to_do;
+		spawned = to_spawn;
+		syncing = to_sync;
+	}
+
+	fork_join_task * fork_join_worker::allocate_task()
+	{
+		if (free_tasks.empty()) return pool.allocate_task();
+		fork_join_task * task = free_tasks.back();
+		free_tasks.pop_back();
+		return task;
+	}
+	void fork_join_worker::free_task(fork_join_task * task)
+	{
+		// enough to spawn a few levels deep without taking the lock of the
+		// pool. the rest goes back to the pool, where every worker can
+		// take it
+		static const size_t MAX_FREE_TASKS = 16;
+		if (free_tasks.size() < MAX_FREE_TASKS) free_tasks.push_back(task);
+		else pool.free_task(task);
+	}
+
+	void fork_join_worker::push_continuation(fork_join_task * task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(continuations_mutex);
+			continuations.push_back(task);
+		}
+		pool.num_pushed.fetch_add(1);
+		if (pool.num_sleeping.load()) pool.wake_sleeping_worker();
+	}
+	fork_join_task * fork_join_worker::pop_continuation()
+	{
+		std::lock_guard<std::mutex> lock(continuations_mutex);
+		if (continuations.empty()) return nullptr;
+		fork_join_task * task = continuations.back();
+		continuations.pop_back();
+		return task;
+	}
+	fork_join_task * fork_join_worker::steal()
+	{
+		size_t num_workers = pool.workers.size();
+		if (num_workers < 2) return nullptr;
+		size_t offset = random() % (num_workers - 1) + 1;
+		fork_join_worker & victim = *pool.workers[(index + offset) % num_workers];
+		std::lock_guard<std::mutex> lock(victim.continuations_mutex);
+		if (victim.continuations.empty()) return nullptr;
+		// the oldest continuation is the one that has the most work left
+		fork_join_task * task = victim.continuations.front();
+		victim.continuations.pop_front();
+		pool.steals.fetch_add(1, std::memory_order_relaxed);
+		return task;
+	}
+
+	void fork_join_worker::run()
+	{
+		// how often an idle worker tries to steal before it goes to sleep
+		// until the next continuation is pushed
+		static const size_t MAX_FAILED_STEALS = 64;
+		current_worker = this;
+		size_t num_failed_steals = 0;
+		for (;;)
+		{
+			size_t num_pushed = pool.num_pushed.load();
+			fork_join_task * task = pop_continuation();
+			if (!task) task = steal();
+			if (task)
+			{
+				num_failed_steals = 0;
+				execute(task);
+				continue;
+			}
+			if (pool.has_work.load(std::memory_order_acquire))
+			{
+				if (++num_failed_steals < MAX_FAILED_STEALS)
+				{
+					std::this_thread::yield();
+					continue;
+				}
+				num_failed_steals = 0;
+				std::unique_lock<std::mutex> lock(pool.state_mutex);
+				// push_continuation either sees this and wakes the worker,
+				// or it pushed before this and the wait returns right away
+				pool.num_sleeping.fetch_add(1);
+				pool.continuation_pushed.wait(lock, [this, num_pushed]
+				{
+					return pool.stopping || !pool.has_work.load(std::memory_order_relaxed) || pool.num_pushed.load() != num_pushed;
+				});
+				pool.num_sleeping.fetch_sub(1);
+				if (pool.stopping) return;
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(pool.state_mutex);
+			pool.state_changed.wait(lock, [this]
+			{
+				return pool.stopping || pool.has_work.load(std::memory_order_relaxed);
+			});
+			if (pool.stopping) return;
+		}
+	}
+
+	void fork_join_worker::execute(fork_join_task * task)
+	{
+		while (task)
+		{
+			running = task;
+			action = ACTION_NONE;
+			task->coroutine();
+			running = nullptr;
+			if (!task->coroutine)
+			{
+				fork_join_task * waiting = finish(task);
+				free_task(task);
+				task = waiting;
+			}
+			else if (action == ACTION_SPAWN)
+			{
+				// the task only gets published here, once it has switched
+				// out. otherwise a thief could resume it while it is still
+				// running on this thread
+				push_continuation(task);
+				task = spawned;
+			}
+			else if (action == ACTION_SYNC)
+			{
+				task_group & group = *syncing;
+				group.waiting = task;
+				// if the last spawned function finished in the meantime,
+				// continue right away. otherwise the thread that finishes
+				// the last one continues the task
+				if (group.pending.fetch_sub(1, std::memory_order_acq_rel) != 1) task = nullptr;
+			}
+			else
+			{
+				// the task yielded for some other reason, for example at a
+				// CORO_PREEMPTION_POINT() or while it awaits a C++20
+				// coroutine. it wants to be resumed later, so it goes back
+				// to where this worker or a thief will pick it up again
+				push_continuation(task);
+				task = nullptr;
+			}
+		}
+	}
+
+	fork_join_task * fork_join_worker::finish(fork_join_task * task)
+	{
+		task_group * group = task->group;
+		if (!group)
+		{
+			pool.finish_run();
+			return nullptr;
+		}
+		if (group->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) return group->waiting;
+		return nullptr;
+	}
+}
+
+task_group::task_group()
+	: pending(1)
+	, waiting(nullptr)
+{
+}
+task_group::~task_group()
+{
+#	ifndef CORO_NO_EXCEPTIONS
+		if (detail::is_unwinding())
+		{
+			// the thread that runs this task has nothing else queued, so
+			// the spawned functions can finish on the other threads
+			while (pending.load(std::memory_order_acquire) != 1)
+			{
+				std::this_thread::yield();
+			}
+			return;
+		}
+#	endif
+	sync();
+}
+
+void task_group::spawn(std::function<void ()> func)
+{
+	detail::fork_join_worker * worker = detail::get_current_worker();
+	if (!detail::fork_join_worker::is_running_task(worker))
+	{
+		func();
+		return;
+	}
+	pending.fetch_add(1, std::memory_order_relaxed);
+	detail::fork_join_task * child = worker->allocate_task();
+	child->start(std::move(func), this);
+	worker->request(detail::fork_join_worker::ACTION_SPAWN, child, nullptr);
+	basic_coroutine::current()->yield();
+}
+
+void task_group::sync()
+{
+	if (pending.load(std::memory_order_acquire) == 1) return;
+	detail::fork_join_worker * worker = detail::get_current_worker();
+	worker->request(detail::fork_join_worker::ACTION_SYNC, nullptr, this);
+	basic_coroutine::current()->yield();
+	// all spawned functions have finished, so the group can be used again
+	pending.store(1, std::memory_order_relaxed);
+}
+
+fork_join_pool::fork_join_pool(size_t num_threads, size_t stack_size)
+	: stack_size(stack_size)
+	, num_pushed(0)
+	, num_sleeping(0)
+	, running(false)
+	, stopping(false)
+	, has_work(false)
+	, steals(0)
+{
+	if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+	for (size_t i = 0; i < num_threads; ++i)
+	{
+		workers.emplace_back(new detail::fork_join_worker(*this, i));
+	}
+	for (size_t i = 0; i < num_threads; ++i)
+	{
+		detail::fork_join_worker * worker = workers[i].get();
+		threads.emplace_back([worker]
+		{
+			worker->run();
+		});
+	}
+}
+
+fork_join_pool::~fork_join_pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(state_mutex);
+		stopping = true;
+	}
+	state_changed.notify_all();
+	continuation_pushed.notify_all();
+	for (std::thread & thread : threads)
+	{
+		thread.join();
+	}
+}
+
+void fork_join_pool::run(std::function<void ()> func)
+{
+	std::lock_guard<std::mutex> run_lock(run_mutex);
+	detail::fork_join_task * root = allocate_task();
+	root->start(std::move(func), nullptr);
+	workers.front()->push_continuation(root);
+	std::unique_lock<std::mutex> lock(state_mutex);
+	running = true;
+	has_work.store(true, std::memory_order_release);
+	state_changed.notify_all();
+	state_changed.wait(lock, [this]
+	{
+		return !running;
+	});
+#	ifndef CORO_NO_EXCEPTIONS
+		std::exception_ptr thrown;
+		{
+			std::lock_guard<std::mutex> exception_lock(exception_mutex);
+			thrown = std::move(exception);
+			exception = nullptr;
+		}
+		if (thrown) std::rethrow_exception(thrown);
+#	endif
+}
+
+void fork_join_pool::finish_run()
+{
+	std::lock_guard<std::mutex> lock(state_mutex);
+	running = false;
+	has_work.store(false, std::memory_order_release);
+	state_changed.notify_all();
+	continuation_pushed.notify_all();
+}
+
+void fork_join_pool::wake_sleeping_worker()
+{
+	std::lock_guard<std::mutex> lock(state_mutex);
+	continuation_pushed.notify_one();
+}
+
+detail::fork_join_task * fork_join_pool::allocate_task()
+{
+	std::lock_guard<std::mutex> lock(tasks_mutex);
+	if (!free_tasks.empty())
+	{
+		detail::fork_join_task * task = free_tasks.back();
+		free_tasks.pop_back();
+		return task;
+	}
+	all_tasks.emplace_back(new detail::fork_join_task(*this, stack_size));
+	return all_tasks.back().get();
+}
+void fork_join_pool::free_task(detail::fork_join_task * task)
+{
+	std::lock_guard<std::mutex> lock(tasks_mutex);
+	free_tasks.push_back(task);
+}
+
+size_t fork_join_pool::num_threads() const
+{
+	return workers.size();
+}
+size_t fork_join_pool::num_steals() const
+{
+	return steals.load(std::memory_order_relaxed);
+}
+size_t fork_join_pool::num_tasks() const
+{
+	std::lock_guard<std::mutex> lock(tasks_mutex);
+	return all_tasks.size();
+}
+}
+
+
+#ifndef DISABLE_GTEST
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <ctime>
+
+namespace
+{
+	void parallel_quicksort(int * begin, int * end)
+	{
+		if (end - begin < 256)
+		{
+			std::sort(begin, end);
+			return;
+		}
+		int pivot = begin[(end - begin) / 2];
+		int * middle = std::partition(begin, end, [pivot](int value){ return value < pivot; });
+		int * middle_end = std::partition(middle, end, [pivot](int value){ return value == pivot; });
+		coro::task_group group;
+		group.spawn([begin, middle]
+		{
+			parallel_quicksort(begin, middle);
+		});
+		parallel_quicksort(middle_end, end);
+		group.sync();
+	}
+
+	long long tree_sum(int depth)
+	{
+		if (depth == 0) return 1;
+		long long left = 0;
+		long long right = 0;
+		coro::task_group group;
+		group.spawn([&left, depth]
+		{
+			left = tree_sum(depth - 1);
+		});
+		right = tree_sum(depth - 1);
+		group.sync();
+		return left + right;
+	}
+
+	std::vector<int> random_values(size_t count)
+	{
+		std::mt19937 random(5);
+		std::vector<int> values(count);
+		for (int & value : values)
+		{
+			value = static_cast<int>(random() % 100000);
+		}
+		return values;
+	}
+}
+
+TEST(fork_join, quicksort)
+{
+	coro::fork_join_pool pool(4);
+	std::vector<int> values = random_values(100000);
+	pool.run([&values]
+	{
+		parallel_quicksort(values.data(), values.data() + values.size());
+	});
+	EXPECT_TRUE(std::is_sorted(values.begin(), values.end()));
+	// the pool can be used again
+	long long sum = 0;
+	pool.run([&sum]
+	{
+		sum = tree_sum(12);
+	});
+	EXPECT_EQ(4096, sum);
+}
+
+TEST(fork_join, tasks_are_reused)
+{
+	coro::fork_join_pool pool(4);
+	std::vector<int> values = random_values(200000);
+	std::vector<int> to_sort;
+	auto sort = [&]
+	{
+		to_sort = values;
+		pool.run([&to_sort]
+		{
+			parallel_quicksort(to_sort.data(), to_sort.data() + to_sort.size());
+		});
+	};
+	for (int i = 0; i < 20; ++i)
+	{
+		sort();
+	}
+	size_t num_warm = pool.num_tasks();
+	for (int i = 0; i < 80; ++i)
+	{
+		sort();
+	}
+	EXPECT_TRUE(std::is_sorted(to_sort.begin(), to_sort.end()));
+	// a finished task used to stay with the thread that finished it, so
+	// every steal made the pool create a new one
+	EXPECT_LE(pool.num_tasks(), num_warm + num_warm / 4);
+}
+
+TEST(fork_join, idle_workers_sleep)
+{
+	// more threads than there is work for
+	coro::fork_join_pool pool(8);
+	long long sum = 0;
+	std::clock_t cpu_before = std::clock();
+	pool.run([&sum]
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		sum = tree_sum(10);
+	});
+	double cpu_seconds = double(std::clock() - cpu_before) / CLOCKS_PER_SEC;
+	EXPECT_EQ(1024, sum);
+	// seven threads that kept trying to steal would use more than a second
+	// of cpu time while the task sleeps
+	EXPECT_LT(cpu_seconds, 0.4);
+}
+
+TEST(fork_join, other_yields)
+{
+	// a task that yields without spawning or syncing gets resumed later
+	coro::fork_join_pool pool(2);
+	int num_yields = 0;
+	long long sum = 0;
+	pool.run([&num_yields, &sum]
+	{
+		for (; num_yields < 10; ++num_yields)
+		{
+			coro::basic_coroutine::current()->yield();
+		}
+		sum = tree_sum(6);
+	});
+	EXPECT_EQ(10, num_yields);
+	EXPECT_EQ(64, sum);
+}
+
+TEST(fork_join, without_pool)
+{
+	// runs serially
+	EXPECT_EQ(64, tree_sum(6));
+}
+
+#ifndef CORO_NO_EXCEPTIONS
+TEST(fork_join, exception)
+{
+	coro::fork_join_pool pool(2);
+	bool continued = false;
+	EXPECT_THROW(pool.run([&continued]
+	{
+		coro::task_group group;
+		group.spawn([]
+		{
+			throw std::runtime_error("spawned");
+		});
+		continued = true;
+	}), std::runtime_error);
+	EXPECT_TRUE(continued);
+}
+#endif
+
+#ifndef CORO_NO_EXCEPTIONS
+TEST(fork_join, throw_after_spawn)
+{
+	coro::fork_join_pool pool(4);
+	for (int i = 0; i < 20; ++i)
+	{
+		std::atomic<bool> spawned_finished(false);
+		EXPECT_THROW(pool.run([&spawned_finished]
+		{
+			int on_stack = 0;
+			coro::task_group group;
+			group.spawn([&spawned_finished, &on_stack]
+			{
+				// long enough for another thread to steal the continuation
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				on_stack = 1;
+				spawned_finished = true;
+			});
+			// ~task_group has to wait for the spawned function while this
+			// unwinds, without moving to another thread
+			throw std::runtime_error("parent");
+		}), std::runtime_error);
+		EXPECT_TRUE(spawned_finished);
+	}
+}
+#endif
+
+#ifdef CORO_RUN_BENCHMARKS
+#include "benchmark.h"
+#include <iostream>
+
+TEST(benchmark, fork_join_quicksort)
+{
+	std::vector<int> values = random_values(1000000);
+	std::vector<int> to_sort;
+	coro::run_benchmark("std::sort of 1M ints", 10, [&]
+	{
+		to_sort = values;
+		std::sort(to_sort.begin(), to_sort.end());
+	});
+	for (size_t num_threads = 1; num_threads <= std::thread::hardware_concurrency(); num_threads *= 2)
+	{
+		coro::fork_join_pool pool(num_threads);
+		std::string name = "parallel quicksort of 1M ints on " + std::to_string(num_threads) + " threads";
+		coro::run_benchmark(name.c_str(), 10, [&]
+		{
+			to_sort = values;
+			pool.run([&to_sort]
+			{
+				parallel_quicksort(to_sort.data(), to_sort.data() + to_sort.size());
+			});
+		});
+		std::cout << "steals: " << pool.num_steals() << std::endl;
+	}
+}
+#endif
+#endif
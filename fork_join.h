@@ -0,0 +1,124 @@
+#pragma once
+
+#include "coroutine.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifndef CORO_NO_EXCEPTIONS
+#	include <exception>
+#endif
+
+namespace coro
+{
+namespace detail
+{
+	struct fork_join_worker;
+	struct fork_join_task;
+}
+
+/**
+ * spawn and sync for recursive parallel algorithms, like in cilk. every
+ * task runs in a coroutine on one of the threads of a fork_join_pool.
+ * spawn() runs the spawned function right away on the same thread, and
+ * puts the rest of the calling task, the continuation, where other threads
+ * can steal it. if nobody steals it, the same thread continues with it
+ * after the spawned function returns. the coroutines are recycled, so
+ * spawning doesn't allocate once the pool has warmed up, unless the
+ * std::function has to allocate to store the function.
+ *
+ * a task may continue on a different thread after spawn() or sync().
+ * outside of a fork_join_pool, spawn() just calls the function and sync()
+ * does nothing
+ */
+struct task_group
+{
+	task_group();
+	// calls sync(), because the spawned functions usually refer to the
+	// stack of the function that spawned them. if an exception is unwinding
+	// the stack, this blocks the thread instead of suspending the task.
+	// otherwise the task could continue on a different thread in the
+	// middle of unwinding, which the exception handling of the C++ runtime
+	// doesn't allow
+	~task_group();
+
+	void spawn(std::function<void ()> func);
+	// waits until all spawned functions have finished
+	void sync();
+
+private:
+	friend struct detail::fork_join_worker;
+	// the number of unfinished spawned functions, plus one for as long as
+	// the spawning task is not waiting in sync()
+	std::atomic<size_t> pending;
+	detail::fork_join_task * waiting;
+
+	// intentionally not implemented
+	task_group(const task_group &);
+	task_group & operator=(const task_group &);
+};
+
+struct fork_join_pool
+{
+	// zero threads means one thread per core
+	explicit fork_join_pool(size_t num_threads = 0, size_t stack_size = CORO_DEFAULT_STACK_SIZE);
+	~fork_join_pool();
+
+	// runs func in the pool and returns when it and everything that it
+	// spawned have finished. if a task throws, the first exception is
+	// rethrown here once everything has finished
+	void run(std::function<void ()> func);
+
+	size_t num_threads() const;
+	// how often a thread has stolen a continuation from another thread
+	size_t num_steals() const;
+	// how many tasks the pool has created. finished tasks are reused, so
+	// this only grows while the pool is warming up
+	size_t num_tasks() const;
+
+private:
+	friend struct detail::fork_join_worker;
+	friend struct detail::fork_join_task;
+
+	size_t stack_size;
+	std::vector<std::unique_ptr<detail::fork_join_worker> > workers;
+	std::vector<std::thread> threads;
+	mutable std::mutex tasks_mutex;
+	std::vector<std::unique_ptr<detail::fork_join_task> > all_tasks;
+	// finished tasks that didn't fit into the free list of the worker that
+	// finished them. a task is often finished by a different worker than
+	// the one that spawned it, so without this the free lists of the
+	// thieves would keep growing while the others keep creating tasks
+	std::vector<detail::fork_join_task *> free_tasks;
+	// one call to run() at a time
+	std::mutex run_mutex;
+	std::mutex state_mutex;
+	std::condition_variable state_changed;
+	// idle workers that gave up on stealing wait for this. it is only
+	// notified if num_sleeping is not zero
+	std::condition_variable continuation_pushed;
+	std::atomic<size_t> num_pushed;
+	std::atomic<size_t> num_sleeping;
+	bool running;
+	bool stopping;
+	std::atomic<bool> has_work;
+	std::atomic<size_t> steals;
+#	ifndef CORO_NO_EXCEPTIONS
+		std::mutex exception_mutex;
+		std::exception_ptr exception;
+#	endif
+
+	detail::fork_join_task * allocate_task();
+	void free_task(detail::fork_join_task * task);
+	void finish_run();
+	void wake_sleeping_worker();
+
+	// intentionally not implemented
+	fork_join_pool(const fork_join_pool &);
+	fork_join_pool & operator=(const fork_join_pool &);
+};
+}
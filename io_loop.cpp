@@ -0,0 +1,416 @@
+#include "io_loop.h"
+#ifdef __linux__
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <limits>
+#include <system_error>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace coro
+{
+namespace
+{
+	thread_local io_loop * current_loop = nullptr;
+
+	static const size_t MAX_EVENTS_PER_WAIT = 64;
+
+	void check_system_call(bool succeeded, const char * name)
+	{
+#	ifdef CORO_NO_EXCEPTIONS
+		assert(succeeded);
+		static_cast<void>(name);
+#	else
+		if (!succeeded) throw std::system_error(errno, std::system_category(), name);
+#	endif
+	}
+}
+
+io_loop::io_task::io_task(std::function<void (task::self &)> func, size_t stack_size)
+	: coroutine(std::move(func), stack_size)
+	, index(0)
+	, waiting_for(nullptr)
+	, num_waiting_for(0)
+	, is_waiting(false)
+	, has_timer(false)
+{
+}
+
+io_loop::io_loop()
+	: epoll_fd(epoll_create1(EPOLL_CLOEXEC))
+	, running(nullptr)
+{
+	check_system_call(epoll_fd >= 0, "epoll_create1");
+}
+io_loop::~io_loop()
+{
+	close(epoll_fd);
+}
+
+void io_loop::spawn(std::function<void (task::self &)> func, size_t stack_size)
+{
+	std::unique_ptr<io_task> spawned(new io_task(std::move(func), stack_size));
+	spawned->index = tasks.size();
+	ready.push_back(spawned.get());
+	tasks.push_back(std::move(spawned));
+}
+
+bool io_loop::run_one()
+{
+	if (tasks.empty()) return false;
+	if (ready.empty()) wait_for_events();
+	if (ready.empty()) return true;
+	io_task * to_run = ready.front();
+	ready.pop_front();
+	// resets the running task even if the task throws, in which case the
+	// exception is passed on to the caller and the task is dropped
+	struct running_guard
+	{
+		~running_guard()
+		{
+			loop.running = nullptr;
+			current_loop = previous_loop;
+			if (!to_run->coroutine) loop.remove(to_run);
+			else if (!to_run->is_waiting) loop.ready.push_back(to_run);
+		}
+		io_loop & loop;
+		io_task * to_run;
+		io_loop * previous_loop;
+	} guard = { *this, to_run, current_loop };
+	running = to_run;
+	current_loop = this;
+	to_run->coroutine();
+	return true;
+}
+void io_loop::run()
+{
+	while (run_one())
+	{
+	}
+}
+
+size_t io_loop::size() const
+{
+	return tasks.size();
+}
+bool io_loop::empty() const
+{
+	return tasks.empty();
+}
+
+size_t io_loop::wait_for_fds(pollfd * fds, size_t count, clock::time_point deadline)
+{
+	io_task * waiting = running_task();
+	waiting->waiting_for = fds;
+	waiting->num_waiting_for = count;
+	size_t num_ready = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		fds[i].revents = 0;
+		if (fds[i].fd < 0) continue;
+		if (!add_waiter(fds[i].fd, waiting))
+		{
+			fds[i].revents = fds[i].events;
+			++num_ready;
+		}
+	}
+	if (num_ready)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (fds[i].fd >= 0 && !fds[i].revents) remove_waiter(fds[i].fd, waiting);
+		}
+		waiting->waiting_for = nullptr;
+		waiting->num_waiting_for = 0;
+		return num_ready;
+	}
+	if (deadline != no_deadline())
+	{
+		waiting->timer = timers.insert(std::make_pair(deadline, waiting));
+		waiting->has_timer = true;
+	}
+	suspend_running_task();
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (fds[i].revents) ++num_ready;
+	}
+	return num_ready;
+}
+short io_loop::wait_for_fd(int fd, short events, clock::time_point deadline)
+{
+	pollfd to_wait_for = { fd, events, 0 };
+	wait_for_fds(&to_wait_for, 1, deadline);
+	return to_wait_for.revents;
+}
+void io_loop::sleep_until(clock::time_point deadline)
+{
+	wait_for_fds(nullptr, 0, deadline);
+}
+
+io_loop * io_loop::current()
+{
+	return current_loop;
+}
+bool io_loop::is_inside_task() const
+{
+	return running && basic_coroutine::current() == &running->coroutine;
+}
+
+io_loop::clock::time_point io_loop::no_deadline()
+{
+	return clock::time_point::max();
+}
+
+io_loop::io_task * io_loop::running_task() const
+{
+#	ifdef CORO_NO_EXCEPTIONS
+		assert(is_inside_task());
+#	else
+		if (!is_inside_task()) throw std::logic_error("You can only wait from inside of a task of the io_loop");
+#	endif
+	return running;
+}
+void io_loop::suspend_running_task()
+{
+	io_task * waiting = running;
+	waiting->is_waiting = true;
+	waiting->coroutine.yield();
+}
+
+bool io_loop::add_waiter(int fd, io_task * waiting)
+{
+	fd_waiters & for_fd = waiters[fd];
+	for_fd.tasks.push_back(waiting);
+	update_registration(fd, for_fd);
+	if (for_fd.registered_events) return true;
+	// epoll refuses file descriptors that are always ready
+	waiters.erase(fd);
+	return false;
+}
+void io_loop::remove_waiter(int fd, io_task * waiting)
+{
+	auto found = waiters.find(fd);
+	if (found == waiters.end()) return;
+	std::vector<io_task *> & for_fd = found->second.tasks;
+	for_fd.erase(std::remove(for_fd.begin(), for_fd.end(), waiting), for_fd.end());
+	update_registration(fd, found->second);
+	if (for_fd.empty()) waiters.erase(found);
+}
+void io_loop::update_registration(int fd, fd_waiters & for_fd)
+{
+	uint32_t events = 0;
+	for (io_task * waiting : for_fd.tasks)
+	{
+		for (size_t i = 0; i < waiting->num_waiting_for; ++i)
+		{
+			if (waiting->waiting_for[i].fd == fd) events |= static_cast<uint16_t>(waiting->waiting_for[i].events);
+		}
+	}
+	if (events == for_fd.registered_events) return;
+	epoll_event event = {};
+	event.events = events;
+	event.data.fd = fd;
+	int result;
+	if (!events) result = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &event);
+	else if (!for_fd.registered_events) result = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+	else result = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+	if (result == 0) for_fd.registered_events = events;
+	else if (errno == EPERM) for_fd.registered_events = 0;
+	else check_system_call(false, "epoll_ctl");
+}
+
+void io_loop::wake(io_task * to_wake)
+{
+	if (!to_wake->is_waiting) return;
+	pollfd * fds = to_wake->waiting_for;
+	size_t count = to_wake->num_waiting_for;
+	to_wake->is_waiting = false;
+	to_wake->waiting_for = nullptr;
+	to_wake->num_waiting_for = 0;
+	if (to_wake->has_timer)
+	{
+		timers.erase(to_wake->timer);
+		to_wake->has_timer = false;
+	}
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (fds[i].fd >= 0) remove_waiter(fds[i].fd, to_wake);
+	}
+	ready.push_back(to_wake);
+}
+
+void io_loop::wait_for_events()
+{
+	int timeout = -1;
+	if (!timers.empty())
+	{
+		clock::duration remaining = timers.begin()->first - clock::now();
+		timeout = 0;
+		if (remaining > clock::duration::zero())
+		{
+			// round up, so that the timer has expired when epoll_wait returns
+			std::chrono::milliseconds milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(remaining);
+			if (milliseconds < remaining) ++milliseconds;
+			// a timer that is more than 24 days out doesn't fit into the int.
+			// epoll_wait returns early then and the loop waits again
+			timeout = static_cast<int>(std::min<std::chrono::milliseconds::rep>(milliseconds.count(), std::numeric_limits<int>::max()));
+		}
+	}
+	epoll_event events[MAX_EVENTS_PER_WAIT];
+	int num_events = epoll_wait(epoll_fd, events, MAX_EVENTS_PER_WAIT, timeout);
+	check_system_call(num_events >= 0 || errno == EINTR, "epoll_wait");
+	for (int i = 0; i < num_events; ++i)
+	{
+		int fd = events[i].data.fd;
+		auto found = waiters.find(fd);
+		if (found == waiters.end()) continue;
+		std::vector<io_task *> to_wake;
+		for (io_task * waiting : found->second.tasks)
+		{
+			bool is_ready = false;
+			for (size_t j = 0; j < waiting->num_waiting_for; ++j)
+			{
+				pollfd & waited_for = waiting->waiting_for[j];
+				if (waited_for.fd != fd) continue;
+				// errors and hangups are always reported, like poll does
+				waited_for.revents = static_cast<short>(events[i].events & (static_cast<uint16_t>(waited_for.events) | EPOLLERR | EPOLLHUP));
+				if (waited_for.revents) is_ready = true;
+			}
+			if (is_ready) to_wake.push_back(waiting);
+		}
+		for (io_task * waiting : to_wake)
+		{
+			wake(waiting);
+		}
+	}
+	clock::time_point now = clock::now();
+	while (!timers.empty() && timers.begin()->first <= now)
+	{
+		wake(timers.begin()->second);
+	}
+}
+
+void io_loop::remove(io_task * finished)
+{
+	assert(!finished->is_waiting);
+	size_t index = finished->index;
+	if (index + 1 != tasks.size())
+	{
+		std::swap(tasks[index], tasks.back());
+		tasks[index]->index = index;
+	}
+	tasks.pop_back();
+}
+}
+#endif
+
+
+#ifndef DISABLE_GTEST
+#ifdef __linux__
+#include <gtest/gtest.h>
+#include <string>
+#include <sys/socket.h>
+
+TEST(io_loop, wait_for_pipe)
+{
+	using namespace coro;
+	int pipe_fds[2];
+	ASSERT_EQ(0, pipe(pipe_fds));
+	io_loop loop;
+	std::string received;
+	loop.spawn([&](io_loop::task::self &)
+	{
+		EXPECT_EQ(POLLIN, loop.wait_for_fd(pipe_fds[0], POLLIN));
+		char buffer[16];
+		ssize_t num_read = read(pipe_fds[0], buffer, sizeof(buffer));
+		ASSERT_LT(0, num_read);
+		received.assign(buffer, num_read);
+	});
+	loop.spawn([&](io_loop::task::self & self)
+	{
+		// the reader is waiting now
+		self.yield();
+		EXPECT_TRUE(received.empty());
+		EXPECT_EQ(5, write(pipe_fds[1], "hello", 5));
+	});
+	loop.run();
+	EXPECT_EQ("hello", received);
+	EXPECT_TRUE(loop.empty());
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+}
+
+TEST(io_loop, timers)
+{
+	using namespace coro;
+	io_loop loop;
+	std::vector<int> order;
+	io_loop::clock::time_point start = io_loop::clock::now();
+	for (int i = 3; i > 0; --i)
+	{
+		loop.spawn([&loop, &order, start, i](io_loop::task::self &)
+		{
+			loop.sleep_until(start + std::chrono::milliseconds(i * 5));
+			EXPECT_LE(start + std::chrono::milliseconds(i * 5), io_loop::clock::now());
+			order.push_back(i);
+		});
+	}
+	// a timeout while waiting for a file descriptor that never gets ready
+	int pipe_fds[2];
+	ASSERT_EQ(0, pipe(pipe_fds));
+	loop.spawn([&](io_loop::task::self &)
+	{
+		EXPECT_EQ(0, loop.wait_for_fd(pipe_fds[0], POLLIN, start + std::chrono::milliseconds(1)));
+		order.push_back(0);
+	});
+	loop.run();
+	EXPECT_EQ((std::vector<int>{ 0, 1, 2, 3 }), order);
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+}
+
+TEST(io_loop, many_sockets)
+{
+	using namespace coro;
+	static const int NUM_PAIRS = 100;
+	io_loop loop;
+	int num_echoed = 0;
+	for (int i = 0; i < NUM_PAIRS; ++i)
+	{
+		int sockets[2];
+		ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+		loop.spawn([&loop, sockets](io_loop::task::self &)
+		{
+			loop.wait_for_fd(sockets[1], POLLIN);
+			char c;
+			ASSERT_EQ(1, read(sockets[1], &c, 1));
+			ASSERT_EQ(1, write(sockets[1], &c, 1));
+			close(sockets[1]);
+		});
+		loop.spawn([&loop, &num_echoed, sockets, i](io_loop::task::self &)
+		{
+			char c = static_cast<char>(i);
+			ASSERT_EQ(1, write(sockets[0], &c, 1));
+			loop.wait_for_fd(sockets[0], POLLIN);
+			char echoed = 0;
+			ASSERT_EQ(1, read(sockets[0], &echoed, 1));
+			EXPECT_EQ(c, echoed);
+			++num_echoed;
+			close(sockets[0]);
+		});
+	}
+	loop.run();
+	EXPECT_EQ(NUM_PAIRS, num_echoed);
+}
+
+#ifndef CORO_NO_EXCEPTIONS
+TEST(io_loop, wait_outside_of_task)
+{
+	coro::io_loop loop;
+	EXPECT_THROW(loop.sleep_until(coro::io_loop::clock::now()), std::logic_error);
+}
+#endif
+#endif
+#endif
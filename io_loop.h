@@ -0,0 +1,115 @@
+#pragma once
+
+#include "coroutine.h"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#ifdef __linux__
+#	include <poll.h>
+#endif
+
+#ifdef __linux__
+namespace coro
+{
+/**
+ * runs coroutines on one thread and suspends them while they wait for file
+ * descriptors or timers. the waiting is done with epoll, so one thread can
+ * serve many connections. tasks call wait_for_fds or sleep_until on the
+ * loop, or they call plain read, write, connect, poll and nanosleep through
+ * the shims in syscall_shims.h, which do that for them.
+ *
+ * tasks run in the order in which they became ready. a task that yields
+ * without waiting for anything goes to the back of the line. this is not
+ * thread safe, use one io_loop per thread
+ */
+struct io_loop
+{
+	typedef coroutine<void ()> task;
+	typedef std::chrono::steady_clock clock;
+
+	io_loop();
+	~io_loop();
+
+	// can also be called from inside of a task
+	void spawn(std::function<void (task::self &)> func, size_t stack_size = CORO_DEFAULT_STACK_SIZE);
+
+	// runs the next task that is ready until it yields or finishes. if no
+	// task is ready, this first waits until one is. returns false if there
+	// were no tasks left
+	bool run_one();
+	// runs until all tasks have finished
+	void run();
+
+	// the number of tasks that haven't finished yet
+	size_t size() const;
+	bool empty() const;
+
+	// these may only be called from inside of a task of this loop. they
+	// suspend the task until one of the file descriptors is ready or until
+	// the deadline. the revents of the pollfds are set like poll() sets
+	// them, and the number of ready file descriptors is returned. file
+	// descriptors that epoll can't wait for, like regular files, are
+	// always ready
+	size_t wait_for_fds(pollfd * fds, size_t count, clock::time_point deadline = no_deadline());
+	// returns the ready events, or 0 if the deadline passed first
+	short wait_for_fd(int fd, short events, clock::time_point deadline = no_deadline());
+	void sleep_until(clock::time_point deadline);
+
+	// the loop that is running a task on this thread right now, or nullptr
+	static io_loop * current();
+	// true if this is called from inside of a task of this loop, and not
+	// from a coroutine that a task called
+	bool is_inside_task() const;
+
+	static clock::time_point no_deadline();
+
+private:
+	struct io_task
+	{
+		io_task(std::function<void (task::self &)> func, size_t stack_size);
+
+		task coroutine;
+		// the index in io_loop::tasks
+		size_t index;
+		// points to the stack of the task while it waits
+		pollfd * waiting_for;
+		size_t num_waiting_for;
+		bool is_waiting;
+		bool has_timer;
+		std::multimap<clock::time_point, io_task *>::iterator timer;
+	};
+	struct fd_waiters
+	{
+		uint32_t registered_events;
+		std::vector<io_task *> tasks;
+	};
+
+	int epoll_fd;
+	std::vector<std::unique_ptr<io_task> > tasks;
+	std::deque<io_task *> ready;
+	std::unordered_map<int, fd_waiters> waiters;
+	std::multimap<clock::time_point, io_task *> timers;
+	io_task * running;
+
+	io_task * running_task() const;
+	void suspend_running_task();
+	// returns false if epoll can't wait for the file descriptor
+	bool add_waiter(int fd, io_task * waiting);
+	void remove_waiter(int fd, io_task * waiting);
+	void update_registration(int fd, fd_waiters & for_fd);
+	void wake(io_task * to_wake);
+	void wait_for_events();
+	void remove(io_task * finished);
+
+	// intentionally not implemented
+	io_loop(const io_loop &);
+	io_loop & operator=(const io_loop &);
+};
+}
+#endif
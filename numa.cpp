@@ -0,0 +1,278 @@
+#include "numa.h"
+#include "stack_arena.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#ifdef __linux__
+#	include <sched.h>
+#	include <sys/syscall.h>
+#	include <unistd.h>
+#endif
+
+namespace coro
+{
+namespace
+{
+	std::atomic<size_t> node_count_override(0);
+
+#ifdef __linux__
+	// from numaif.h, which is only installed together with libnuma
+	static const int MPOL_PREFERRED_POLICY = 1;
+
+	// parses one number of a sysfs list. strtoul would also skip whitespace
+	// and accept a sign, so this checks for a digit first
+	bool parse_sysfs_number(const char *& position, size_t & result)
+	{
+		if (*position < '0' || *position > '9') return false;
+		char * end = nullptr;
+		errno = 0;
+		unsigned long number = std::strtoul(position, &end, 10);
+		if (errno != 0) return false;
+		result = number;
+		position = end;
+		return true;
+	}
+	// parses lists like "0-3,8,10-11" as used in /sys/devices/system/node.
+	// returns an empty list if the list is malformed
+	std::vector<size_t> parse_sysfs_list(const std::string & list)
+	{
+		std::vector<size_t> result;
+		const char * position = list.c_str();
+		while (*position)
+		{
+			size_t first = 0;
+			if (!parse_sysfs_number(position, first)) return std::vector<size_t>();
+			size_t last = first;
+			if (*position == '-')
+			{
+				++position;
+				if (!parse_sysfs_number(position, last) || last < first) return std::vector<size_t>();
+			}
+			for (size_t i = first; i <= last; ++i)
+			{
+				result.push_back(i);
+			}
+			if (*position == ',') ++position;
+			else if (*position) return std::vector<size_t>();
+		}
+		return result;
+	}
+	std::vector<size_t> read_sysfs_list(const std::string & path)
+	{
+		std::ifstream file(path);
+		std::string list;
+		if (!std::getline(file, list)) return std::vector<size_t>();
+		return parse_sysfs_list(list);
+	}
+#endif
+}
+
+size_t numa_node_count()
+{
+	size_t overridden = node_count_override.load(std::memory_order_relaxed);
+	if (overridden) return overridden;
+#ifdef __linux__
+	static const size_t count = []() -> size_t
+	{
+		std::vector<size_t> nodes = read_sysfs_list("/sys/devices/system/node/online");
+		return nodes.empty() ? 1 : nodes.back() + 1;
+	}();
+	return count;
+#else
+	return 1;
+#endif
+}
+
+size_t current_numa_node()
+{
+#ifdef __linux__
+	if (numa_node_count() == 1) return 0;
+	unsigned cpu = 0;
+	unsigned node = 0;
+	// glibc's getcpu goes through the vDSO, so it doesn't enter the kernel
+#	if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+		if (getcpu(&cpu, &node) != 0) return 0;
+#	else
+		if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) return 0;
+#	endif
+	return node;
+#else
+	return 0;
+#endif
+}
+
+void override_numa_node_count(size_t count)
+{
+	node_count_override.store(count, std::memory_order_relaxed);
+}
+
+stack_memory allocate_on_numa_node(size_t size, size_t node)
+{
+#ifdef __linux__
+	if (numa_node_count() > 1 && node < numa_node_count())
+	{
+		// mbind works on whole pages, so the memory can't come from new[].
+		// mapping and binding every stack on its own would be three
+		// syscalls per coroutine, so the stacks are pooled. the arenas are
+		// leaked because stacks may be given back during static destruction
+		static std::mutex mutex;
+		static std::map<std::pair<size_t, size_t>, stack_arena *> arenas;
+		stack_arena * for_node;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stack_arena *& in_map = arenas[std::make_pair(node, size)];
+			if (!in_map)
+			{
+				stack_arena_options options;
+				options.numa_node = node;
+				in_map = new stack_arena(size, options);
+			}
+			for_node = in_map;
+		}
+		return for_node->allocate();
+	}
+#endif
+	static_cast<void>(node);
+	stack_memory_deleter deleter = { nullptr, size, nullptr };
+	return stack_memory(new unsigned char[size], deleter);
+}
+
+bool bind_to_numa_node(void * memory, size_t size, size_t node)
+{
+#ifdef __linux__
+	if (node >= numa_node_count()) return false;
+	const size_t bits_per_word = sizeof(unsigned long) * 8;
+	std::vector<unsigned long> node_mask(node / bits_per_word + 1);
+	node_mask[node / bits_per_word] |= 1ul << (node % bits_per_word);
+	// the kernel only reads maxnode - 1 bits of the mask
+	size_t max_node = node_mask.size() * bits_per_word + 1;
+	return syscall(SYS_mbind, memory, size, MPOL_PREFERRED_POLICY, node_mask.data(), max_node, 0) == 0;
+#else
+	static_cast<void>(memory);
+	static_cast<void>(size);
+	return node == 0;
+#endif
+}
+
+bool set_thread_numa_node(size_t node)
+{
+#ifdef __linux__
+	if (node >= numa_node_count()) return false;
+	if (numa_node_count() == 1) return true;
+	std::vector<size_t> cpus = read_sysfs_list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+	if (cpus.empty()) return false;
+	cpu_set_t cpu_set;
+	CPU_ZERO(&cpu_set);
+	for (size_t cpu : cpus)
+	{
+		if (cpu < CPU_SETSIZE) CPU_SET(cpu, &cpu_set);
+	}
+	return sched_setaffinity(0, sizeof(cpu_set), &cpu_set) == 0;
+#else
+	return node == 0;
+#endif
+}
+}
+
+
+#ifndef DISABLE_GTEST
+#include <gtest/gtest.h>
+#include "coroutine.h"
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+TEST(numa, allocate)
+{
+	using namespace coro;
+	ASSERT_LE(1u, numa_node_count());
+	EXPECT_LT(current_numa_node(), numa_node_count());
+	for (size_t node = 0; node < numa_node_count(); ++node)
+	{
+		stack_memory memory = allocate_on_numa_node(64 * 1024, node);
+		ASSERT_TRUE(memory != nullptr);
+		std::memset(memory.get(), 1, 64 * 1024);
+	}
+}
+
+#ifdef __linux__
+#include <sys/mman.h>
+
+TEST(numa, bind)
+{
+	using namespace coro;
+	size_t size = 64 * 1024;
+	void * memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ASSERT_NE(MAP_FAILED, memory);
+	EXPECT_TRUE(bind_to_numa_node(memory, size, current_numa_node()));
+	EXPECT_FALSE(bind_to_numa_node(memory, size, numa_node_count()));
+	std::memset(memory, 1, size);
+	munmap(memory, size);
+}
+#endif
+
+TEST(numa, several_nodes)
+{
+	using namespace coro;
+	// on a machine with one node this pretends that there is a second one
+	// without memory, so that the stacks come from the pooled arenas
+	size_t count = std::max<size_t>(2, numa_node_count());
+	override_numa_node_count(count);
+	size_t stack_size = 64 * 1024;
+	for (size_t node = 0; node < count; ++node)
+	{
+		stack_memory first = allocate_on_numa_node(stack_size, node);
+		stack_memory second = allocate_on_numa_node(stack_size, node);
+		ASSERT_TRUE(first != nullptr);
+		ASSERT_TRUE(second != nullptr);
+		// both came from the arena for this node and size
+		EXPECT_TRUE(first.get_deleter().release != nullptr);
+		EXPECT_EQ(first.get_deleter().context, second.get_deleter().context);
+		std::memset(first.get(), 1, stack_size);
+		std::memset(second.get(), 1, stack_size);
+	}
+	EXPECT_NE(allocate_on_numa_node(stack_size, 0).get_deleter().context, allocate_on_numa_node(stack_size, 1).get_deleter().context);
+	EXPECT_FALSE(set_thread_numa_node(count));
+
+	coroutine<int ()> on_node([](coroutine<int ()>::self &)
+	{
+		return 5;
+	}, stack_size);
+	EXPECT_LT(on_node.numa_node(), count);
+	EXPECT_EQ(5, on_node());
+	override_numa_node_count(0);
+}
+
+TEST(numa, worker_thread)
+{
+	using namespace coro;
+	size_t node = numa_node_count() - 1;
+	bool pinned = false;
+	size_t current = 0;
+	size_t coroutine_node = numa_node_count();
+	int result = 0;
+	std::thread worker([&]
+	{
+		pinned = set_thread_numa_node(node);
+		current = current_numa_node();
+		coroutine<int ()> on_node([](coroutine<int ()>::self &)
+		{
+			return 5;
+		});
+		coroutine_node = on_node.numa_node();
+		result = on_node();
+	});
+	worker.join();
+	EXPECT_TRUE(pinned);
+	EXPECT_EQ(node, current);
+	EXPECT_EQ(node, coroutine_node);
+	EXPECT_EQ(5, result);
+	EXPECT_FALSE(set_thread_numa_node(numa_node_count()));
+}
+#endif
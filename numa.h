@@ -0,0 +1,44 @@
+#pragma once
+
+#include "stack_memory.h"
+#include <cstddef>
+
+namespace coro
+{
+/**
+ * helpers for placing coroutine stacks on the NUMA node of the thread that
+ * creates them. on machines with only one node, and on platforms other
+ * than linux, every function here falls back to doing nothing special:
+ * there is one node, memory comes from new[] and threads are not pinned
+ */
+// one more than the highest node id that is online. node ids can have
+// gaps, for example if a node was taken offline, so this isn't always the
+// number of nodes. it's meant for sizing arrays that are indexed by node
+size_t numa_node_count();
+// the node of the cpu that the calling thread is running on. the thread
+// can move to another node right after this returns, so call it once and
+// keep the result if several things should end up on the same node
+size_t current_numa_node();
+// makes numa_node_count() return the given count, so that the code for
+// machines with several nodes can be tested on a machine with one. nodes
+// that don't exist behave like nodes without cpus: memory can't be bound
+// to them and threads can't be moved to them. zero goes back to the count
+// of the system
+void override_numa_node_count(size_t count);
+
+// allocates memory that will be placed on the given node when it is first
+// touched. if the node doesn't have enough memory, other nodes are used.
+// on machines with several nodes the memory comes from a stack_arena for
+// that node and size, so that creating a coroutine doesn't have to map
+// memory. those arenas are never freed
+stack_memory allocate_on_numa_node(size_t size, size_t node);
+// asks the kernel to place the pages of the memory on the node when they
+// are first touched. the memory has to be page aligned. returns false if
+// that didn't work, in which case the memory is still usable
+bool bind_to_numa_node(void * memory, size_t size, size_t node);
+
+// restricts the calling thread to the cpus of the given node. use this for
+// worker threads so that the coroutines that they create keep running next
+// to their stacks. returns false if the thread could not be restricted
+bool set_thread_numa_node(size_t node);
+}
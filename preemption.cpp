@@ -0,0 +1,260 @@
+#include "preemption.h"
+#include "coroutine.h"
+#include <cassert>
+#include <mutex>
+#ifdef __linux__
+#	include <sys/syscall.h>
+#	include <time.h>
+#	include <unistd.h>
+#endif
+
+// older versions of glibc don't have the name for this field
+#if defined(__linux__) && !defined(sigev_notify_thread_id)
+#	define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+namespace coro
+{
+namespace
+{
+	// set by the signal handler
+	thread_local volatile std::sig_atomic_t preemption_flag = 0;
+	// also set by the signal handler, but only cleared when the timer is
+	// started again
+	thread_local volatile std::sig_atomic_t time_slice_expired = 0;
+	// the timer of this thread
+	thread_local preemption_timer * thread_timer = nullptr;
+
+#ifdef __linux__
+	CORO_NO_INSTRUMENT void on_preemption_signal(int)
+	{
+		preemption_flag = 1;
+		time_slice_expired = 1;
+	}
+	void install_signal_handler()
+	{
+		static std::once_flag installed;
+		std::call_once(installed, []
+		{
+			struct sigaction action = {};
+			action.sa_handler = &on_preemption_signal;
+			// restarts reads and writes that the signal interrupts. some
+			// calls, like nanosleep, poll and epoll_wait, fail with EINTR
+			// anyway
+			action.sa_flags = SA_RESTART;
+			sigemptyset(&action.sa_mask);
+			sigaction(SIGALRM, &action, nullptr);
+		});
+	}
+#endif
+}
+
+preemption_timer::preemption_timer(std::chrono::microseconds time_slice)
+	: timer(nullptr)
+	, time_slice(time_slice)
+	, active(false)
+{
+	assert(!thread_timer);
+#ifdef __linux__
+	install_signal_handler();
+	// the signal has to go to this thread, not to any thread in the process
+	sigevent event = {};
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = SIGALRM;
+	event.sigev_notify_thread_id = static_cast<pid_t>(syscall(SYS_gettid));
+	timer_t created;
+	if (timer_create(CLOCK_MONOTONIC, &event, &created) != 0) return;
+	timer = created;
+	if (!start())
+	{
+		timer_delete(created);
+		timer = nullptr;
+		return;
+	}
+	active = true;
+	thread_timer = this;
+#else
+	static_cast<void>(time_slice);
+#endif
+}
+
+preemption_timer::~preemption_timer()
+{
+#ifdef __linux__
+	if (active)
+	{
+		timer_delete(static_cast<timer_t>(timer));
+		thread_timer = nullptr;
+	}
+#endif
+}
+
+bool preemption_timer::is_active() const
+{
+	return active;
+}
+
+bool preemption_timer::start()
+{
+#ifdef __linux__
+	// one-shot, begin_time_slice() starts it again
+	itimerspec expiry = {};
+	expiry.it_value.tv_sec = static_cast<time_t>(time_slice.count() / 1000000);
+	expiry.it_value.tv_nsec = static_cast<long>(time_slice.count() % 1000000 * 1000);
+	return timer_settime(static_cast<timer_t>(timer), 0, &expiry, nullptr) == 0;
+#else
+	return false;
+#endif
+}
+
+bool preemption_requested()
+{
+	return preemption_flag != 0;
+}
+void begin_time_slice()
+{
+	preemption_flag = 0;
+	if (time_slice_expired)
+	{
+		time_slice_expired = 0;
+		if (thread_timer) thread_timer->start();
+	}
+}
+
+void preempt_current()
+{
+	// cleared first, so that the calls below don't come back here through
+	// the hook of -finstrument-functions. the time slice is started again
+	// by whoever resumes the next coroutine
+	preemption_flag = 0;
+	basic_coroutine * current = basic_coroutine::current();
+	if (!current)
+	{
+		// the next coroutine that runs on this thread still has to yield
+		preemption_flag = 1;
+		return;
+	}
+	current->yield();
+}
+}
+
+#ifdef CORO_PREEMPT_AT_FUNCTION_ENTRY
+// called by the code that -finstrument-functions inserts
+extern "C" CORO_NO_INSTRUMENT void __cyg_profile_func_enter(void *, void *)
+{
+	if (coro::preemption_requested()) coro::preempt_current();
+}
+extern "C" CORO_NO_INSTRUMENT void __cyg_profile_func_exit(void *, void *)
+{
+}
+#endif
+
+
+#ifndef DISABLE_GTEST
+#include <gtest/gtest.h>
+
+#ifdef __linux__
+TEST(preemption, time_slice)
+{
+	using namespace coro;
+	preemption_timer timer(std::chrono::milliseconds(1));
+	ASSERT_TRUE(timer.is_active());
+	bool stop = false;
+	size_t iterations = 0;
+	coroutine<void ()> busy([&](coroutine<void ()>::self &)
+	{
+		// never yields on its own
+		while (!stop)
+		{
+			++iterations;
+			CORO_PREEMPTION_POINT();
+		}
+	});
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	size_t num_preempted = 0;
+	while (num_preempted < 5 && std::chrono::steady_clock::now() - start < std::chrono::seconds(10))
+	{
+		begin_time_slice();
+		busy();
+		++num_preempted;
+	}
+	EXPECT_EQ(5u, num_preempted);
+	EXPECT_LT(0u, iterations);
+	stop = true;
+	busy();
+	EXPECT_FALSE(busy);
+}
+#endif
+
+#ifdef CORO_PREEMPT_AT_FUNCTION_ENTRY
+namespace
+{
+	__attribute__((noinline)) void count_iteration(volatile size_t & iterations)
+	{
+		iterations = iterations + 1;
+	}
+}
+
+TEST(preemption, function_entry)
+{
+	using namespace coro;
+	preemption_timer timer(std::chrono::milliseconds(1));
+	ASSERT_TRUE(timer.is_active());
+	volatile bool stop = false;
+	volatile size_t iterations = 0;
+	coroutine<void ()> busy([&](coroutine<void ()>::self &)
+	{
+		// no preemption points, only function calls
+		while (!stop)
+		{
+			count_iteration(iterations);
+		}
+	});
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	size_t num_preempted = 0;
+	while (num_preempted < 5 && std::chrono::steady_clock::now() - start < std::chrono::seconds(10))
+	{
+		begin_time_slice();
+		busy();
+		++num_preempted;
+	}
+	EXPECT_EQ(5u, num_preempted);
+	EXPECT_LT(0u, iterations);
+	stop = true;
+	while (busy)
+	{
+		begin_time_slice();
+		busy();
+	}
+}
+#endif
+
+TEST(preemption, outside_of_coroutine)
+{
+	using namespace coro;
+	preemption_flag = 1;
+	// does nothing
+	CORO_PREEMPTION_POINT();
+	EXPECT_TRUE(preemption_requested());
+	begin_time_slice();
+	EXPECT_FALSE(preemption_requested());
+}
+
+#ifdef CORO_RUN_BENCHMARKS
+#include "benchmark.h"
+
+TEST(benchmark, preemption_point)
+{
+	volatile size_t sum = 0;
+	coro::run_benchmark("loop without preemption points", 100000000, [&sum]
+	{
+		sum = sum + 1;
+	});
+	coro::run_benchmark("loop with a preemption point", 100000000, [&sum]
+	{
+		sum = sum + 1;
+		CORO_PREEMPTION_POINT();
+	});
+}
+#endif
+#endif
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "stack_swap.h"
+#include <chrono>
+#include <csignal>
+
+namespace coro
+{
+/**
+ * opt-in preemption for coroutines that run for a long time without
+ * yielding. a preemption_timer sends a signal to its thread when a time
+ * slice is used up, and the signal handler only sets a flag. the running coroutine
+ * yields at the next CORO_PREEMPTION_POINT() after the flag was set. so a
+ * coroutine is never switched out in the middle of something, only at the
+ * points that it marked as safe. the coroutine yields without producing a
+ * value, so this is meant for coroutine<void ()> tasks like the ones in
+ * scheduler.h, which starts a new time slice every time it resumes a task.
+ *
+ * if you compile with -finstrument-functions and define
+ * CORO_PREEMPT_AT_FUNCTION_ENTRY, every function entry is a preemption
+ * point. only do that if all code that runs in coroutines can be switched
+ * out at any function call, for example if it doesn't hold locks. the
+ * hook and the stack switching are marked so that they are never
+ * instrumented themselves. to test this mode, build everything with
+ *     -finstrument-functions -DCORO_PREEMPT_AT_FUNCTION_ENTRY
+ * which also turns on the preemption.function_entry test.
+ *
+ * the timer is one-shot: it only fires again after begin_time_slice() was
+ * called after the last expiry, so a thread that has no tasks to run is
+ * left alone. the signal still interrupts blocking system calls like
+ * nanosleep, poll, epoll_wait and select, which fail with EINTR no matter
+ * what, so code that runs while a time slice is active has to handle that.
+ *
+ * this is only implemented on linux. elsewhere the timer does nothing
+ */
+struct preemption_timer
+{
+	// uses SIGALRM. don't use SIGALRM for anything else in the process.
+	// there can only be one timer per thread
+	explicit preemption_timer(std::chrono::microseconds time_slice);
+	~preemption_timer();
+
+	// false if the timer couldn't be created
+	bool is_active() const;
+	// starts the next time slice. begin_time_slice() does this for the
+	// timer of the thread
+	bool start();
+
+private:
+	void * timer;
+	std::chrono::microseconds time_slice;
+	bool active;
+
+	// intentionally not implemented
+	preemption_timer(const preemption_timer &);
+	preemption_timer & operator=(const preemption_timer &);
+};
+
+// true if the time slice of the running coroutine is used up. a coroutine
+// can be resumed on a different thread after it yielded, for example a
+// task of fork_join.h, so the flags of the thread are read in functions
+// that are not inlined. otherwise the compiler could keep using the
+// address of the flag of the thread that the coroutine ran on before
+CORO_NO_INSTRUMENT CORO_NO_INLINE bool preemption_requested();
+// call this before resuming a coroutine. this only makes a system call if
+// the last time slice ran out
+CORO_NO_INSTRUMENT CORO_NO_INLINE void begin_time_slice();
+// yields the current coroutine. does nothing outside of a coroutine
+CORO_NO_INSTRUMENT void preempt_current();
+}
+
+#define CORO_PREEMPTION_POINT() do { if (::coro::preemption_requested()) ::coro::preempt_current(); } while (false)
@@ -0,0 +1,265 @@
+#include "scheduler.h"
+#include "preemption.h"
+#include <algorithm>
+
+namespace coro
+{
+scheduler_options::scheduler_options()
+	: starvation_limit(32)
+{
+}
+
+scheduler::scheduled_task::scheduled_task(std::function<void (task::self &)> func, scheduling_priority priority, clock::time_point deadline, size_t sequence, size_t stack_size)
+	: coroutine(std::move(func), stack_size)
+	, priority(priority)
+	, deadline(deadline)
+	, sequence(sequence)
+{
+}
+
+bool scheduler::runs_later::operator()(const std::unique_ptr<scheduled_task> & lhs, const std::unique_ptr<scheduled_task> & rhs) const
+{
+	// std::push_heap puts the largest element first, so the task that
+	// should run first has to compare as the largest
+	if (lhs->deadline != rhs->deadline) return lhs->deadline > rhs->deadline;
+	return lhs->sequence > rhs->sequence;
+}
+
+scheduler::scheduler(scheduler_options options)
+	: options(options)
+	, next_sequence(0)
+	, num_running(0)
+{
+	std::fill(times_passed_over, times_passed_over + NUM_PRIORITIES, 0);
+}
+
+void scheduler::spawn(std::function<void (task::self &)> func, scheduling_priority priority, clock::time_point deadline, size_t stack_size)
+{
+	push(std::unique_ptr<scheduled_task>(new scheduled_task(std::move(func), priority, deadline, next_sequence++, stack_size)));
+}
+
+void scheduler::push(std::unique_ptr<scheduled_task> task)
+{
+	std::vector<std::unique_ptr<scheduled_task> > & heap = runnable[task->priority];
+	heap.push_back(std::move(task));
+	std::push_heap(heap.begin(), heap.end(), runs_later());
+}
+
+size_t scheduler::pick_priority()
+{
+	size_t picked = NUM_PRIORITIES;
+	for (size_t i = 0; i < NUM_PRIORITIES; ++i)
+	{
+		if (runnable[i].empty()) continue;
+		if (picked == NUM_PRIORITIES) picked = i;
+		else if (options.starvation_limit && times_passed_over[i] >= options.starvation_limit)
+		{
+			picked = i;
+			break;
+		}
+	}
+	for (size_t i = 0; i < NUM_PRIORITIES; ++i)
+	{
+		if (i == picked) times_passed_over[i] = 0;
+		else if (!runnable[i].empty()) ++times_passed_over[i];
+	}
+	return picked;
+}
+
+bool scheduler::run_one()
+{
+	size_t priority = pick_priority();
+	if (priority == NUM_PRIORITIES) return false;
+	std::vector<std::unique_ptr<scheduled_task> > & heap = runnable[priority];
+	std::pop_heap(heap.begin(), heap.end(), runs_later());
+	std::unique_ptr<scheduled_task> to_run = std::move(heap.back());
+	heap.pop_back();
+	++num_running;
+	struct decrement_running
+	{
+		~decrement_running()
+		{
+			--count;
+		}
+		size_t & count;
+	} decrement = { num_running };
+	// if the task throws, the exception is passed on to the caller and the
+	// task is dropped
+	begin_time_slice();
+	to_run->coroutine();
+	if (to_run->coroutine)
+	{
+		to_run->sequence = next_sequence++;
+		push(std::move(to_run));
+	}
+	return true;
+}
+
+void scheduler::run()
+{
+	while (run_one())
+	{
+	}
+}
+
+size_t scheduler::size() const
+{
+	size_t result = num_running;
+	for (const std::vector<std::unique_ptr<scheduled_task> > & heap : runnable)
+	{
+		result += heap.size();
+	}
+	return result;
+}
+bool scheduler::empty() const
+{
+	return size() == 0;
+}
+
+scheduler::clock::time_point scheduler::no_deadline()
+{
+	return clock::time_point::max();
+}
+}
+
+
+#ifndef DISABLE_GTEST
+#include <gtest/gtest.h>
+#include <string>
+
+TEST(scheduler, priority_and_deadline)
+{
+	using namespace coro;
+	scheduler s;
+	std::string order;
+	scheduler::clock::time_point now = scheduler::clock::now();
+	auto append = [&order](char c)
+	{
+		return [&order, c](scheduler::task::self &)
+		{
+			order += c;
+		};
+	};
+	s.spawn(append('d'), PRIORITY_LOW);
+	s.spawn(append('c'), PRIORITY_NORMAL);
+	s.spawn(append('b'), PRIORITY_HIGH, now + std::chrono::seconds(2));
+	s.spawn(append('a'), PRIORITY_HIGH, now + std::chrono::seconds(1));
+	s.spawn(append('e'), PRIORITY_LOW);
+	EXPECT_EQ(5u, s.size());
+	s.run();
+	EXPECT_EQ("abcde", order);
+	EXPECT_TRUE(s.empty());
+}
+
+TEST(scheduler, preempt_at_yield)
+{
+	using namespace coro;
+	scheduler s;
+	std::string order;
+	s.spawn([&](scheduler::task::self & self)
+	{
+		order += 'a';
+		s.spawn([&](scheduler::task::self &)
+		{
+			order += 'b';
+		}, PRIORITY_HIGH);
+		self.yield();
+		order += 'c';
+	}, PRIORITY_LOW);
+	s.spawn([&](scheduler::task::self & self)
+	{
+		order += 'x';
+		self.yield();
+		order += 'y';
+	}, PRIORITY_LOW);
+	s.run();
+	// a yielded task goes behind the other tasks of its priority
+	EXPECT_EQ("abxcy", order);
+}
+
+TEST(scheduler, starvation)
+{
+	using namespace coro;
+	scheduler_options options;
+	options.starvation_limit = 4;
+	scheduler s(options);
+	size_t high_runs = 0;
+	size_t high_runs_before_low = 0;
+	s.spawn([&](scheduler::task::self & self)
+	{
+		while (high_runs < 100)
+		{
+			++high_runs;
+			self.yield();
+		}
+	}, PRIORITY_HIGH);
+	s.spawn([&](scheduler::task::self &)
+	{
+		high_runs_before_low = high_runs;
+	}, PRIORITY_LOW);
+	s.run();
+	EXPECT_EQ(4u, high_runs_before_low);
+}
+
+#ifndef CORO_NO_EXCEPTIONS
+TEST(scheduler, exception)
+{
+	using namespace coro;
+	scheduler s;
+	s.spawn([](scheduler::task::self &)
+	{
+		throw 5;
+	});
+	EXPECT_THROW(s.run_one(), int);
+	EXPECT_TRUE(s.empty());
+}
+#endif
+
+#ifdef CORO_RUN_BENCHMARKS
+#include <iostream>
+
+namespace
+{
+	// batch jobs that yield after every bit of work, and short requests that
+	// arrive regularly. returns the 99th percentile of the time from spawning
+	// a request until it finishes
+	double request_latency_p99_microseconds(coro::scheduling_priority request_priority)
+	{
+		using namespace coro;
+		scheduler s;
+		volatile size_t work = 0;
+		for (int i = 0; i < 100; ++i)
+		{
+			s.spawn([&work](scheduler::task::self & self)
+			{
+				for (int j = 0; j < 200; ++j)
+				{
+					for (int k = 0; k < 1000; ++k) work = work + k;
+					self.yield();
+				}
+			}, PRIORITY_LOW);
+		}
+		std::vector<double> latencies;
+		for (size_t step = 0; s.run_one(); ++step)
+		{
+			if (step % 50 != 0) continue;
+			scheduler::clock::time_point spawned = scheduler::clock::now();
+			s.spawn([&work, &latencies, spawned](scheduler::task::self &)
+			{
+				for (int k = 0; k < 1000; ++k) work = work + k;
+				latencies.push_back(std::chrono::duration<double, std::micro>(scheduler::clock::now() - spawned).count());
+			}, request_priority);
+		}
+		std::sort(latencies.begin(), latencies.end());
+		return latencies[latencies.size() * 99 / 100];
+	}
+}
+
+TEST(benchmark, scheduler_request_latency)
+{
+	using namespace coro;
+	std::cout << "p99 latency of requests with the same priority as batch jobs: " << request_latency_p99_microseconds(PRIORITY_LOW) << " us" << std::endl;
+	std::cout << "p99 latency of high priority requests: " << request_latency_p99_microseconds(PRIORITY_HIGH) << " us" << std::endl;
+}
+#endif
+#endif
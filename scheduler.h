@@ -0,0 +1,93 @@
+#pragma once
+
+#include "coroutine.h"
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace coro
+{
+enum scheduling_priority
+{
+	PRIORITY_HIGH,
+	PRIORITY_NORMAL,
+	PRIORITY_LOW,
+	NUM_PRIORITIES
+};
+
+struct scheduler_options
+{
+	scheduler_options();
+
+	// if a priority class has runnable tasks but was passed over this many
+	// times in a row because higher priorities were running, it gets to
+	// run one task next. zero turns off the starvation protection
+	size_t starvation_limit;
+};
+
+/**
+ * runs many coroutines on one thread. the task with the highest priority
+ * runs first. tasks of the same priority run in the order of their
+ * deadlines, earliest first, and tasks without a deadline run after those
+ * with one, in the order in which they were spawned. a task runs until
+ * it yields or finishes, and every yield is a chance for a task with a
+ * higher priority or an earlier deadline to run. tasks that don't yield
+ * often enough can be preempted, see preemption.h. this is not thread safe,
+ * use one scheduler per thread
+ */
+struct scheduler
+{
+	typedef coroutine<void ()> task;
+	typedef std::chrono::steady_clock clock;
+
+	explicit scheduler(scheduler_options options = scheduler_options());
+
+	// can also be called from inside of a task
+	void spawn(std::function<void (task::self &)> func, scheduling_priority priority = PRIORITY_NORMAL, clock::time_point deadline = no_deadline(), size_t stack_size = CORO_DEFAULT_STACK_SIZE);
+
+	// runs the next task until it yields or finishes. returns false if there
+	// were no tasks left to run
+	bool run_one();
+	// runs until all tasks have finished
+	void run();
+
+	// the number of tasks that haven't finished yet
+	size_t size() const;
+	bool empty() const;
+
+	static clock::time_point no_deadline();
+
+private:
+	struct scheduled_task
+	{
+		scheduled_task(std::function<void (task::self &)> func, scheduling_priority priority, clock::time_point deadline, size_t sequence, size_t stack_size);
+
+		task coroutine;
+		scheduling_priority priority;
+		clock::time_point deadline;
+		// orders tasks with the same deadline. a task that yielded gets a
+		// new sequence number, so it goes behind the tasks that are waiting
+		size_t sequence;
+	};
+	struct runs_later
+	{
+		bool operator()(const std::unique_ptr<scheduled_task> & lhs, const std::unique_ptr<scheduled_task> & rhs) const;
+	};
+
+	scheduler_options options;
+	// one heap per priority class
+	std::vector<std::unique_ptr<scheduled_task> > runnable[NUM_PRIORITIES];
+	size_t times_passed_over[NUM_PRIORITIES];
+	size_t next_sequence;
+	size_t num_running;
+
+	void push(std::unique_ptr<scheduled_task> task);
+	size_t pick_priority();
+
+	// intentionally not implemented
+	scheduler(const scheduler &);
+	scheduler & operator=(const scheduler &);
+};
+}
@@ -0,0 +1,247 @@
+#include "simulation.h"
+#include <algorithm>
+#include <cassert>
+#include <cinttypes>
+#include <cstdio>
+#ifndef CORO_NO_EXCEPTIONS
+#	include <stdexcept>
+#endif
+
+namespace coro
+{
+namespace
+{
+	static const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+	static const uint64_t FNV_PRIME = 1099511628211ull;
+}
+
+simulation::simulated_task::simulated_task(std::function<void (task::self &)> func, size_t id, size_t stack_size)
+	: coroutine(std::move(func), stack_size)
+	, id(id)
+	, wake_time(0)
+{
+}
+
+bool simulation::wakes_later::operator()(const std::unique_ptr<simulated_task> & lhs, const std::unique_ptr<simulated_task> & rhs) const
+{
+	// tasks that wake at the same time wake in the order of their ids, so
+	// that the order doesn't depend on how the heap is implemented
+	if (lhs->wake_time != rhs->wake_time) return lhs->wake_time > rhs->wake_time;
+	return lhs->id > rhs->id;
+}
+
+simulation::simulation(uint64_t seed)
+	: initial_seed(seed)
+	, random(seed)
+	, current_time(0)
+	, next_id(0)
+	, steps(0)
+	, hash(FNV_OFFSET_BASIS)
+	, running(nullptr)
+	, running_sleeps(false)
+{
+}
+
+void simulation::spawn(std::function<void (task::self &)> func, size_t stack_size)
+{
+	ready.emplace_back(new simulated_task(std::move(func), next_id++, stack_size));
+}
+
+void simulation::sleep_for(task::self & self, duration time)
+{
+#	ifdef CORO_NO_EXCEPTIONS
+		assert(running && &running->coroutine == &self);
+#	else
+		if (!running || &running->coroutine != &self) throw std::logic_error("sleep_for has to be called from the task that is running in this simulation");
+#	endif
+	running->wake_time = current_time + time;
+	running_sleeps = true;
+	self.yield();
+}
+
+bool simulation::run_one()
+{
+	if (ready.empty())
+	{
+		if (sleeping.empty()) return false;
+		// nothing can happen until the next timer fires, so skip ahead
+		current_time = sleeping.front()->wake_time;
+	}
+	while (!sleeping.empty() && sleeping.front()->wake_time <= current_time)
+	{
+		std::pop_heap(sleeping.begin(), sleeping.end(), wakes_later());
+		ready.push_back(std::move(sleeping.back()));
+		sleeping.pop_back();
+	}
+	// std::uniform_int_distribution is implemented differently by different
+	// standard libraries, so it would give different orders on different
+	// platforms. the modulo is slightly biased but always the same
+	size_t index = static_cast<size_t>(random() % ready.size());
+	std::unique_ptr<simulated_task> to_run = std::move(ready[index]);
+	ready[index] = std::move(ready.back());
+	ready.pop_back();
+	record(to_run->id);
+	record(static_cast<uint64_t>(current_time.count()));
+	++steps;
+
+	running = to_run.get();
+	running_sleeps = false;
+	struct reset_running
+	{
+		~reset_running()
+		{
+			running = nullptr;
+		}
+		simulated_task *& running;
+	} reset = { running };
+#	ifdef CORO_NO_EXCEPTIONS
+		to_run->coroutine();
+#	else
+		try
+		{
+			to_run->coroutine();
+		}
+		catch(...)
+		{
+			std::fprintf(stderr, "a task of the simulation with seed %" PRIu64 " threw in step %zu\n", initial_seed, steps);
+			throw;
+		}
+#	endif
+	if (!to_run->coroutine) return true;
+	if (running_sleeps)
+	{
+		sleeping.push_back(std::move(to_run));
+		std::push_heap(sleeping.begin(), sleeping.end(), wakes_later());
+	}
+	else ready.push_back(std::move(to_run));
+	return true;
+}
+
+void simulation::run()
+{
+	while (run_one())
+	{
+	}
+}
+
+simulation::duration simulation::now() const
+{
+	return current_time;
+}
+uint64_t simulation::seed() const
+{
+	return initial_seed;
+}
+size_t simulation::num_steps() const
+{
+	return steps;
+}
+uint64_t simulation::trace_hash() const
+{
+	return hash;
+}
+size_t simulation::size() const
+{
+	return ready.size() + sleeping.size() + (running ? 1 : 0);
+}
+
+void simulation::record(uint64_t value)
+{
+	for (int i = 0; i < 8; ++i)
+	{
+		hash = (hash ^ ((value >> (i * 8)) & 0xff)) * FNV_PRIME;
+	}
+}
+}
+
+
+#ifndef DISABLE_GTEST
+#include <gtest/gtest.h>
+#include <string>
+
+namespace
+{
+	std::string run_simulation(uint64_t seed, uint64_t * hash = nullptr)
+	{
+		using namespace coro;
+		simulation sim(seed);
+		std::string order;
+		for (char c = 'a'; c < 'f'; ++c)
+		{
+			sim.spawn([&order, c](simulation::task::self & self)
+			{
+				for (int i = 0; i < 3; ++i)
+				{
+					order += c;
+					self.yield();
+				}
+			});
+		}
+		sim.run();
+		if (hash) *hash = sim.trace_hash();
+		return order;
+	}
+}
+
+TEST(simulation, reproducible)
+{
+	uint64_t first_hash = 0;
+	uint64_t second_hash = 0;
+	std::string first = run_simulation(5, &first_hash);
+	EXPECT_EQ(15u, first.size());
+	EXPECT_EQ(first, run_simulation(5, &second_hash));
+	EXPECT_EQ(first_hash, second_hash);
+	bool any_different = false;
+	for (uint64_t seed = 6; seed < 10; ++seed)
+	{
+		any_different = any_different || run_simulation(seed) != first;
+	}
+	EXPECT_TRUE(any_different);
+}
+
+#ifndef CORO_NO_EXCEPTIONS
+TEST(simulation, prints_seed)
+{
+	using namespace coro;
+	simulation sim(12345);
+	sim.spawn([](simulation::task::self & self)
+	{
+		self.yield();
+		throw std::runtime_error("failed");
+	});
+	testing::internal::CaptureStderr();
+	EXPECT_THROW(sim.run(), std::runtime_error);
+	std::string printed = testing::internal::GetCapturedStderr();
+	EXPECT_NE(std::string::npos, printed.find("seed 12345"));
+}
+#endif
+
+TEST(simulation, virtual_clock)
+{
+	using namespace coro;
+	simulation sim(1);
+	std::string order;
+	std::vector<simulation::duration> wake_times;
+	auto sleeper = [&](char c, std::chrono::hours time)
+	{
+		return [&, c, time](simulation::task::self & self)
+		{
+			sim.sleep_for(self, time);
+			order += c;
+			wake_times.push_back(sim.now());
+		};
+	};
+	sim.spawn(sleeper('c', std::chrono::hours(3)));
+	sim.spawn(sleeper('a', std::chrono::hours(1)));
+	sim.spawn(sleeper('b', std::chrono::hours(2)));
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	sim.run();
+	EXPECT_GT(std::chrono::seconds(10), std::chrono::steady_clock::now() - start);
+	EXPECT_EQ("abc", order);
+	ASSERT_EQ(3u, wake_times.size());
+	EXPECT_EQ(std::chrono::hours(1), wake_times[0]);
+	EXPECT_EQ(std::chrono::hours(3), wake_times[2]);
+	EXPECT_EQ(std::chrono::hours(3), sim.now());
+	EXPECT_EQ(0u, sim.size());
+}
+#endif
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "coroutine.h"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace coro
+{
+/**
+ * a scheduler for tests and benchmarks that runs tasks in a reproducible
+ * order. the next task to run is picked by a random number generator with
+ * a fixed seed, and time only passes when all tasks are waiting for a
+ * timer. the virtual clock then jumps to the next timer. so two runs with
+ * the same seed make exactly the same scheduling decisions, independent
+ * of how fast the machine is. to reproduce a failure, run again with the
+ * same seed. if a task throws, run_one() prints the seed to stderr before
+ * the exception leaves it. for failures that don't throw, like a failed
+ * EXPECT in a test, print seed() yourself. this is not thread safe
+ */
+struct simulation
+{
+	typedef coroutine<void ()> task;
+	// virtual time since the simulation started
+	typedef std::chrono::nanoseconds duration;
+
+	explicit simulation(uint64_t seed);
+
+	// can also be called from inside of a task
+	void spawn(std::function<void (task::self &)> func, size_t stack_size = CORO_DEFAULT_STACK_SIZE);
+	// suspends the calling task until the virtual clock has advanced by the
+	// given amount. has to be called from inside a task of this simulation
+	void sleep_for(task::self & self, duration time);
+
+	// runs one randomly picked task until it yields, sleeps or finishes. if
+	// no task is ready, advances the clock to the next timer first. returns
+	// false if there are no tasks left
+	bool run_one();
+	// runs until all tasks have finished
+	void run();
+
+	duration now() const;
+	uint64_t seed() const;
+	// the number of times that a task was run
+	size_t num_steps() const;
+	// a hash of every scheduling decision so far. two runs made the same
+	// decisions if they have the same hash
+	uint64_t trace_hash() const;
+	// the number of tasks that haven't finished yet
+	size_t size() const;
+
+private:
+	struct simulated_task
+	{
+		simulated_task(std::function<void (task::self &)> func, size_t id, size_t stack_size);
+
+		task coroutine;
+		size_t id;
+		duration wake_time;
+	};
+	struct wakes_later
+	{
+		bool operator()(const std::unique_ptr<simulated_task> & lhs, const std::unique_ptr<simulated_task> & rhs) const;
+	};
+
+	uint64_t initial_seed;
+	std::mt19937_64 random;
+	duration current_time;
+	size_t next_id;
+	size_t steps;
+	uint64_t hash;
+	std::vector<std::unique_ptr<simulated_task> > ready;
+	// a heap ordered by wake time
+	std::vector<std::unique_ptr<simulated_task> > sleeping;
+	simulated_task * running;
+	bool running_sleeps;
+
+	void record(uint64_t value);
+
+	// intentionally not implemented
+	simulation(const simulation &);
+	simulation & operator=(const simulation &);
+};
+}
@@ -0,0 +1,310 @@
+#include "stack_arena.h"
+#include "numa.h"
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#ifdef __linux__
+#	include <sys/mman.h>
+#	include <unistd.h>
+#endif
+
+namespace coro
+{
+namespace
+{
+	static const size_t CANARY_SIZE = 64;
+	static const uint64_t CANARY_PATTERN = 0x5ca1ab1ec0ffee11ull;
+
+	size_t round_up(size_t size, size_t multiple)
+	{
+		return (size + multiple - 1) / multiple * multiple;
+	}
+	size_t page_size()
+	{
+#		ifdef __linux__
+			static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+			return size;
+#		else
+			return 4096;
+#		endif
+	}
+
+	// the canary depends on the address so that a copy of a canary that
+	// was written somewhere else doesn't pass the check
+	uint64_t canary_value(const unsigned char * canary, size_t index)
+	{
+		return CANARY_PATTERN ^ (reinterpret_cast<uintptr_t>(canary) + index);
+	}
+	void write_canary(unsigned char * canary)
+	{
+		for (size_t i = 0; i < CANARY_SIZE / sizeof(uint64_t); ++i)
+		{
+			uint64_t value = canary_value(canary, i);
+			std::memcpy(canary + i * sizeof(uint64_t), &value, sizeof(value));
+		}
+	}
+	bool is_canary_intact(const unsigned char * canary)
+	{
+		for (size_t i = 0; i < CANARY_SIZE / sizeof(uint64_t); ++i)
+		{
+			uint64_t value;
+			std::memcpy(&value, canary + i * sizeof(uint64_t), sizeof(value));
+			if (value != canary_value(canary, i)) return false;
+		}
+		return true;
+	}
+
+	void out_of_memory()
+	{
+#		ifdef CORO_NO_EXCEPTIONS
+			std::fputs("coroutine stack arena: could not map a region for stacks\n", stderr);
+			std::abort();
+#		else
+			throw std::bad_alloc();
+#		endif
+	}
+}
+
+stack_arena_options::stack_arena_options()
+	: huge_pages(true)
+	, guard_pages(false)
+	, numa_node(ANY_NUMA_NODE)
+{
+}
+
+stack_arena::stack_arena(size_t stack_size, stack_arena_options options)
+	: options(options)
+	, stack_bytes(options.guard_pages ? round_up(stack_size, page_size()) : round_up(stack_size, CANARY_SIZE))
+	, slot_size(stack_bytes + (options.guard_pages ? page_size() : CANARY_SIZE))
+	, region_size(round_up(slot_size, REGION_ALIGNMENT))
+	, explicit_huge_pages(false)
+{
+}
+
+stack_arena::~stack_arena()
+{
+	assert(free_stacks.size() == regions.size() * stacks_per_region() && "a stack_arena was destroyed before all of its stacks were given back");
+	for (const region & r : regions)
+	{
+#		ifdef __linux__
+			munmap(r.memory, r.size);
+#		else
+			delete[] r.memory;
+#		endif
+	}
+}
+
+stack_memory stack_arena::allocate()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (free_stacks.empty()) add_region();
+	unsigned char * stack = free_stacks.back();
+	free_stacks.pop_back();
+	stack_memory_deleter deleter = { &release, stack_bytes, this };
+	return stack_memory(stack, deleter);
+}
+
+void stack_arena::release(unsigned char * stack, size_t, void * arena)
+{
+	stack_arena & self = *static_cast<stack_arena *>(arena);
+	if (!self.options.guard_pages && !is_canary_intact(stack - CANARY_SIZE))
+	{
+		// the memory around the stack is already corrupted, there is no
+		// way to recover from this
+		std::fputs("coroutine stack overflow: the canary below a stack from a stack_arena was overwritten\n", stderr);
+		std::abort();
+	}
+	std::lock_guard<std::mutex> lock(self.mutex);
+	self.free_stacks.push_back(stack);
+}
+
+size_t stack_arena::stack_size() const
+{
+	return stack_bytes;
+}
+size_t stack_arena::stacks_per_region() const
+{
+	return region_size / slot_size;
+}
+size_t stack_arena::num_regions() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return regions.size();
+}
+bool stack_arena::uses_explicit_huge_pages() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return explicit_huge_pages;
+}
+
+void stack_arena::add_region()
+{
+	region added = { nullptr, region_size };
+#	ifdef __linux__
+		void * memory = MAP_FAILED;
+		// mprotect can't split an explicit huge page, so guard pages only
+		// work on normal mappings
+		if (options.huge_pages && !options.guard_pages && (regions.empty() || explicit_huge_pages))
+		{
+			memory = mmap(nullptr, region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			explicit_huge_pages = memory != MAP_FAILED;
+		}
+		if (memory == MAP_FAILED)
+		{
+			// map more than needed so that the region can be aligned to
+			// the huge page size. the kernel can only use a huge page for
+			// aligned memory
+			size_t mapped_size = region_size + REGION_ALIGNMENT;
+			unsigned char * mapped = static_cast<unsigned char *>(mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+			if (mapped == MAP_FAILED) out_of_memory();
+			unsigned char * aligned = reinterpret_cast<unsigned char *>(round_up(reinterpret_cast<uintptr_t>(mapped), REGION_ALIGNMENT));
+			if (aligned != mapped) munmap(mapped, aligned - mapped);
+			munmap(aligned + region_size, mapped + mapped_size - (aligned + region_size));
+			memory = aligned;
+#			ifdef MADV_HUGEPAGE
+				if (options.huge_pages) madvise(memory, region_size, MADV_HUGEPAGE);
+#			endif
+		}
+		added.memory = static_cast<unsigned char *>(memory);
+		// before the canaries are written, so that no page is placed yet
+		if (options.numa_node != stack_arena_options::ANY_NUMA_NODE) bind_to_numa_node(memory, region_size, options.numa_node);
+		if (options.guard_pages)
+		{
+			for (size_t i = 0; i < stacks_per_region(); ++i)
+			{
+				// this fails if the process runs out of mappings, see
+				// vm.max_map_count. without the guard page nothing would
+				// catch an overflow, so don't hand out the stack
+				if (mprotect(added.memory + i * slot_size, page_size(), PROT_NONE) != 0)
+				{
+					munmap(added.memory, region_size);
+					out_of_memory();
+				}
+			}
+		}
+#	else
+		added.memory = new unsigned char[region_size];
+#	endif
+	regions.push_back(added);
+
+	size_t num_stacks = stacks_per_region();
+	free_stacks.reserve(regions.size() * num_stacks);
+	// push in reverse so that the stacks are handed out in address order
+	for (size_t i = num_stacks; i-- > 0;)
+	{
+		unsigned char * slot = added.memory + i * slot_size;
+		if (options.guard_pages)
+		{
+			// there are no guard pages without mmap, but the stack still
+			// starts a page above the slot
+			free_stacks.push_back(slot + page_size());
+		}
+		else
+		{
+			write_canary(slot);
+			free_stacks.push_back(slot + CANARY_SIZE);
+		}
+	}
+}
+}
+
+
+#ifndef DISABLE_GTEST
+#include <gtest/gtest.h>
+#include "coroutine.h"
+
+TEST(stack_arena, many_stacks)
+{
+	using namespace coro;
+	stack_arena arena(64 * 1024);
+	EXPECT_EQ(64u * 1024, arena.stack_size());
+	EXPECT_LE(31u, arena.stacks_per_region());
+	std::vector<std::unique_ptr<coroutine<int ()> > > coroutines;
+	for (int i = 0; i < 100; ++i)
+	{
+		coroutines.emplace_back(new coroutine<int ()>([i](coroutine<int ()>::self & self)
+		{
+			self.yield(i);
+			return i * 2;
+		}, arena));
+	}
+	EXPECT_EQ((100 + arena.stacks_per_region() - 1) / arena.stacks_per_region(), arena.num_regions());
+	for (int i = 0; i < 100; ++i)
+	{
+		EXPECT_EQ(i, (*coroutines[i])());
+	}
+	for (int i = 0; i < 100; ++i)
+	{
+		EXPECT_EQ(i * 2, (*coroutines[i])());
+	}
+	size_t num_regions = arena.num_regions();
+	coroutines.clear();
+	// stacks are reused
+	coroutine<int ()> reused([](coroutine<int ()>::self &)
+	{
+		return 1;
+	}, arena);
+	EXPECT_EQ(1, reused());
+	EXPECT_EQ(num_regions, arena.num_regions());
+}
+
+TEST(stack_arena, guard_pages)
+{
+	using namespace coro;
+	stack_arena_options options;
+	options.huge_pages = false;
+	options.guard_pages = true;
+	stack_arena arena(10000, options);
+	EXPECT_EQ(0u, arena.stack_size() % 4096);
+	coroutine<int ()> guarded([](coroutine<int ()>::self &)
+	{
+		volatile char used[8 * 1024];
+		used[0] = 3;
+		return used[0];
+	}, arena);
+	EXPECT_EQ(3, guarded());
+}
+
+TEST(stack_arena, guard_pages_with_huge_pages)
+{
+	using namespace coro;
+	stack_arena_options options;
+	options.guard_pages = true;
+	EXPECT_DEATH(
+	{
+		stack_arena arena(16 * 1024, options);
+		stack_memory stack = arena.allocate();
+		static_cast<volatile unsigned char *>(stack.get())[-1] = 0;
+	}, "");
+	stack_arena arena(16 * 1024, options);
+	EXPECT_FALSE(arena.uses_explicit_huge_pages());
+}
+
+TEST(stack_arena, numa_node)
+{
+	using namespace coro;
+	stack_arena_options options;
+	options.numa_node = current_numa_node();
+	stack_arena arena(16 * 1024, options);
+	coroutine<int ()> on_node([](coroutine<int ()>::self &)
+	{
+		return 4;
+	}, arena);
+	EXPECT_EQ(4, on_node());
+}
+
+TEST(stack_arena, canary)
+{
+	using namespace coro;
+	EXPECT_DEATH(
+	{
+		stack_arena arena(16 * 1024);
+		stack_memory stack = arena.allocate();
+		stack.get()[-1] = 0;
+		stack.reset();
+	}, "stack overflow");
+}
+#endif
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "stack_memory.h"
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace coro
+{
+struct stack_arena_options
+{
+	stack_arena_options();
+
+	// back the arena with 2 MiB pages so that switching between many
+	// coroutines doesn't need a TLB entry for every stack. explicit huge
+	// pages (MAP_HUGETLB) are used if the system has some reserved,
+	// otherwise the kernel is asked for transparent huge pages
+	bool huge_pages;
+	// put an inaccessible page below every stack. this splits the huge
+	// pages, and explicit huge pages are never used with it. so by
+	// default a canary below the stack is checked instead
+	// when the stack is given back. the canary only catches overflows
+	// after the fact, and only those that write to it
+	bool guard_pages;
+	// put the regions on this NUMA node. see numa.h. the default leaves it
+	// to the kernel, which usually picks the node of the thread that first
+	// touches a page
+	size_t numa_node;
+
+	static const size_t ANY_NUMA_NODE = static_cast<size_t>(-1);
+};
+
+/**
+ * hands out many coroutine stacks of the same size, carved out of large
+ * regions. stacks that are given back are reused. the arena has to outlive
+ * all stacks that it handed out. this is safe to use from several threads
+ */
+struct stack_arena
+{
+	explicit stack_arena(size_t stack_size, stack_arena_options options = stack_arena_options());
+	~stack_arena();
+
+	stack_memory allocate();
+
+	size_t stack_size() const;
+	size_t stacks_per_region() const;
+	size_t num_regions() const;
+	// true if the regions are backed by explicit huge pages. if this is
+	// false but huge_pages was requested, transparent huge pages are used
+	// if the kernel allows it
+	bool uses_explicit_huge_pages() const;
+
+	static const size_t REGION_ALIGNMENT = 2 * 1024 * 1024;
+
+private:
+	struct region
+	{
+		unsigned char * memory;
+		size_t size;
+	};
+
+	stack_arena_options options;
+	size_t stack_bytes;
+	// the stack and the guard page or canary below it
+	size_t slot_size;
+	size_t region_size;
+	bool explicit_huge_pages;
+	mutable std::mutex mutex;
+	std::vector<region> regions;
+	std::vector<unsigned char *> free_stacks;
+
+	void add_region();
+	static void release(unsigned char * stack, size_t size, void * arena);
+
+	// intentionally not implemented
+	stack_arena(const stack_arena &);
+	stack_arena & operator=(const stack_arena &);
+};
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+
+namespace coro
+{
+/**
+ * the memory of a coroutine stack. it knows how to give itself back to
+ * wherever it came from: new[], a NUMA node (see numa.h) or a stack_arena
+ * (see stack_arena.h)
+ */
+struct stack_memory_deleter
+{
+	// if this is nullptr the memory came from new[]
+	void (*release)(unsigned char * memory, size_t size, void * context);
+	size_t size;
+	void * context;
+
+	void operator()(unsigned char * memory) const
+	{
+		if (release) release(memory, size, context);
+		else delete[] memory;
+	}
+};
+typedef std::unique_ptr<unsigned char[], stack_memory_deleter> stack_memory;
+
+namespace detail
+{
+	inline void release_nothing(unsigned char *, size_t, void *)
+	{
+	}
+}
+// for memory that is owned by someone else and that has to outlive the
+// coroutine that runs on it
+inline stack_memory unowned_stack_memory(unsigned char * memory, size_t size)
+{
+	stack_memory_deleter deleter = { &detail::release_nothing, size, nullptr };
+	return stack_memory(memory, deleter);
+}
+}
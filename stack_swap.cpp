@@ -1,86 +1,106 @@
 #include "stack_swap.h"
+#include <cstdint>
 #include <cstring>
 #include <utility>
 
 namespace stack
 {
 
-#ifdef _WIN64
+// this is called like a normal function, so that the compiler knows that
+// all registers that a call may clobber have to be saved by the caller
 extern "C" void switch_to_context(void ** old_stack_top, const void * new_stack_top);
+#ifdef _WIN64
 extern "C" void callable_context_start();
 #else
+// the .cfi directives describe where the registers of the caller are saved,
+// so that debuggers and profilers can unwind through these functions
 asm
 (
+	// toplevel asm is pasted into the output of the compiler wherever it
+	// happens to be, so restore the section that the compiler was in
+	".pushsection .text\n\t"
+	".type switch_to_context, @function\n"
 	"switch_to_context:\n\t"
+	".cfi_startproc\n\t"
 	"pushq %rbp\n\t"
+	".cfi_adjust_cfa_offset 8\n\t"
+	".cfi_rel_offset %rbp, 0\n\t"
 	"movq %rsp, %rbp\n\t"
 	// store rbx and r12 to r15 on the stack. these will be restored
 	// after we switch back
 	"pushq %rbx\n\t"
+	".cfi_adjust_cfa_offset 8\n\t"
+	".cfi_rel_offset %rbx, 0\n\t"
 	"pushq %r12\n\t"
+	".cfi_adjust_cfa_offset 8\n\t"
+	".cfi_rel_offset %r12, 0\n\t"
 	"pushq %r13\n\t"
+	".cfi_adjust_cfa_offset 8\n\t"
+	".cfi_rel_offset %r13, 0\n\t"
 	"pushq %r14\n\t"
+	".cfi_adjust_cfa_offset 8\n\t"
+	".cfi_rel_offset %r14, 0\n\t"
 	"pushq %r15\n\t"
+	".cfi_adjust_cfa_offset 8\n\t"
+	".cfi_rel_offset %r15, 0\n\t"
 	"movq %rsp, (%rdi)\n\t" // store stack pointer
-	// set up the other guy's stack pointer
-	"switch_point:\n\t"
-	"movq %rsi, %rsp\n\t"
+	// set up the other guy's stack pointer. the other stack has the same
+	// layout as this one, so the cfi stays valid across the switch
+	"movq %rsi, %rsp\n"
+	"switch_restore:\n\t"
 	// and we are now in the other context
 	// restore registers
 	"popq %r15\n\t"
+	".cfi_adjust_cfa_offset -8\n\t"
+	".cfi_restore %r15\n\t"
 	"popq %r14\n\t"
+	".cfi_adjust_cfa_offset -8\n\t"
+	".cfi_restore %r14\n\t"
 	"popq %r13\n\t"
+	".cfi_adjust_cfa_offset -8\n\t"
+	".cfi_restore %r13\n\t"
 	"popq %r12\n\t"
+	".cfi_adjust_cfa_offset -8\n\t"
+	".cfi_restore %r12\n\t"
 	"popq %rbx\n\t"
+	".cfi_adjust_cfa_offset -8\n\t"
+	".cfi_restore %rbx\n\t"
 	"popq %rbp\n\t"
+	".cfi_adjust_cfa_offset -8\n\t"
+	".cfi_restore %rbp\n\t"
 	"retq\n\t" // go to whichever code is used by the other stack
-);
-asm
-(
-	"switch_to_callable_context:\n\t"
-	"pushq %rbp\n\t"
-	"movq %rsp, %rbp\n\t"
-	// store rbx and r12 to r15 on the stack. these will be restored
-	// after we jump back
-	"pushq %rbx\n\t"
-	"pushq %r12\n\t"
-	"pushq %r13\n\t"
-	"pushq %r14\n\t"
-	"pushq %r15\n\t"
-	"movq %rsp, (%rdi)\n\t" // store stack pointer
-	// set up the other guy's stack pointer to make
-	// debugging easier
-	"movq %rbp, (%rdx)\n\t"
-	"jmp switch_point\n\t"
+	".cfi_endproc\n\t"
+	".size switch_to_context, .-switch_to_context\n\t"
+	".popsection\n\t"
 );
 
 asm
 (
+	".pushsection .text\n\t"
+	".type callable_context_start, @function\n"
 	"callable_context_start:\n\t"
+	".cfi_startproc\n\t"
+	// this is the outermost frame of the coroutine. the return address is
+	// undefined so that unwinders stop here, and rbp starts out as zero
+	// so that frame pointer based unwinders stop here as well
+	".cfi_undefined %rip\n\t"
 	"movq %r13, %rdi\n\t" // function_argument
 	"callq *%r12\n\t" // function
-	"movq (%rbx), %rsi\n\t" // caller_stack_top
-	"jmp switch_point\n\t"
+	"movq (%rbx), %rsp\n\t" // caller_stack_top
+	"jmp switch_restore\n\t"
+	".cfi_endproc\n\t"
+	".size callable_context_start, .-callable_context_start\n\t"
+	".popsection\n\t"
 );
 #endif
 
-void stack_context::switch_into()
+void asm_backend::switch_into()
 {
-#ifdef _WIN64
 	switch_to_context(&caller_stack_top, my_stack_top);
-#else
-	asm("call switch_to_callable_context"
-		: : "D"(&caller_stack_top), "S"(my_stack_top), "d"(rbp_on_stack));
-#endif
 }
-void stack_context::switch_out_of()
+void asm_backend::switch_out_of()
 {
-#ifdef _WIN64
 	switch_to_context(&my_stack_top, caller_stack_top);
-#else
-	asm("call switch_to_context"
-		: : "D"(&my_stack_top), "S"(caller_stack_top));
-#endif
 }
 
 static void * ensure_alignment(void * stack, size_t stack_size)
@@ -91,12 +111,9 @@ static void * ensure_alignment(void * stack, size_t stack_size)
 	return stack_top - reinterpret_cast<size_t>(stack_top) % CONTEXT_STACK_ALIGNMENT;
 }
 
-stack_context::stack_context(void * stack, size_t stack_size, void (* function)(void *), void * function_argument)
-	: caller_stack_top(nullptr), my_stack_top(nullptr)
-#ifndef _WIN64
-	, rbp_on_stack(nullptr)
-#endif
+void asm_backend::reset(void * stack, size_t stack_size, void (* function)(void *), void * function_argument)
 {
+	caller_stack_top = nullptr;
 	unsigned char * math_stack = static_cast<unsigned char *>(ensure_alignment(stack, stack_size));
 #ifdef _WIN64
 	my_stack_top = math_stack - sizeof(void *) // space for return address (initial call)
@@ -134,11 +151,12 @@ stack_context::stack_context(void * stack, size_t stack_size, void (* function)(
 #else
 	my_stack_top = math_stack - sizeof(void *) * 9;
 	void ** initial_stack = static_cast<void **>(my_stack_top);
-	// store the return address here to make the debuggers life easier
-	asm("movq $switch_point, %0\n\t" : : "m"(initial_stack[8]));
-	initial_stack[7] = nullptr; // will store rbp here to make the debuggers life easier
+	// a zero return address and a zero rbp above the first frame mark it
+	// as the outermost frame for debuggers and profilers
+	initial_stack[8] = nullptr;
+	initial_stack[7] = nullptr;
 	asm("movq $callable_context_start, %0\n\t" : : "m"(initial_stack[6]));
-	rbp_on_stack = initial_stack[5] = &initial_stack[7]; // initial rbp
+	initial_stack[5] = nullptr; // initial rbp
 	initial_stack[4] = &caller_stack_top; // initial rbx
 	initial_stack[3] = reinterpret_cast<void *>(function); // initial r12
 	initial_stack[2] = function_argument; // initial r13
@@ -147,22 +165,103 @@ stack_context::stack_context(void * stack, size_t stack_size, void (* function)(
 #endif
 }
 
+#ifndef _WIN32
+namespace
+{
+	// makecontext only passes ints to the function, so pointers have to be
+	// split in two
+	unsigned int high_bits(const void * pointer)
+	{
+		return static_cast<unsigned int>(reinterpret_cast<uintptr_t>(pointer) >> 16 >> 16);
+	}
+	unsigned int low_bits(const void * pointer)
+	{
+		return static_cast<unsigned int>(reinterpret_cast<uintptr_t>(pointer));
+	}
+}
+
+void make_start_context(ucontext_t & context, void * stack, size_t stack_size, void (* start)(unsigned int, unsigned int), void * backend)
+{
+	getcontext(&context);
+	unsigned char * stack_top = static_cast<unsigned char *>(ensure_alignment(stack, stack_size));
+	context.uc_stack.ss_sp = stack;
+	context.uc_stack.ss_size = stack_top - static_cast<unsigned char *>(stack);
+	// the start functions never return, they switch back to the caller
+	context.uc_link = nullptr;
+	makecontext(&context, reinterpret_cast<void (*)()>(start), 2, high_bits(backend), low_bits(backend));
+}
+
+void ucontext_backend::reset(void * stack, size_t stack_size, void (* function)(void *), void * function_argument)
+{
+	this->function = function;
+	this->function_argument = function_argument;
+	make_start_context(my_context, stack, stack_size, &ucontext_backend::start, this);
+}
+void ucontext_backend::switch_into()
+{
+	swapcontext(&caller_context, &my_context);
+}
+void ucontext_backend::switch_out_of()
+{
+	swapcontext(&my_context, &caller_context);
+}
+void ucontext_backend::start(unsigned int this_high, unsigned int this_low)
+{
+	ucontext_backend * self = from_bits<ucontext_backend>(this_high, this_low);
+	self->function(self->function_argument);
+	setcontext(&self->caller_context);
+}
+#endif
+
+#ifdef CORO_MEASURE_STACK_USAGE
+static const unsigned char STACK_PAINT_PATTERN = 0xcd;
+
+void paint_stack(void * stack, size_t stack_size)
+{
+	memset(stack, STACK_PAINT_PATTERN, stack_size);
+}
+size_t measure_stack_usage(const unsigned char * stack_bottom, const unsigned char * stack_top)
+{
+	// the stack grows down, so search for the lowest byte that has been changed
+	const unsigned char * lowest_used = stack_bottom;
+	while (lowest_used != stack_top && *lowest_used == STACK_PAINT_PATTERN)
+	{
+		++lowest_used;
+	}
+	return stack_top - lowest_used;
+}
+#endif
+
 }
 
 
 #ifndef DISABLE_GTEST
 #include <gtest/gtest.h>
 
+// every backend has to pass these
+template<typename Context>
+struct stack_swap : ::testing::Test
+{
+};
+#ifdef _WIN32
+typedef ::testing::Types<stack::basic_stack_context<stack::asm_backend> > switch_backends;
+#else
+typedef ::testing::Types<stack::basic_stack_context<stack::asm_backend>, stack::basic_stack_context<stack::ucontext_backend>, stack::basic_stack_context<stack::setjmp_backend> > switch_backends;
+#endif
+TYPED_TEST_SUITE(stack_swap, switch_backends);
+
 namespace
 {
+	template<typename Context>
 	struct exception_test_info
 	{
-		stack::stack_context * context;
+		Context * context;
 		int * to_set;
 	};
+	template<typename Context>
 	void exception_call(void * arg)
 	{
-		exception_test_info * info = static_cast<exception_test_info *>(arg);
+		exception_test_info<Context> * info = static_cast<exception_test_info<Context> *>(arg);
 		try
 		{
 			info->context->switch_out_of();
@@ -174,12 +273,12 @@ namespace
 	}
 }
 
-TEST(stack_swap, exceptions)
+TYPED_TEST(stack_swap, exceptions)
 {
 	unsigned char local_stack[64*1024];
-	exception_test_info info;
+	exception_test_info<TypeParam> info;
 
-	stack::stack_context context(local_stack, sizeof(local_stack), &exception_call, &info);
+	TypeParam context(local_stack, sizeof(local_stack), &exception_call<TypeParam>, &info);
 	info.context = &context;
 	int inner_set = 0;
 	info.to_set = &inner_set;
@@ -196,5 +295,167 @@ TEST(stack_swap, exceptions)
 	EXPECT_EQ(0, inner_set);
 	EXPECT_EQ(5, outer_set);
 }
+
+namespace
+{
+	template<typename Context>
+	struct ping_pong_info
+	{
+		Context * context;
+		int * counter;
+		double * value;
+	};
+	template<typename Context>
+	void ping_pong(void * arg)
+	{
+		ping_pong_info<Context> info = *static_cast<ping_pong_info<Context> *>(arg);
+		// these have to survive the switches
+		double local_value = 0.5;
+		int local_counter = 0;
+		for (int i = 0; i < 100; ++i)
+		{
+			++*info.counter;
+			++local_counter;
+			local_value *= 2.0;
+			*info.value = local_value;
+			info.context->switch_out_of();
+			EXPECT_EQ(i + 1, local_counter);
+		}
+		*info.counter = -local_counter;
+	}
+}
+
+TYPED_TEST(stack_swap, switch_and_return)
+{
+	unsigned char local_stack[64*1024];
+	int counter = 0;
+	double value = 0.0;
+	ping_pong_info<TypeParam> info;
+	TypeParam context(local_stack, sizeof(local_stack), &ping_pong<TypeParam>, &info);
+	info.context = &context;
+	info.counter = &counter;
+	info.value = &value;
+	double expected_value = 0.5;
+	for (int i = 0; i < 100; ++i)
+	{
+		context.switch_into();
+		expected_value *= 2.0;
+		EXPECT_EQ(i + 1, counter);
+		EXPECT_EQ(expected_value, value);
+	}
+	// the function returns, which switches back one last time
+	context.switch_into();
+	EXPECT_EQ(-100, counter);
+
+	// and after a reset it starts over
+	counter = 0;
+	context.reset(local_stack, sizeof(local_stack), &ping_pong<TypeParam>, &info);
+	context.switch_into();
+	EXPECT_EQ(1, counter);
+}
+
+TYPED_TEST(stack_swap, interleaved)
+{
+	unsigned char first_stack[64*1024];
+	unsigned char second_stack[64*1024];
+	int first_counter = 0;
+	int second_counter = 0;
+	double value = 0.0;
+	ping_pong_info<TypeParam> first_info;
+	ping_pong_info<TypeParam> second_info;
+	TypeParam first(first_stack, sizeof(first_stack), &ping_pong<TypeParam>, &first_info);
+	TypeParam second(second_stack, sizeof(second_stack), &ping_pong<TypeParam>, &second_info);
+	first_info.context = &first;
+	first_info.counter = &first_counter;
+	first_info.value = &value;
+	second_info.context = &second;
+	second_info.counter = &second_counter;
+	second_info.value = &value;
+	for (int i = 0; i < 10; ++i)
+	{
+		first.switch_into();
+		second.switch_into();
+		second.switch_into();
+	}
+	EXPECT_EQ(10, first_counter);
+	EXPECT_EQ(20, second_counter);
+}
+
+#ifdef CORO_MEASURE_STACK_USAGE
+namespace
+{
+	static const size_t STACK_USAGE_TEST_SIZE = 16 * 1024;
+	template<typename Context>
+	void use_stack(void * arg)
+	{
+		volatile unsigned char used[STACK_USAGE_TEST_SIZE];
+		for (size_t i = 0; i < STACK_USAGE_TEST_SIZE; ++i)
+		{
+			used[i] = 0;
+		}
+		// read it back so that the compiler doesn't warn about it being unused
+		static_cast<void>(used[0]);
+		static_cast<Context *>(arg)->switch_out_of();
+	}
+}
+
+TYPED_TEST(stack_swap, max_stack_usage)
+{
+	unsigned char local_stack[64*1024];
+	TypeParam context(local_stack, sizeof(local_stack), &use_stack<TypeParam>, &context);
+	size_t before_start = context.max_stack_usage();
+	EXPECT_GT(256u, before_start);
+	context.switch_into();
+	EXPECT_LE(STACK_USAGE_TEST_SIZE, context.max_stack_usage());
+	EXPECT_GT(STACK_USAGE_TEST_SIZE + 4096, context.max_stack_usage());
+}
 #endif
 
+#ifdef CORO_RUN_BENCHMARKS
+#include "benchmark.h"
+
+namespace
+{
+	template<typename Context>
+	void switch_forever(void * arg)
+	{
+		for (;;) static_cast<Context *>(arg)->switch_out_of();
+	}
+	template<typename Context>
+	void benchmark_switch(const char * name)
+	{
+		static const size_t NUM_ROUND_TRIPS = 1000 * 1000;
+		unsigned char local_stack[64*1024];
+		Context context(local_stack, sizeof(local_stack), &switch_forever<Context>, &context);
+		// a round trip is two switches
+		double nanoseconds = coro::run_benchmark(name, NUM_ROUND_TRIPS, [&context]
+		{
+			context.switch_into();
+		});
+		std::cout << name << ": " << nanoseconds / 2 << " ns per switch" << std::endl;
+		coro::instruction_counter instructions;
+		if (!instructions.is_available())
+		{
+			std::cout << name << ": can't count instructions on this machine" << std::endl;
+			return;
+		}
+		instructions.start();
+		for (size_t i = 0; i < NUM_ROUND_TRIPS; ++i)
+		{
+			context.switch_into();
+		}
+		uint64_t num_instructions = instructions.stop();
+		std::cout << name << ": " << num_instructions / (2.0 * NUM_ROUND_TRIPS) << " instructions per switch" << std::endl;
+	}
+}
+
+TEST(benchmark, switch_backends)
+{
+	benchmark_switch<stack::basic_stack_context<stack::asm_backend> >("asm");
+#ifndef _WIN32
+	benchmark_switch<stack::basic_stack_context<stack::ucontext_backend> >("ucontext");
+	benchmark_switch<stack::basic_stack_context<stack::setjmp_backend> >("setjmp");
+#endif
+}
+#endif
+#endif
@@ -1,30 +1,200 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+#ifdef _MSC_VER
+#	include <xmmintrin.h>
+#endif
+#ifndef _WIN32
+#	include <setjmp.h>
+#	include <ucontext.h>
+#endif
+
 
+// for code that must not call the hooks of -finstrument-functions. see
+// CORO_PREEMPT_AT_FUNCTION_ENTRY in preemption.h
+#ifdef _MSC_VER
+#	define CORO_NO_INSTRUMENT
+#else
+#	define CORO_NO_INSTRUMENT __attribute__((no_instrument_function))
+#endif
+// for functions that read thread_local variables in code that can continue
+// on a different thread after a coroutine switch. see basic_coroutine::current()
+#ifdef _MSC_VER
+#	define CORO_NO_INLINE __declspec(noinline)
+#else
+#	define CORO_NO_INLINE __attribute__((noinline))
+#endif
 
 namespace stack
 {
-struct stack_context
+#ifdef CORO_MEASURE_STACK_USAGE
+void paint_stack(void * stack, size_t stack_size);
+size_t measure_stack_usage(const unsigned char * stack_bottom, const unsigned char * stack_top);
+#endif
+
+// asks the cpu to pull the cache line into the cache, without waiting for it
+inline void prefetch(const void * address)
+{
+#ifdef _MSC_VER
+	_mm_prefetch(static_cast<const char *>(address), _MM_HINT_T0);
+#else
+	__builtin_prefetch(address);
+#endif
+}
+
+// the backends that can switch between stacks. the default is the hand
+// written assembly. define CORO_SWITCH_BACKEND to one of the others to use
+// that for all coroutines instead. they are slower but more portable: the
+// ucontext backend uses swapcontext, which also saves the signal mask and
+// as such makes a syscall on every switch, and the setjmp backend uses
+// _setjmp and _longjmp and only needs makecontext to start the coroutine
+#define CORO_SWITCH_ASM 1
+#define CORO_SWITCH_UCONTEXT 2
+#define CORO_SWITCH_SETJMP 3
+#ifndef CORO_SWITCH_BACKEND
+#define CORO_SWITCH_BACKEND CORO_SWITCH_ASM
+#endif
+
+struct asm_backend
 {
-	stack_context(void * stack, size_t stack_size, void (* function)(void *), void * function_argument);
-	void switch_into();
-	void switch_out_of();
+	void reset(void * stack, size_t stack_size, void (* function)(void *), void * function_argument);
+	CORO_NO_INSTRUMENT void switch_into();
+	CORO_NO_INSTRUMENT void switch_out_of();
+	void prefetch_saved_registers() const
+	{
+		prefetch(my_stack_top);
+		prefetch(static_cast<const char *>(my_stack_top) + 64);
+	}
 
 private:
 	void * caller_stack_top;
 	void * my_stack_top;
-#ifndef _WIN64
-	void * rbp_on_stack;
+};
+
+#ifndef _WIN32
+struct ucontext_backend
+{
+	void reset(void * stack, size_t stack_size, void (* function)(void *), void * function_argument);
+	CORO_NO_INSTRUMENT void switch_into();
+	CORO_NO_INSTRUMENT void switch_out_of();
+	void prefetch_saved_registers() const
+	{
+		// the general purpose registers. the floating point state comes later
+		prefetch(&my_context.uc_mcontext);
+		prefetch(reinterpret_cast<const char *>(&my_context.uc_mcontext) + 64);
+	}
+
+private:
+	ucontext_t caller_context;
+	ucontext_t my_context;
+	void (* function)(void *);
+	void * function_argument;
+
+	static void start(unsigned int this_high, unsigned int this_low);
+};
+
+// this lives in stack_swap_setjmp.cpp, which is compiled without
+// _FORTIFY_SOURCE
+struct setjmp_backend
+{
+	void reset(void * stack, size_t stack_size, void (* function)(void *), void * function_argument);
+	CORO_NO_INSTRUMENT void switch_into();
+	CORO_NO_INSTRUMENT void switch_out_of();
+	void prefetch_saved_registers() const
+	{
+		prefetch(&my_context);
+	}
+
+private:
+	jmp_buf caller_context;
+	jmp_buf my_context;
+	bool started;
+	// only used to get onto the new stack the first time
+	ucontext_t start_context;
+	void (* function)(void *);
+	void * function_argument;
+
+	static void start(unsigned int this_high, unsigned int this_low);
+};
+
+// shared by the ucontext and setjmp backends. makecontext only passes ints
+// to the start function, so the pointer to the backend is split in two
+void make_start_context(ucontext_t & context, void * stack, size_t stack_size, void (* start)(unsigned int, unsigned int), void * backend);
+template<typename T>
+T * from_bits(unsigned int high, unsigned int low)
+{
+	return reinterpret_cast<T *>((static_cast<uintptr_t>(high) << 16 << 16) | low);
+}
 #endif
 
-	// intentionally left unimplemented. there is a this pointer stored on the
-	// stack and as such not even moving makes sense, because then that this
-	// pointer would point to the old address
-	stack_context(const stack_context &);
-	stack_context & operator=(const stack_context &);
-	stack_context(stack_context &&);
-	stack_context & operator=(stack_context &&);
+template<typename Backend>
+struct basic_stack_context
+{
+	basic_stack_context(void * stack, size_t stack_size, void (* function)(void *), void * function_argument)
+	{
+		reset(stack, stack_size, function, function_argument);
+	}
+	// a hook of -finstrument-functions that yields would run after the
+	// caller made the coroutine current but before the switch, so these
+	// must not call the hooks
+	CORO_NO_INSTRUMENT void switch_into()
+	{
+		backend.switch_into();
+	}
+	CORO_NO_INSTRUMENT void switch_out_of()
+	{
+		backend.switch_out_of();
+	}
+	// starts over as if the context had just been constructed. this must not
+	// be called while the context is running
+	void reset(void * stack, size_t stack_size, void (* function)(void *), void * function_argument)
+	{
+#ifdef CORO_MEASURE_STACK_USAGE
+		stack_bottom = static_cast<unsigned char *>(stack);
+		stack_top = static_cast<unsigned char *>(stack) + stack_size;
+		paint_stack(stack, stack_size);
+#endif
+		backend.reset(stack, stack_size, function, function_argument);
+	}
+	// prefetches the registers that switch_into will restore
+	void prefetch_saved_registers() const
+	{
+		backend.prefetch_saved_registers();
+	}
+
+#ifdef CORO_MEASURE_STACK_USAGE
+	// the stack is filled with a pattern when the context is created. this
+	// returns how much of the stack has been overwritten since then, which
+	// is the maximum amount of stack that has been used so far
+	size_t max_stack_usage() const
+	{
+		return measure_stack_usage(stack_bottom, stack_top);
+	}
+#endif
+
+private:
+	Backend backend;
+#ifdef CORO_MEASURE_STACK_USAGE
+	unsigned char * stack_bottom;
+	unsigned char * stack_top;
+#endif
+
+	// intentionally left unimplemented. the backends store a this pointer
+	// on the stack and as such not even moving makes sense, because then
+	// that this pointer would point to the old address
+	basic_stack_context(const basic_stack_context &);
+	basic_stack_context & operator=(const basic_stack_context &);
+	basic_stack_context(basic_stack_context &&);
+	basic_stack_context & operator=(basic_stack_context &&);
 };
 
+#if CORO_SWITCH_BACKEND == CORO_SWITCH_UCONTEXT
+typedef basic_stack_context<ucontext_backend> stack_context;
+#elif CORO_SWITCH_BACKEND == CORO_SWITCH_SETJMP
+typedef basic_stack_context<setjmp_backend> stack_context;
+#else
+typedef basic_stack_context<asm_backend> stack_context;
+#endif
+
 }
@@ -0,0 +1,36 @@
+// with _FORTIFY_SOURCE, _longjmp checks that it doesn't jump to a deeper
+// frame of the same stack. this backend jumps between stacks, which that
+// check can't tell apart from a bug. so it is turned off for this file
+// only, which has nothing but the setjmp backend in it
+#undef _FORTIFY_SOURCE
+#include "stack_swap.h"
+
+#ifndef _WIN32
+namespace stack
+{
+void setjmp_backend::reset(void * stack, size_t stack_size, void (* function)(void *), void * function_argument)
+{
+	this->function = function;
+	this->function_argument = function_argument;
+	started = false;
+	make_start_context(start_context, stack, stack_size, &setjmp_backend::start, this);
+}
+void setjmp_backend::switch_into()
+{
+	if (_setjmp(caller_context)) return;
+	if (started) _longjmp(my_context, 1);
+	started = true;
+	setcontext(&start_context);
+}
+void setjmp_backend::switch_out_of()
+{
+	if (!_setjmp(my_context)) _longjmp(caller_context, 1);
+}
+void setjmp_backend::start(unsigned int this_high, unsigned int this_low)
+{
+	setjmp_backend * self = from_bits<setjmp_backend>(this_high, this_low);
+	self->function(self->function_argument);
+	_longjmp(self->caller_context, 1);
+}
+}
+#endif
@@ -0,0 +1,174 @@
+#include "stack_usage.h"
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <utility>
+
+namespace coro
+{
+namespace
+{
+	struct stack_usage_registry
+	{
+		std::mutex mutex;
+		std::map<std::pair<std::string, const void *>, stack_usage_histogram> histograms;
+	};
+	stack_usage_registry & get_registry()
+	{
+		static stack_usage_registry registry;
+		return registry;
+	}
+	size_t bucket_index(size_t used)
+	{
+		size_t index = 0;
+		while (used >>= 1) ++index;
+		return index;
+	}
+}
+
+size_t stack_usage_histogram::percentile(double fraction) const
+{
+	if (fraction >= 1.0) return max_usage;
+	size_t to_count = static_cast<size_t>(fraction * num_samples);
+	size_t counted = 0;
+	for (size_t i = 0; i < buckets.size(); ++i)
+	{
+		counted += buckets[i];
+		if (counted > to_count) return std::min(max_usage, (size_t(2) << i) - 1);
+	}
+	return max_usage;
+}
+
+void record_stack_usage(const char * key, size_t used, size_t stack_size)
+{
+	record_stack_usage(key, nullptr, used, stack_size);
+}
+void record_stack_usage(const char * key, const void * function, size_t used, size_t stack_size)
+{
+	stack_usage_registry & registry = get_registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	stack_usage_histogram & histogram = registry.histograms[std::make_pair(std::string(key), function)];
+	if (histogram.buckets.empty())
+	{
+		histogram.key = key;
+		histogram.function = function;
+		histogram.stack_size = 0;
+		histogram.num_samples = 0;
+		histogram.max_usage = 0;
+		histogram.buckets.resize(stack_usage_histogram::NUM_BUCKETS);
+	}
+	histogram.stack_size = std::max(histogram.stack_size, stack_size);
+	++histogram.num_samples;
+	histogram.max_usage = std::max(histogram.max_usage, used);
+	++histogram.buckets[bucket_index(used)];
+}
+
+std::vector<stack_usage_histogram> get_stack_usage_histograms()
+{
+	stack_usage_registry & registry = get_registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	std::vector<stack_usage_histogram> result;
+	result.reserve(registry.histograms.size());
+	for (const auto & histogram : registry.histograms)
+	{
+		result.push_back(histogram.second);
+	}
+	return result;
+}
+
+void reset_stack_usage_histograms()
+{
+	stack_usage_registry & registry = get_registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.histograms.clear();
+}
+}
+
+
+#ifndef DISABLE_GTEST
+#include <gtest/gtest.h>
+#include "coroutine.h"
+
+TEST(stack_usage, histogram)
+{
+	using namespace coro;
+	reset_stack_usage_histograms();
+	for (size_t i = 1; i <= 100; ++i)
+	{
+		record_stack_usage("test", i * 100, 64 * 1024);
+	}
+	record_stack_usage("other", 10, 1024);
+	std::vector<stack_usage_histogram> histograms = get_stack_usage_histograms();
+	ASSERT_EQ(2u, histograms.size());
+	const stack_usage_histogram & test = histograms[0].key == "test" ? histograms[0] : histograms[1];
+	EXPECT_EQ(100u, test.num_samples);
+	EXPECT_EQ(10000u, test.max_usage);
+	EXPECT_EQ(64u * 1024, test.stack_size);
+	EXPECT_EQ(10000u, test.percentile(1.0));
+	// 100 to 200 are in the buckets for 64 and 128
+	EXPECT_EQ(255u, test.percentile(0.01));
+	EXPECT_LE(9000u, test.percentile(0.9));
+	reset_stack_usage_histograms();
+	EXPECT_TRUE(get_stack_usage_histograms().empty());
+}
+
+#ifdef CORO_MEASURE_STACK_USAGE
+TEST(stack_usage, coroutine)
+{
+	using namespace coro;
+	reset_stack_usage_histograms();
+	for (int i = 0; i < 3; ++i)
+	{
+		coroutine<void ()> uses_stack([](coroutine<void ()>::self & self)
+		{
+			volatile char used[8 * 1024];
+			used[0] = 0;
+			self.yield();
+			used[0] = used[0] + 1;
+		});
+		uses_stack();
+		EXPECT_LE(8u * 1024, uses_stack.max_stack_usage());
+		uses_stack();
+	}
+	std::vector<stack_usage_histogram> histograms = get_stack_usage_histograms();
+	ASSERT_EQ(1u, histograms.size());
+	EXPECT_EQ(3u, histograms[0].num_samples);
+	EXPECT_LE(8u * 1024, histograms[0].max_usage);
+	EXPECT_EQ(size_t(CORO_DEFAULT_STACK_SIZE), histograms[0].stack_size);
+	reset_stack_usage_histograms();
+}
+
+namespace
+{
+	void shallow(coro::coroutine<void ()>::self &)
+	{
+	}
+	void deep(coro::coroutine<void ()>::self &)
+	{
+		volatile char used[8 * 1024];
+		used[0] = 0;
+		used[0] = used[0] + 1;
+	}
+}
+
+TEST(stack_usage, function_pointers)
+{
+	using namespace coro;
+	reset_stack_usage_histograms();
+	for (void (*function)(coroutine<void ()>::self &) : { &shallow, &deep, &shallow })
+	{
+		coroutine<void ()> plain_function(function);
+		plain_function();
+	}
+	std::vector<stack_usage_histogram> histograms = get_stack_usage_histograms();
+	ASSERT_EQ(2u, histograms.size());
+	const stack_usage_histogram & deep_histogram = histograms[0].function == reinterpret_cast<const void *>(&deep) ? histograms[0] : histograms[1];
+	const stack_usage_histogram & shallow_histogram = histograms[0].function == reinterpret_cast<const void *>(&deep) ? histograms[1] : histograms[0];
+	EXPECT_EQ(reinterpret_cast<const void *>(&shallow), shallow_histogram.function);
+	EXPECT_EQ(2u, shallow_histogram.num_samples);
+	EXPECT_EQ(1u, deep_histogram.num_samples);
+	EXPECT_LT(shallow_histogram.max_usage, deep_histogram.max_usage);
+	reset_stack_usage_histograms();
+}
+#endif
+#endif
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace coro
+{
+/**
+ * collects how much stack coroutines used, grouped by the function that
+ * the coroutine was running. coroutines record their usage in here when
+ * they finish if CORO_MEASURE_STACK_USAGE is defined. use this to pick
+ * the stack size for each kind of coroutine
+ */
+struct stack_usage_histogram
+{
+	static const size_t NUM_BUCKETS = sizeof(size_t) * 8;
+
+	// the type name of the function that the coroutine ran
+	std::string key;
+	// coroutines that ran plain function pointers all have the same type
+	// name, so they are told apart by the address of the function. this is
+	// nullptr for other functions
+	const void * function;
+	// the biggest stack that was given to one of the coroutines
+	size_t stack_size;
+	size_t num_samples;
+	size_t max_usage;
+	// buckets[i] counts the coroutines that used between 2^i and 2^(i+1) - 1 bytes
+	std::vector<size_t> buckets;
+
+	// returns an upper bound for the stack usage of the given fraction of
+	// coroutines. percentile(1.0) returns max_usage
+	size_t percentile(double fraction) const;
+};
+
+void record_stack_usage(const char * key, size_t used, size_t stack_size);
+void record_stack_usage(const char * key, const void * function, size_t used, size_t stack_size);
+std::vector<stack_usage_histogram> get_stack_usage_histograms();
+void reset_stack_usage_histograms();
+}
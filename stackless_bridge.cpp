@@ -0,0 +1,174 @@
+#include "stackless_bridge.h"
+
+
+#ifndef DISABLE_GTEST
+#ifdef CORO_HAS_STACKLESS_BRIDGE
+#include <gtest/gtest.h>
+
+namespace
+{
+	// the smallest C++20 coroutine type that can be used in the tests. it
+	// runs eagerly and stores its result
+	struct eager_task
+	{
+		struct promise_type
+		{
+			int result = 0;
+			eager_task get_return_object()
+			{
+				return eager_task(std::coroutine_handle<promise_type>::from_promise(*this));
+			}
+			std::suspend_never initial_suspend() noexcept
+			{
+				return {};
+			}
+			std::suspend_always final_suspend() noexcept
+			{
+				return {};
+			}
+			void return_value(int value)
+			{
+				result = value;
+			}
+			void unhandled_exception()
+			{
+				throw;
+			}
+		};
+
+		explicit eager_task(std::coroutine_handle<promise_type> handle)
+			: handle(handle)
+		{
+		}
+		eager_task(eager_task && other)
+			: handle(std::exchange(other.handle, nullptr))
+		{
+		}
+		~eager_task()
+		{
+			if (handle) handle.destroy();
+		}
+		bool done() const
+		{
+			return handle.done();
+		}
+		int result() const
+		{
+			return handle.promise().result;
+		}
+
+		std::coroutine_handle<promise_type> handle;
+	};
+
+	// an awaitable that is completed by calling set()
+	struct manual_event
+	{
+		bool await_ready() const
+		{
+			return value != 0;
+		}
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			waiting = handle;
+		}
+		int await_resume() const
+		{
+			return value;
+		}
+		void set(int to_set)
+		{
+			value = to_set;
+			if (waiting) std::exchange(waiting, nullptr).resume();
+		}
+
+		int value = 0;
+		std::coroutine_handle<> waiting;
+	};
+
+	eager_task sum_steps(coro::coroutine<int (int)> & steps)
+	{
+		int sum = 0;
+		for (int i = 1; steps; ++i)
+		{
+			sum += co_await coro::resume(steps, i);
+		}
+		co_return sum;
+	}
+}
+
+TEST(stackless_bridge, resume_from_stackless)
+{
+	using namespace coro;
+	coroutine<int (int)> steps([](coroutine<int (int)>::self & self, int i)
+	{
+		while (i < 3)
+		{
+			i = std::get<0>(self.yield(i * 10));
+		}
+		return i * 10;
+	});
+	eager_task task = sum_steps(steps);
+	ASSERT_TRUE(task.done());
+	EXPECT_EQ(60, task.result());
+}
+
+TEST(stackless_bridge, await_from_stackful)
+{
+	using namespace coro;
+	manual_event event;
+	int received = 0;
+	coroutine<void ()> waiter([&](coroutine<void ()>::self & self)
+	{
+		received = await(self, event);
+	});
+	waiter();
+	EXPECT_TRUE(waiter);
+	waiter();
+	EXPECT_TRUE(waiter);
+	event.set(7);
+	waiter();
+	EXPECT_FALSE(waiter);
+	EXPECT_EQ(7, received);
+
+	// an awaitable that is already done doesn't yield
+	coroutine<void ()> ready([&](coroutine<void ()>::self & self)
+	{
+		received = await(self, event) + 1;
+	});
+	ready();
+	EXPECT_FALSE(ready);
+	EXPECT_EQ(8, received);
+}
+
+// without exceptions, cancel() doesn't unwind the stack
+#ifndef CORO_NO_EXCEPTIONS
+TEST(stackless_bridge, cancel_while_awaiting)
+{
+	using namespace coro;
+	manual_event event;
+	bool unwound = false;
+	coroutine<void ()> waiter([&](coroutine<void ()>::self & self)
+	{
+		struct set_on_destruction
+		{
+			bool & to_set;
+			~set_on_destruction()
+			{
+				to_set = true;
+			}
+		} set_unwound{unwound};
+		await(self, event);
+		ADD_FAILURE() << "the await should have been cancelled";
+	});
+	waiter();
+	ASSERT_TRUE(event.waiting);
+	waiter.cancel();
+	EXPECT_FALSE(waiter);
+	EXPECT_TRUE(unwound);
+	// the awaitable still holds the handle. resuming it frees the frame
+	event.set(1);
+	EXPECT_FALSE(event.waiting);
+}
+#endif
+#endif
+#endif
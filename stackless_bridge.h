@@ -0,0 +1,205 @@
+#pragma once
+
+#include "coroutine.h"
+
+// only available if the compiler supports C++20 coroutines
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L && defined(__has_include)
+#	if __has_include(<coroutine>)
+#		define CORO_HAS_STACKLESS_BRIDGE
+#	endif
+#endif
+
+#ifdef CORO_HAS_STACKLESS_BRIDGE
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace coro
+{
+/**
+ * co_await resume(c, args...) runs the stackful coroutine c from inside of
+ * a C++20 coroutine until c yields or returns, and gives back the result.
+ * stackful coroutines run on the thread that resumes them, so this never
+ * suspends the C++20 coroutine. exceptions from c are thrown out of the
+ * co_await
+ */
+template<typename Result, typename... Arguments>
+struct resume_awaitable
+{
+	resume_awaitable(coroutine<Result (Arguments...)> & to_resume, std::tuple<Arguments...> arguments)
+		: to_resume(to_resume), arguments(std::move(arguments))
+	{
+	}
+
+	bool await_ready() const noexcept
+	{
+		return true;
+	}
+	void await_suspend(std::coroutine_handle<>) const noexcept
+	{
+	}
+	Result await_resume()
+	{
+		return std::apply(to_resume, std::move(arguments));
+	}
+
+private:
+	coroutine<Result (Arguments...)> & to_resume;
+	std::tuple<Arguments...> arguments;
+};
+template<typename Result, typename... Arguments, typename... Passed>
+resume_awaitable<Result, Arguments...> resume(coroutine<Result (Arguments...)> & to_resume, Passed &&... arguments)
+{
+	return resume_awaitable<Result, Arguments...>(to_resume, std::tuple<Arguments...>(std::forward<Passed>(arguments)...));
+}
+
+namespace detail
+{
+	// a C++20 coroutine that does nothing but set a flag when it is resumed.
+	// its handle is what a stackful coroutine passes to await_suspend. the
+	// flag lives in the frame, which is on the heap, so that the awaitable
+	// can still resume the handle after the stackful coroutine was cancelled.
+	// whichever of the two sides is done last destroys the frame
+	struct resume_signal
+	{
+		struct promise_type
+		{
+			enum : int
+			{
+				WAITING,
+				RESUMED,
+				ABANDONED
+			};
+
+			// sets the flag once the frame is suspended for the last time.
+			// the stackful coroutine destroys the frame as soon as it sees
+			// the flag, which may happen on another thread right away
+			struct set_flag_when_suspended
+			{
+				bool await_ready() noexcept
+				{
+					return false;
+				}
+				void await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+				{
+					// the frame must not be touched after the exchange,
+					// unless the stackful coroutine has already given up
+					int expected = WAITING;
+					if (!handle.promise().state.compare_exchange_strong(expected, RESUMED, std::memory_order_acq_rel))
+						handle.destroy();
+				}
+				void await_resume() noexcept
+				{
+				}
+			};
+
+			resume_signal get_return_object()
+			{
+				return resume_signal(std::coroutine_handle<promise_type>::from_promise(*this));
+			}
+			std::suspend_always initial_suspend() noexcept
+			{
+				return {};
+			}
+			set_flag_when_suspended final_suspend() noexcept
+			{
+				return {};
+			}
+			void return_void()
+			{
+			}
+			void unhandled_exception()
+			{
+				std::terminate();
+			}
+
+			std::atomic<int> state{WAITING};
+		};
+
+		explicit resume_signal(std::coroutine_handle<promise_type> handle)
+			: handle(handle)
+		{
+		}
+		// if the awaitable still holds the handle, the frame is left to it.
+		// this happens if yield() throws coroutine_cancelled while waiting
+		~resume_signal()
+		{
+			int expected = promise_type::WAITING;
+			if (!handed_out || !handle.promise().state.compare_exchange_strong(expected, promise_type::ABANDONED, std::memory_order_acq_rel))
+				handle.destroy();
+		}
+
+		bool resumed() const
+		{
+			return handle.promise().state.load(std::memory_order_acquire) == promise_type::RESUMED;
+		}
+		void set_resumed()
+		{
+			handle.promise().state.store(promise_type::RESUMED, std::memory_order_relaxed);
+		}
+
+		std::coroutine_handle<promise_type> handle;
+		// set once await_suspend returned, and the awaitable may resume the
+		// handle at any time from then on
+		bool handed_out = false;
+
+	private:
+		// intentionally not implemented
+		resume_signal(const resume_signal &);
+		resume_signal & operator=(const resume_signal &);
+	};
+	inline resume_signal signal_on_resume()
+	{
+		co_return;
+	}
+
+	template<typename Awaitable>
+	decltype(auto) get_awaiter(Awaitable && awaitable)
+	{
+		if constexpr (requires { std::forward<Awaitable>(awaitable).operator co_await(); })
+			return std::forward<Awaitable>(awaitable).operator co_await();
+		else
+			return std::forward<Awaitable>(awaitable);
+	}
+}
+
+/**
+ * blocks a stackful coroutine on a C++20 awaitable. until the awaitable is
+ * done, the coroutine yields every time that it is resumed, without a new
+ * result. the caller of the coroutine has to keep calling it, like the
+ * schedulers in scheduler.h and simulation.h do. the awaitable may finish
+ * on another thread. waiting allocates the frame of one C++20 coroutine.
+ * the coroutine may be cancelled while it waits. the awaitable can still
+ * resume its handle after that, and then frees the frame. if the coroutine
+ * is destroyed without being cancelled, or with CORO_NO_EXCEPTIONS, the
+ * frame is never freed
+ */
+template<typename Awaitable>
+decltype(auto) await(basic_coroutine & self, Awaitable && awaitable)
+{
+	auto && awaiter = detail::get_awaiter(std::forward<Awaitable>(awaitable));
+	if (!awaiter.await_ready())
+	{
+		detail::resume_signal signal = detail::signal_on_resume();
+		typedef decltype(awaiter.await_suspend(signal.handle)) suspend_result;
+		if constexpr (std::is_void<suspend_result>::value)
+			awaiter.await_suspend(signal.handle);
+		else if constexpr (std::is_same<suspend_result, bool>::value)
+		{
+			if (!awaiter.await_suspend(signal.handle)) signal.set_resumed();
+		}
+		else
+			awaiter.await_suspend(signal.handle).resume();
+		signal.handed_out = true;
+		while (!signal.resumed())
+		{
+			self.yield();
+		}
+	}
+	return awaiter.await_resume();
+}
+}
+#endif
@@ -0,0 +1,345 @@
+#include "stream_parser.h"
+#include <vector>
+#ifndef CORO_NO_EXCEPTIONS
+#	include <stdexcept>
+#endif
+
+namespace coro
+{
+namespace
+{
+	// the parse function returns after this
+	void reject_record()
+	{
+#		ifndef CORO_NO_EXCEPTIONS
+			throw std::length_error("The record is larger than the maximum record size of the stream_parser");
+#		endif
+	}
+
+	void parse_length_prefixed_up_to(stream_parser<byte_chunk>::input & in, size_t max_record_size)
+	{
+		std::vector<unsigned char> buffer;
+		for (;;)
+		{
+			unsigned char header[4];
+			if (!in.read(header, sizeof(header))) return;
+			size_t length = size_t(header[0]) | size_t(header[1]) << 8 | size_t(header[2]) << 16 | size_t(header[3]) << 24;
+			if (length > max_record_size)
+			{
+				reject_record();
+				return;
+			}
+			byte_chunk record;
+			if (!length || (in.wait_for_data() && in.available() >= length))
+			{
+				record.data = in.peek().data;
+				record.size = length;
+				in.skip(length);
+				in.emit(record);
+			}
+			else
+			{
+				buffer.resize(length);
+				if (!in.read(buffer.data(), length)) return;
+				record.data = buffer.data();
+				record.size = length;
+				// the buffer is reused for the next record that crosses
+				// chunks. this happens at most once per chunk
+				in.emit(record);
+				in.flush();
+			}
+		}
+	}
+
+	void parse_lines_up_to(stream_parser<byte_chunk>::input & in, size_t max_record_size)
+	{
+		// the start of a line that crosses chunks
+		std::vector<unsigned char> partial;
+		while (in.wait_for_data())
+		{
+			byte_chunk rest = in.peek();
+			const unsigned char * newline = static_cast<const unsigned char *>(std::memchr(rest.data, '\n', rest.size));
+			size_t length = newline ? newline - rest.data : rest.size;
+			if (partial.size() + length > max_record_size)
+			{
+				reject_record();
+				return;
+			}
+			if (!newline)
+			{
+				partial.insert(partial.end(), rest.data, rest.data + rest.size);
+				in.skip(rest.size);
+				continue;
+			}
+			byte_chunk record = { rest.data, length };
+			in.skip(length + 1);
+			if (partial.empty()) in.emit(record);
+			else
+			{
+				partial.insert(partial.end(), rest.data, newline);
+				record.data = partial.data();
+				record.size = partial.size();
+				// partial is reused for the next line that crosses chunks.
+				// this happens at most once per chunk
+				in.emit(record);
+				in.flush();
+				partial.clear();
+			}
+		}
+		if (!partial.empty())
+		{
+			byte_chunk record = { partial.data(), partial.size() };
+			in.emit(record);
+			in.flush();
+		}
+	}
+}
+
+void parse_length_prefixed(stream_parser<byte_chunk>::input & in)
+{
+	parse_length_prefixed_up_to(in, DEFAULT_MAX_RECORD_SIZE);
+}
+std::function<void (stream_parser<byte_chunk>::input &)> length_prefixed_parser(size_t max_record_size)
+{
+	return [max_record_size](stream_parser<byte_chunk>::input & in)
+	{
+		parse_length_prefixed_up_to(in, max_record_size);
+	};
+}
+
+void parse_lines(stream_parser<byte_chunk>::input & in)
+{
+	parse_lines_up_to(in, DEFAULT_MAX_RECORD_SIZE);
+}
+std::function<void (stream_parser<byte_chunk>::input &)> line_parser(size_t max_record_size)
+{
+	return [max_record_size](stream_parser<byte_chunk>::input & in)
+	{
+		parse_lines_up_to(in, max_record_size);
+	};
+}
+}
+
+
+#ifndef DISABLE_GTEST
+#include <gtest/gtest.h>
+#include <string>
+
+namespace
+{
+	std::vector<std::string> parse_in_chunks(const std::string & input, size_t chunk_size, void (*parse)(coro::stream_parser<coro::byte_chunk>::input &))
+	{
+		std::vector<std::string> records;
+		coro::stream_parser<coro::byte_chunk> parser(parse);
+		for (size_t i = 0; i < input.size(); i += chunk_size)
+		{
+			parser.push(input.data() + i, std::min(chunk_size, input.size() - i));
+			while (const coro::byte_chunk * record = parser.next())
+			{
+				records.emplace_back(reinterpret_cast<const char *>(record->data), record->size);
+			}
+		}
+		parser.finish();
+		while (const coro::byte_chunk * record = parser.next())
+		{
+			records.emplace_back(reinterpret_cast<const char *>(record->data), record->size);
+		}
+		EXPECT_TRUE(parser.is_done());
+		return records;
+	}
+	void append_length_prefixed(std::string & out, const std::string & record)
+	{
+		size_t length = record.size();
+		for (int i = 0; i < 4; ++i)
+		{
+			out += static_cast<char>((length >> (8 * i)) & 0xff);
+		}
+		out += record;
+	}
+}
+
+TEST(stream_parser, lines)
+{
+	std::string input = "first line\nsecond\n\na line that is longer than the chunks\nno newline at the end";
+	std::vector<std::string> expected = { "first line", "second", "", "a line that is longer than the chunks", "no newline at the end" };
+	for (size_t chunk_size : { 1, 3, 7, 100 })
+	{
+		EXPECT_EQ(expected, parse_in_chunks(input, chunk_size, &coro::parse_lines));
+	}
+}
+
+TEST(stream_parser, length_prefixed)
+{
+	std::vector<std::string> expected = { "hello", "", std::string(300, 'x'), "world" };
+	std::string input;
+	for (const std::string & record : expected)
+	{
+		append_length_prefixed(input, record);
+	}
+	std::string cut_off = input;
+	append_length_prefixed(cut_off, "this one is incomplete");
+	cut_off.resize(cut_off.size() - 3);
+	for (size_t chunk_size : { 1, 5, 64, 1000 })
+	{
+		EXPECT_EQ(expected, parse_in_chunks(input, chunk_size, &coro::parse_length_prefixed));
+		EXPECT_EQ(expected, parse_in_chunks(cut_off, chunk_size, &coro::parse_length_prefixed));
+	}
+}
+
+TEST(stream_parser, more_records_than_a_batch)
+{
+	std::vector<std::string> expected;
+	std::string lines;
+	std::string length_prefixed;
+	for (size_t i = 0; i < 5 * coro::stream_parser<coro::byte_chunk>::BATCH_SIZE; ++i)
+	{
+		expected.push_back(std::string(i % 7, static_cast<char>('a' + i % 26)));
+		lines += expected.back() + '\n';
+		append_length_prefixed(length_prefixed, expected.back());
+	}
+	for (size_t chunk_size : { 1, 13, 100, 100000 })
+	{
+		EXPECT_EQ(expected, parse_in_chunks(lines, chunk_size, &coro::parse_lines));
+		EXPECT_EQ(expected, parse_in_chunks(length_prefixed, chunk_size, &coro::parse_length_prefixed));
+	}
+}
+
+TEST(stream_parser, max_record_size)
+{
+	using namespace coro;
+	std::string length_prefixed;
+	append_length_prefixed(length_prefixed, "short");
+	append_length_prefixed(length_prefixed, "too long");
+	std::string lines = "short\ntoo long\n";
+	std::function<void (stream_parser<byte_chunk>::input &)> parsers[] = { length_prefixed_parser(5), line_parser(5) };
+	const std::string * inputs[] = { &length_prefixed, &lines };
+	for (int i = 0; i < 2; ++i)
+	{
+		stream_parser<byte_chunk> parser(parsers[i]);
+		parser.push(inputs[i]->data(), inputs[i]->size());
+		const byte_chunk * record = parser.next();
+		ASSERT_TRUE(record != nullptr);
+		EXPECT_EQ("short", std::string(reinterpret_cast<const char *>(record->data), record->size));
+#		ifdef CORO_NO_EXCEPTIONS
+			EXPECT_EQ(nullptr, parser.next());
+#		else
+			EXPECT_THROW(parser.next(), std::length_error);
+#		endif
+		EXPECT_TRUE(parser.is_done());
+	}
+	// a huge length in the header is rejected before anything is allocated
+	const unsigned char huge[] = { 0xff, 0xff, 0xff, 0x7f };
+	stream_parser<byte_chunk> parser(&parse_length_prefixed);
+	parser.push(huge, sizeof(huge));
+#	ifdef CORO_NO_EXCEPTIONS
+		EXPECT_EQ(nullptr, parser.next());
+#	else
+		EXPECT_THROW(parser.next(), std::length_error);
+#	endif
+	EXPECT_TRUE(parser.is_done());
+}
+
+TEST(stream_parser, zero_copy)
+{
+	using namespace coro;
+	std::string input = "abc\ndef\n";
+	stream_parser<byte_chunk> parser(&parse_lines);
+	parser.push(input.data(), input.size());
+	const byte_chunk * record = parser.next();
+	ASSERT_TRUE(record != nullptr);
+	EXPECT_EQ(reinterpret_cast<const unsigned char *>(input.data()), record->data);
+	record = parser.next();
+	ASSERT_TRUE(record != nullptr);
+	EXPECT_EQ(reinterpret_cast<const unsigned char *>(input.data() + 4), record->data);
+	EXPECT_EQ(nullptr, parser.next());
+	EXPECT_FALSE(parser.is_done());
+	parser.finish();
+	EXPECT_EQ(nullptr, parser.next());
+	EXPECT_TRUE(parser.is_done());
+}
+
+TEST(stream_parser, custom_records)
+{
+	using namespace coro;
+	// sums of bytes, one record per zero byte
+	stream_parser<int> parser([](stream_parser<int>::input & in)
+	{
+		int sum = 0;
+		unsigned char byte;
+		while (in.next_byte(byte))
+		{
+			if (byte) sum += byte;
+			else
+			{
+				in.emit(sum);
+				sum = 0;
+			}
+		}
+	});
+	const unsigned char first[] = { 1, 2, 0, 3 };
+	const unsigned char second[] = { 4, 0 };
+	parser.push(first, sizeof(first));
+	const int * sum = parser.next();
+	ASSERT_TRUE(sum != nullptr);
+	EXPECT_EQ(3, *sum);
+	EXPECT_EQ(nullptr, parser.next());
+	parser.push(second, sizeof(second));
+	sum = parser.next();
+	ASSERT_TRUE(sum != nullptr);
+	EXPECT_EQ(7, *sum);
+#	ifndef CORO_NO_EXCEPTIONS
+		// the parser isn't done with the chunk yet
+		EXPECT_THROW(parser.push(first, sizeof(first)), std::logic_error);
+#	endif
+}
+
+#ifdef CORO_RUN_BENCHMARKS
+#include "benchmark.h"
+#include <iostream>
+
+namespace
+{
+	void benchmark_parser(const char * name, const std::string & input, size_t expected_records, void (*parse)(coro::stream_parser<coro::byte_chunk>::input &))
+	{
+		static const size_t CHUNK_SIZE = 64 * 1024;
+		size_t num_records = 0;
+		double nanoseconds = coro::run_benchmark(name, 10, [&]
+		{
+			num_records = 0;
+			coro::stream_parser<coro::byte_chunk> parser(parse);
+			for (size_t i = 0; i < input.size(); i += CHUNK_SIZE)
+			{
+				parser.push(input.data() + i, std::min(CHUNK_SIZE, input.size() - i));
+				while (parser.next())
+				{
+					++num_records;
+				}
+			}
+			parser.finish();
+			while (parser.next())
+			{
+				++num_records;
+			}
+		});
+		EXPECT_EQ(expected_records, num_records);
+		std::cout << name << ": " << input.size() / nanoseconds << " GB/s" << std::endl;
+	}
+}
+
+TEST(benchmark, stream_parser)
+{
+	static const size_t NUM_RECORDS = 1024 * 1024;
+	std::string lines;
+	std::string length_prefixed;
+	for (size_t i = 0; i < NUM_RECORDS; ++i)
+	{
+		std::string record(16 + i % 96, static_cast<char>('a' + i % 26));
+		lines += record;
+		lines += '\n';
+		append_length_prefixed(length_prefixed, record);
+	}
+	benchmark_parser("decode newline delimited records", lines, NUM_RECORDS, &coro::parse_lines);
+	benchmark_parser("decode length prefixed records", length_prefixed, NUM_RECORDS, &coro::parse_length_prefixed);
+}
+#endif
+#endif
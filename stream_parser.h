@@ -0,0 +1,292 @@
+#pragma once
+
+#include "coroutine.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <functional>
+#ifndef CORO_NO_EXCEPTIONS
+#	include <exception>
+#	include <stdexcept>
+#endif
+
+namespace coro
+{
+// a view of bytes that someone else owns
+struct byte_chunk
+{
+	const unsigned char * data;
+	size_t size;
+};
+
+/**
+ * decodes a stream of bytes that arrives in chunks, like from a socket. the
+ * caller pushes a chunk and then takes records out with next() until that
+ * returns nullptr, which means that the parser has used up the chunk and
+ * needs the next one. the parser is written as if it pulled bytes from a
+ * stream: it runs in a coroutine, and whenever the current chunk runs dry
+ * it suspends until the caller pushes the next one.
+ *
+ * the parser collects records in a batch on its stack and only switches
+ * back to the caller when the batch is full or the chunk runs dry. next()
+ * hands out the records of the batch without switching. so a Record has
+ * to be default constructible and copyable.
+ *
+ * nothing is copied on the way in: the parser reads straight from the
+ * chunks of the caller. so a chunk has to stay alive and unchanged until
+ * next() returned nullptr. records are returned as pointers into the
+ * batch, which are valid until the next call to next()
+ */
+template<typename Record>
+struct stream_parser
+{
+	static const size_t BATCH_SIZE = 64;
+
+	// what the parser coroutine hands to next()
+	struct record_batch
+	{
+		const Record * records;
+		size_t size;
+		// true if the parser waits for the next chunk once the caller has
+		// taken all records out of the batch
+		bool needs_input;
+	};
+	typedef coroutine<record_batch (byte_chunk)> parser_coroutine;
+
+	// the parse function gets this to pull bytes and to hand out records
+	struct input
+	{
+		input(typename parser_coroutine::self & self, byte_chunk first_chunk)
+			: self(self)
+			, position(first_chunk.data)
+			, end(first_chunk.data + first_chunk.size)
+			, is_at_end(!first_chunk.data)
+			, batch_size(0)
+		{
+		}
+
+		// the unread rest of the current chunk
+		byte_chunk peek() const
+		{
+			byte_chunk rest = { position, available() };
+			return rest;
+		}
+		size_t available() const
+		{
+			return end - position;
+		}
+		// skips bytes of the current chunk. can't skip more than available()
+		void skip(size_t size)
+		{
+			assert(size <= available());
+			position += size;
+		}
+		// suspends until the caller pushes the next chunk if the current one
+		// is used up. returns false at the end of the stream
+		bool wait_for_data()
+		{
+			while (position == end)
+			{
+				if (is_at_end) return false;
+				byte_chunk next = std::get<0>(self.yield(take_batch(true)));
+				if (!next.data) is_at_end = true;
+				else
+				{
+					position = next.data;
+					end = next.data + next.size;
+				}
+			}
+			return true;
+		}
+		bool next_byte(unsigned char & byte)
+		{
+			if (!wait_for_data()) return false;
+			byte = *position++;
+			return true;
+		}
+		// copies bytes, even if they are spread over several chunks. returns
+		// false if the stream ended first
+		bool read(void * out, size_t size)
+		{
+			unsigned char * to = static_cast<unsigned char *>(out);
+			while (size)
+			{
+				if (!wait_for_data()) return false;
+				size_t to_copy = std::min(size, available());
+				std::memcpy(to, position, to_copy);
+				position += to_copy;
+				to += to_copy;
+				size -= to_copy;
+			}
+			return true;
+		}
+		// copies the record into the batch. what the record points to has
+		// to stay unchanged until the batch is handed out, which happens
+		// when it is full, when the chunk runs dry, or in flush(). so flush
+		// before a record in a local buffer of the parse function goes away
+		void emit(const Record & record)
+		{
+			batch[batch_size++] = record;
+			if (batch_size == BATCH_SIZE) flush();
+		}
+		// hands the records that were emitted so far to the caller. call this
+		// before changing memory that an emitted record points to
+		void flush()
+		{
+			if (batch_size) self.yield(take_batch(false));
+		}
+
+	private:
+		typename parser_coroutine::self & self;
+		const unsigned char * position;
+		const unsigned char * end;
+		bool is_at_end;
+		size_t batch_size;
+		Record batch[BATCH_SIZE];
+
+		record_batch take_batch(bool needs_input)
+		{
+			record_batch taken = { batch, batch_size, needs_input };
+			batch_size = 0;
+			return taken;
+		}
+	};
+
+	explicit stream_parser(std::function<void (input &)> parse, size_t stack_size = CORO_DEFAULT_STACK_SIZE)
+		: parser([parse](typename parser_coroutine::self & self, byte_chunk first_chunk) -> record_batch
+		{
+			input in(self, first_chunk);
+#			ifdef CORO_NO_EXCEPTIONS
+				parse(in);
+#			else
+				// the records before the exception are handed out first.
+				// this doesn't yield inside of the catch, because the
+				// caller could be in a catch of its own
+				std::exception_ptr exception;
+				try
+				{
+					parse(in);
+				}
+				catch(const coroutine_cancelled &)
+				{
+					throw;
+				}
+				catch(...)
+				{
+					exception = std::current_exception();
+				}
+#			endif
+			in.flush();
+#			ifndef CORO_NO_EXCEPTIONS
+				if (exception) std::rethrow_exception(exception);
+#			endif
+			record_batch none = { nullptr, 0, true };
+			return none;
+		}, stack_size)
+		, current(nullptr)
+		, batch_end(nullptr)
+		, has_pending(false)
+		, parser_needs_input(true)
+		, can_push(true)
+		, is_input_finished(false)
+	{
+	}
+
+	// only call this when next() has returned nullptr, or before the first
+	// call to next()
+	void push(const void * data, size_t size)
+	{
+		check_can_push();
+		if (!size) return;
+		pending.data = static_cast<const unsigned char *>(data);
+		pending.size = size;
+		has_pending = true;
+	}
+	// tells the parser that no more chunks will come. call next() after
+	// this to get the records at the end of the stream
+	void finish()
+	{
+		check_can_push();
+		is_input_finished = true;
+	}
+
+	// returns nullptr if the parser needs the next chunk or is done
+	const Record * next()
+	{
+		if (current != batch_end) return current++;
+		if (!parser) return nullptr;
+		byte_chunk argument = { nullptr, 0 };
+		if (parser_needs_input)
+		{
+			if (has_pending)
+			{
+				argument = pending;
+				has_pending = false;
+			}
+			// an empty chunk marks the end of the stream
+			else if (!is_input_finished)
+			{
+				can_push = true;
+				return nullptr;
+			}
+		}
+		can_push = false;
+		record_batch batch = parser(argument);
+		parser_needs_input = batch.needs_input;
+		current = batch.records;
+		batch_end = batch.records + batch.size;
+		if (current != batch_end) return current++;
+		can_push = true;
+		return nullptr;
+	}
+
+	// true once the parser has returned. this happens at the end of the
+	// stream, or earlier if the parse function decides to stop
+	bool is_done() const
+	{
+		return !parser;
+	}
+
+private:
+	parser_coroutine parser;
+	// the records of the batch that next() hasn't returned yet
+	const Record * current;
+	const Record * batch_end;
+	byte_chunk pending;
+	bool has_pending;
+	// true if the parser waits in wait_for_data()
+	bool parser_needs_input;
+	// true if next() returned nullptr since the last push
+	bool can_push;
+	bool is_input_finished;
+
+	void check_can_push() const
+	{
+#		ifdef CORO_NO_EXCEPTIONS
+			assert(can_push && !has_pending && !is_input_finished);
+#		else
+			if (!can_push || has_pending || is_input_finished) throw std::logic_error("You can only push a chunk after next() returned nullptr");
+#		endif
+	}
+};
+
+// parse functions for stream_parser<byte_chunk>. the records point into
+// the chunk if they are entirely inside of it, and into a buffer of the
+// parser if they cross chunks
+
+// the bytes come from somewhere else, so the size of a record can't be
+// trusted. a record that is larger than the maximum is rejected: next()
+// throws a std::length_error and the parser is done. with
+// CORO_NO_EXCEPTIONS the parser is just done, which you can tell from
+// is_done() returning true before finish() was called
+static const size_t DEFAULT_MAX_RECORD_SIZE = 16 * 1024 * 1024;
+
+// each record is a 4 byte little endian length followed by that many bytes.
+// a record that is cut off at the end of the stream is dropped
+void parse_length_prefixed(stream_parser<byte_chunk>::input & in);
+std::function<void (stream_parser<byte_chunk>::input &)> length_prefixed_parser(size_t max_record_size);
+// each record ends with a '\n', which is not part of the record. the last
+// record doesn't need one
+void parse_lines(stream_parser<byte_chunk>::input & in);
+std::function<void (stream_parser<byte_chunk>::input &)> line_parser(size_t max_record_size);
+}
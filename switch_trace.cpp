@@ -0,0 +1,338 @@
+#include "switch_trace.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#ifdef _MSC_VER
+#	include <intrin.h>
+#else
+#	include <x86intrin.h>
+#endif
+
+namespace coro
+{
+namespace
+{
+	static const size_t SWITCH_TRACE_BUFFER_SIZE = CORO_SWITCH_TRACE_BUFFER_SIZE;
+}
+namespace detail
+{
+	// written only by the thread that owns it
+	struct thread_trace_buffer
+	{
+		thread_trace_buffer(size_t thread_index)
+			: thread_index(thread_index)
+			, num_written(0)
+			, events(new switch_event[SWITCH_TRACE_BUFFER_SIZE])
+		{
+		}
+
+		size_t thread_index;
+		std::atomic<uint64_t> num_written;
+		std::unique_ptr<switch_event[]> events;
+	};
+}
+namespace
+{
+	// buffers are never removed so that the events of threads that have
+	// exited can still be read
+	struct trace_registry
+	{
+		std::mutex mutex;
+		std::vector<std::unique_ptr<detail::thread_trace_buffer> > buffers;
+	};
+	trace_registry & get_registry()
+	{
+		static trace_registry registry;
+		return registry;
+	}
+
+	detail::thread_trace_buffer * register_thread()
+	{
+		trace_registry & registry = get_registry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		registry.buffers.emplace_back(new detail::thread_trace_buffer(registry.buffers.size()));
+		return registry.buffers.back().get();
+	}
+	// the buffer is created when the thread records its first event
+	thread_local detail::thread_trace_buffer * current_buffer = nullptr;
+}
+
+detail::thread_trace_buffer & detail::get_thread_trace_buffer()
+{
+	if (!current_buffer) current_buffer = register_thread();
+	return *current_buffer;
+}
+
+uint64_t read_timestamp()
+{
+	return __rdtsc();
+}
+
+double timestamp_ticks_per_microsecond()
+{
+	static const double ticks_per_microsecond = []
+	{
+		std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+		uint64_t start_ticks = read_timestamp();
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		uint64_t end_ticks = read_timestamp();
+		double microseconds = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start_time).count();
+		return (end_ticks - start_ticks) / microseconds;
+	}();
+	return ticks_per_microsecond;
+}
+
+uint64_t trace_switch(switch_event_type type, const void * coroutine, const char * name)
+{
+	return trace_switch(detail::get_thread_trace_buffer(), type, coroutine, name);
+}
+uint64_t trace_switch(detail::thread_trace_buffer & buffer, switch_event_type type, const void * coroutine, const char * name)
+{
+	uint64_t index = buffer.num_written.load(std::memory_order_relaxed);
+	switch_event & event = buffer.events[index % SWITCH_TRACE_BUFFER_SIZE];
+	event.timestamp = read_timestamp();
+	event.coroutine = coroutine;
+	event.name = name;
+	event.type = type;
+	buffer.num_written.store(index + 1, std::memory_order_release);
+	return event.timestamp;
+}
+
+std::vector<traced_thread> get_switch_trace()
+{
+	trace_registry & registry = get_registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	std::vector<traced_thread> result(registry.buffers.size());
+	for (size_t i = 0; i < registry.buffers.size(); ++i)
+	{
+		const detail::thread_trace_buffer & buffer = *registry.buffers[i];
+		uint64_t num_written = buffer.num_written.load(std::memory_order_acquire);
+		uint64_t first = num_written > SWITCH_TRACE_BUFFER_SIZE ? num_written - SWITCH_TRACE_BUFFER_SIZE : 0;
+		result[i].thread_index = buffer.thread_index;
+		result[i].num_dropped = first;
+		result[i].events.reserve(num_written - first);
+		for (uint64_t j = first; j != num_written; ++j)
+		{
+			result[i].events.push_back(buffer.events[j % SWITCH_TRACE_BUFFER_SIZE]);
+		}
+	}
+	return result;
+}
+
+void clear_switch_trace()
+{
+	trace_registry & registry = get_registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	for (const std::unique_ptr<detail::thread_trace_buffer> & buffer : registry.buffers)
+	{
+		buffer->num_written.store(0, std::memory_order_relaxed);
+	}
+}
+
+namespace
+{
+	// the names come from the user, so they may contain quotes
+	void write_json_string(std::ostream & out, const char * text)
+	{
+		out << '"';
+		for (; *text; ++text)
+		{
+			char c = *text;
+			if (c == '"' || c == '\\') out << '\\' << c;
+			else if (static_cast<unsigned char>(c) < 0x20)
+			{
+				char escaped[8];
+				std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+				out << escaped;
+			}
+			else out << c;
+		}
+		out << '"';
+	}
+}
+
+void write_chrome_trace(std::ostream & out)
+{
+	std::vector<traced_thread> threads = get_switch_trace();
+	uint64_t first_timestamp = UINT64_MAX;
+	for (const traced_thread & thread : threads)
+	{
+		if (!thread.events.empty() && thread.events.front().timestamp < first_timestamp)
+		{
+			first_timestamp = thread.events.front().timestamp;
+		}
+	}
+	double ticks_per_microsecond = timestamp_ticks_per_microsecond();
+	// the default precision of six digits would round timestamps to whole
+	// microseconds after a second or so, so print them with nanoseconds
+	std::ios_base::fmtflags old_flags = out.flags();
+	std::streamsize old_precision = out.precision(3);
+	out << std::fixed;
+	out << "{\"traceEvents\":[";
+	bool first = true;
+	for (const traced_thread & thread : threads)
+	{
+		for (const switch_event & event : thread.events)
+		{
+			if (!first) out << ",\n";
+			first = false;
+			// a resume begins a slice on the thread, yielding or finishing ends it
+			out << "{\"name\":";
+			write_json_string(out, event.name ? event.name : "coroutine");
+			out << ",\"ph\":\"" << (event.type == SWITCH_RESUME ? 'B' : 'E') << "\""
+				<< ",\"ts\":" << (event.timestamp - first_timestamp) / ticks_per_microsecond
+				<< ",\"pid\":1,\"tid\":" << thread.thread_index
+				<< ",\"args\":{\"coroutine\":\"" << event.coroutine << "\""
+				<< (event.type == SWITCH_FINISH ? ",\"finished\":true" : "") << "}}";
+		}
+	}
+	out << "]}\n";
+	out.flags(old_flags);
+	out.precision(old_precision);
+}
+}
+
+
+#ifndef DISABLE_GTEST
+#include <gtest/gtest.h>
+#include "coroutine.h"
+#include <sstream>
+
+namespace
+{
+	const coro::traced_thread * find_this_thread(const std::vector<coro::traced_thread> & threads, const void * coroutine)
+	{
+		for (const coro::traced_thread & thread : threads)
+		{
+			for (const coro::switch_event & event : thread.events)
+			{
+				if (event.coroutine == coroutine) return &thread;
+			}
+		}
+		return nullptr;
+	}
+}
+
+TEST(switch_trace, ring_buffer)
+{
+	using namespace coro;
+	clear_switch_trace();
+	int marker = 0;
+	for (size_t i = 0; i < SWITCH_TRACE_BUFFER_SIZE + 10; ++i)
+	{
+		trace_switch(i % 2 ? SWITCH_YIELD : SWITCH_RESUME, &marker, "test");
+	}
+	std::vector<traced_thread> threads = get_switch_trace();
+	const traced_thread * thread = find_this_thread(threads, &marker);
+	ASSERT_TRUE(thread != nullptr);
+	EXPECT_EQ(10u, thread->num_dropped);
+	ASSERT_EQ(SWITCH_TRACE_BUFFER_SIZE, thread->events.size());
+	EXPECT_EQ(SWITCH_RESUME, thread->events.front().type);
+	for (size_t i = 1; i < thread->events.size(); ++i)
+	{
+		EXPECT_LE(thread->events[i - 1].timestamp, thread->events[i].timestamp);
+	}
+	clear_switch_trace();
+}
+
+TEST(switch_trace, chrome_trace)
+{
+	using namespace coro;
+	clear_switch_trace();
+	int marker = 0;
+	trace_switch(SWITCH_RESUME, &marker, "test");
+	trace_switch(SWITCH_FINISH, &marker, "test");
+	std::stringstream json;
+	write_chrome_trace(json);
+	EXPECT_EQ(0u, json.str().find("{\"traceEvents\":[{\"name\":\"test\",\"ph\":\"B\",\"ts\":0.000,"));
+	EXPECT_NE(std::string::npos, json.str().find("\"ph\":\"E\""));
+	EXPECT_NE(std::string::npos, json.str().find("\"finished\":true"));
+	clear_switch_trace();
+}
+
+TEST(switch_trace, chrome_trace_escapes_names)
+{
+	using namespace coro;
+	clear_switch_trace();
+	int marker = 0;
+	trace_switch(SWITCH_RESUME, &marker, "say \"hi\"\\\n");
+	std::stringstream json;
+	write_chrome_trace(json);
+	EXPECT_NE(std::string::npos, json.str().find("\"name\":\"say \\\"hi\\\"\\\\\\u000a\""));
+	clear_switch_trace();
+}
+
+#ifdef CORO_TRACE_SWITCHES
+TEST(switch_trace, coroutine)
+{
+	using namespace coro;
+	clear_switch_trace();
+	coroutine<void ()> traced([](coroutine<void ()>::self & self)
+	{
+		self.yield();
+		self.yield();
+	});
+	while (traced)
+	{
+		traced();
+	}
+	EXPECT_EQ(3u, traced.num_switches());
+	EXPECT_LT(0u, traced.run_time());
+	std::vector<traced_thread> threads = get_switch_trace();
+	const traced_thread * thread = find_this_thread(threads, &traced);
+	ASSERT_TRUE(thread != nullptr);
+	ASSERT_EQ(6u, thread->events.size());
+	switch_event_type expected[] = { SWITCH_RESUME, SWITCH_YIELD, SWITCH_RESUME, SWITCH_YIELD, SWITCH_RESUME, SWITCH_FINISH };
+	for (size_t i = 0; i < 6; ++i)
+	{
+		EXPECT_EQ(expected[i], thread->events[i].type);
+	}
+	clear_switch_trace();
+}
+#endif
+
+#ifdef CORO_RUN_BENCHMARKS
+#include "benchmark.h"
+
+TEST(benchmark, switch_trace)
+{
+	using namespace coro;
+	// compare with and without CORO_TRACE_SWITCHES. recording the events
+	// is also measured on its own, so that a build without tracing shows
+	// what tracing would add to every resume and yield
+	coroutine<void ()> yielding([](coroutine<void ()>::self & self)
+	{
+		for (;;)
+		{
+			self.yield();
+		}
+	});
+#	ifdef CORO_TRACE_SWITCHES
+		const char * name = "resume and yield, traced";
+#	else
+		const char * name = "resume and yield, not traced";
+#	endif
+	run_benchmark(name, 1000000, [&yielding]
+	{
+		yielding();
+	});
+	int dummy = 0;
+	run_benchmark("recording the events of one resume and yield", 1000000, [&dummy]
+	{
+		detail::thread_trace_buffer & buffer = detail::get_thread_trace_buffer();
+		trace_switch(buffer, SWITCH_RESUME, &dummy, "benchmark");
+		trace_switch(buffer, SWITCH_YIELD, &dummy, "benchmark");
+	});
+	run_benchmark("read_timestamp", 1000000, []
+	{
+		read_timestamp();
+	});
+	clear_switch_trace();
+}
+#endif
+#endif
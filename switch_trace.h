@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <vector>
+
+#ifndef CORO_SWITCH_TRACE_BUFFER_SIZE
+#define CORO_SWITCH_TRACE_BUFFER_SIZE 64 * 1024
+#endif
+
+namespace coro
+{
+/**
+ * if CORO_TRACE_SWITCHES is defined, every coroutine records an event when
+ * it is resumed and when it yields or returns. the events go into a ring
+ * buffer per thread, so recording them doesn't need any locks. only the
+ * most recent CORO_SWITCH_TRACE_BUFFER_SIZE events per thread are kept.
+ * every resume reads the time stamp counter twice, which is most of what
+ * tracing costs. that is tens of nanoseconds per resume, more in a virtual
+ * machine. the switch_trace benchmark measures it
+ */
+enum switch_event_type
+{
+	SWITCH_RESUME,
+	SWITCH_YIELD,
+	SWITCH_FINISH
+};
+
+struct switch_event
+{
+	// from read_timestamp()
+	uint64_t timestamp;
+	const void * coroutine;
+	// the type name of the function that the coroutine runs
+	const char * name;
+	switch_event_type type;
+};
+
+struct traced_thread
+{
+	// in the order in which the threads recorded their first event
+	size_t thread_index;
+	// oldest event first
+	std::vector<switch_event> events;
+	// the number of events that were overwritten in the ring buffer
+	uint64_t num_dropped;
+};
+
+// reads the time stamp counter of the cpu
+uint64_t read_timestamp();
+double timestamp_ticks_per_microsecond();
+
+namespace detail
+{
+	struct thread_trace_buffer;
+	thread_trace_buffer & get_thread_trace_buffer();
+}
+// returns the timestamp of the event
+uint64_t trace_switch(switch_event_type type, const void * coroutine, const char * name);
+// the same, for when the buffer of the calling thread was already looked
+// up. a coroutine records two events for every resume, and this way it
+// only looks up the buffer once
+uint64_t trace_switch(detail::thread_trace_buffer & buffer, switch_event_type type, const void * coroutine, const char * name);
+
+// don't call these while other threads are recording events, because those
+// might overwrite the events while they are being read
+std::vector<traced_thread> get_switch_trace();
+void clear_switch_trace();
+// writes the events in the chrome://tracing JSON format, which can also be
+// opened in Perfetto
+void write_chrome_trace(std::ostream & out);
+}
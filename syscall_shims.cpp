@@ -0,0 +1,612 @@
+#include "syscall_shims.h"
+#ifdef __linux__
+#include "io_loop.h"
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace coro
+{
+namespace
+{
+	// these go straight to the kernel. calling read() here would end up in
+	// the shims again if they replace read()
+	ssize_t system_read(int fd, void * buffer, size_t count)
+	{
+		return syscall(SYS_read, fd, buffer, count);
+	}
+	ssize_t system_write(int fd, const void * buffer, size_t count)
+	{
+		return syscall(SYS_write, fd, buffer, count);
+	}
+	int system_connect(int fd, const sockaddr * address, socklen_t address_length)
+	{
+		return static_cast<int>(syscall(SYS_connect, fd, address, address_length));
+	}
+	int system_poll(pollfd * fds, nfds_t count, int timeout_milliseconds)
+	{
+#	ifdef SYS_poll
+		return static_cast<int>(syscall(SYS_poll, fds, count, timeout_milliseconds));
+#	else
+		timespec timeout = { timeout_milliseconds / 1000, (timeout_milliseconds % 1000) * 1000000 };
+		return static_cast<int>(syscall(SYS_ppoll, fds, count, timeout_milliseconds < 0 ? nullptr : &timeout, nullptr, 0));
+#	endif
+	}
+	int system_nanosleep(const timespec * duration, timespec * remaining)
+	{
+		return static_cast<int>(syscall(SYS_nanosleep, duration, remaining));
+	}
+	int system_close(int fd)
+	{
+		return static_cast<int>(syscall(SYS_close, fd));
+	}
+
+	io_loop * loop_of_running_task()
+	{
+		io_loop * loop = io_loop::current();
+		return loop && loop->is_inside_task() ? loop : nullptr;
+	}
+
+	ssize_t system_receive(int fd, void * buffer, size_t count)
+	{
+		return syscall(SYS_recvfrom, fd, buffer, count, MSG_DONTWAIT, nullptr, nullptr);
+	}
+	ssize_t system_send(int fd, const void * buffer, size_t count)
+	{
+		// MSG_NOSIGNAL is left out, a write to a closed socket raises
+		// SIGPIPE like a plain write would
+		return syscall(SYS_sendto, fd, buffer, count, MSG_DONTWAIT, nullptr, 0);
+	}
+
+	enum fd_kind : unsigned char
+	{
+		FD_UNKNOWN,
+		FD_SOCKET,
+		// regular files and directories. they are always ready, and epoll
+		// rejects them anyway
+		FD_FILE,
+		// pipes, terminals and other devices
+		FD_OTHER
+	};
+	// what the shims found out about each file descriptor, so that that
+	// doesn't cost a system call every time. file descriptors are shared by
+	// all threads, so this is too. cooperative_close forgets the entry. if
+	// the number of a file that was closed some other way is reused for a
+	// socket, the socket call fails with ENOTSOCK and the entry is updated
+	static const int NUM_REMEMBERED_FDS = 64 * 1024;
+	std::atomic<unsigned char> remembered_fd_kinds[NUM_REMEMBERED_FDS];
+
+	fd_kind find_fd_kind(int fd)
+	{
+		struct stat status;
+		if (fstat(fd, &status) != 0) return FD_UNKNOWN;
+		if (S_ISSOCK(status.st_mode)) return FD_SOCKET;
+		if (S_ISREG(status.st_mode) || S_ISDIR(status.st_mode)) return FD_FILE;
+		return FD_OTHER;
+	}
+	fd_kind get_fd_kind(int fd)
+	{
+		if (fd < 0 || fd >= NUM_REMEMBERED_FDS) return find_fd_kind(fd);
+		fd_kind kind = static_cast<fd_kind>(remembered_fd_kinds[fd].load(std::memory_order_relaxed));
+		if (kind != FD_UNKNOWN) return kind;
+		kind = find_fd_kind(fd);
+		remembered_fd_kinds[fd].store(kind, std::memory_order_relaxed);
+		return kind;
+	}
+	void forget_fd_kind(int fd)
+	{
+		if (fd >= 0 && fd < NUM_REMEMBERED_FDS) remembered_fd_kinds[fd].store(FD_UNKNOWN, std::memory_order_relaxed);
+	}
+
+	bool is_non_blocking(int fd)
+	{
+		int flags = fcntl(fd, F_GETFL);
+		return flags >= 0 && (flags & O_NONBLOCK);
+	}
+	bool would_block()
+	{
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+	}
+
+	// makes the file descriptor non-blocking for as long as this lives,
+	// unless it already was non-blocking. this changes the open file
+	// description, which other processes with a copy of the file
+	// descriptor share, so this is only used for connect(), which has no
+	// other way of not blocking
+	struct temporarily_non_blocking
+	{
+		explicit temporarily_non_blocking(int fd)
+			: fd(fd)
+			, flags(fcntl(fd, F_GETFL))
+		{
+			if (was_blocking()) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+		}
+		~temporarily_non_blocking()
+		{
+			int saved_errno = errno;
+			if (was_blocking()) fcntl(fd, F_SETFL, flags);
+			errno = saved_errno;
+		}
+		bool was_blocking() const
+		{
+			return flags >= 0 && !(flags & O_NONBLOCK);
+		}
+
+		int fd;
+		int flags;
+	};
+
+	// sockets are read and written with MSG_DONTWAIT, which doesn't touch
+	// the flags of the file descriptor, and which makes the common case of
+	// data that is already there a single system call. regular files never
+	// wait. for other files the loop waits until the file is ready, and
+	// then the blocking call is made
+	template<typename SocketCall, typename Call>
+	ssize_t call_when_ready(int fd, short events, SocketCall && socket_call, Call && call)
+	{
+		io_loop * loop = loop_of_running_task();
+		if (!loop) return call();
+		fd_kind kind = get_fd_kind(fd);
+		if (kind == FD_FILE || kind == FD_UNKNOWN) return call();
+		if (kind == FD_SOCKET)
+		{
+			for (;;)
+			{
+				ssize_t result = socket_call();
+				if (result >= 0) return result;
+				if (errno == ENOTSOCK)
+				{
+					// the file descriptor was closed and reused
+					forget_fd_kind(fd);
+					return call_when_ready(fd, events, socket_call, call);
+				}
+				if (!would_block()) return result;
+				// the caller expects EAGAIN if it made the socket non-blocking
+				if (is_non_blocking(fd)) return result;
+				loop->wait_for_fd(fd, events);
+			}
+		}
+		pollfd is_ready = { fd, events, 0 };
+		if (system_poll(&is_ready, 1, 0) == 0 && !is_non_blocking(fd)) loop->wait_for_fd(fd, events);
+		return call();
+	}
+}
+
+ssize_t cooperative_read(int fd, void * buffer, size_t count)
+{
+	return call_when_ready(fd, POLLIN, [=]
+	{
+		return system_receive(fd, buffer, count);
+	}, [=]
+	{
+		return system_read(fd, buffer, count);
+	});
+}
+ssize_t cooperative_write(int fd, const void * buffer, size_t count)
+{
+	// a blocking write only returns once everything is written, so keep
+	// going after partial writes
+	size_t written = 0;
+	do
+	{
+		const unsigned char * rest = static_cast<const unsigned char *>(buffer) + written;
+		size_t rest_size = count - written;
+		ssize_t result = call_when_ready(fd, POLLOUT, [=]
+		{
+			return system_send(fd, rest, rest_size);
+		}, [=]
+		{
+			return system_write(fd, rest, rest_size);
+		});
+		if (result < 0) return written ? static_cast<ssize_t>(written) : result;
+		written += result;
+	}
+	while (written < count && loop_of_running_task());
+	return written;
+}
+int cooperative_connect(int fd, const sockaddr * address, socklen_t address_length)
+{
+	io_loop * loop = loop_of_running_task();
+	if (!loop) return system_connect(fd, address, address_length);
+	temporarily_non_blocking non_blocking(fd);
+	int result = system_connect(fd, address, address_length);
+	if (!non_blocking.was_blocking() || result == 0 || errno != EINPROGRESS) return result;
+	loop->wait_for_fd(fd, POLLOUT);
+	int error = 0;
+	socklen_t error_length = sizeof(error);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length) != 0) return -1;
+	if (!error) return 0;
+	errno = error;
+	return -1;
+}
+int cooperative_poll(pollfd * fds, nfds_t count, int timeout_milliseconds)
+{
+	io_loop * loop = loop_of_running_task();
+	if (!loop || timeout_milliseconds == 0) return system_poll(fds, count, timeout_milliseconds);
+	int num_ready = system_poll(fds, count, 0);
+	if (num_ready != 0) return num_ready;
+	io_loop::clock::time_point deadline = io_loop::no_deadline();
+	if (timeout_milliseconds > 0) deadline = io_loop::clock::now() + std::chrono::milliseconds(timeout_milliseconds);
+	loop->wait_for_fds(fds, count, deadline);
+	// the kernel fills in revents exactly like a blocking poll would
+	return system_poll(fds, count, 0);
+}
+int cooperative_close(int fd)
+{
+	forget_fd_kind(fd);
+	return system_close(fd);
+}
+int cooperative_nanosleep(const timespec * duration, timespec * remaining)
+{
+	io_loop * loop = loop_of_running_task();
+	if (!loop || duration->tv_nsec < 0 || duration->tv_nsec >= 1000000000 || duration->tv_sec < 0)
+	{
+		return system_nanosleep(duration, remaining);
+	}
+	io_loop::clock::time_point now = io_loop::clock::now();
+	// a huge tv_sec is the idiom for sleeping forever. it doesn't fit into
+	// the clock, so that sleeps until the end of the clock instead
+	io_loop::clock::time_point deadline = io_loop::no_deadline();
+	if (duration->tv_sec < std::chrono::duration_cast<std::chrono::seconds>(deadline - now).count())
+	{
+		deadline = now + std::chrono::seconds(duration->tv_sec) + std::chrono::nanoseconds(duration->tv_nsec);
+	}
+	loop->sleep_until(deadline);
+	if (remaining) *remaining = timespec();
+	return 0;
+}
+}
+
+// for linking with -Wl,--wrap=read and so on
+extern "C" ssize_t __wrap_read(int fd, void * buffer, size_t count)
+{
+	return coro::cooperative_read(fd, buffer, count);
+}
+extern "C" ssize_t __wrap_write(int fd, const void * buffer, size_t count)
+{
+	return coro::cooperative_write(fd, buffer, count);
+}
+extern "C" int __wrap_connect(int fd, const sockaddr * address, socklen_t address_length)
+{
+	return coro::cooperative_connect(fd, address, address_length);
+}
+extern "C" int __wrap_poll(pollfd * fds, nfds_t count, int timeout_milliseconds)
+{
+	return coro::cooperative_poll(fds, count, timeout_milliseconds);
+}
+extern "C" int __wrap_nanosleep(const timespec * duration, timespec * remaining)
+{
+	return coro::cooperative_nanosleep(duration, remaining);
+}
+extern "C" int __wrap_close(int fd)
+{
+	return coro::cooperative_close(fd);
+}
+
+#ifdef CORO_INTERPOSE_SYSCALLS
+extern "C" ssize_t read(int fd, void * buffer, size_t count)
+{
+	return coro::cooperative_read(fd, buffer, count);
+}
+extern "C" ssize_t write(int fd, const void * buffer, size_t count)
+{
+	return coro::cooperative_write(fd, buffer, count);
+}
+extern "C" int connect(int fd, const sockaddr * address, socklen_t address_length)
+{
+	return coro::cooperative_connect(fd, address, address_length);
+}
+extern "C" int poll(pollfd * fds, nfds_t count, int timeout_milliseconds)
+{
+	return coro::cooperative_poll(fds, count, timeout_milliseconds);
+}
+extern "C" int nanosleep(const timespec * duration, timespec * remaining)
+{
+	return coro::cooperative_nanosleep(duration, remaining);
+}
+extern "C" int close(int fd)
+{
+	return coro::cooperative_close(fd);
+}
+#endif
+#endif
+
+
+#ifndef DISABLE_GTEST
+#ifdef __linux__
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <limits>
+#include <string>
+#include <vector>
+
+TEST(syscall_shims, read_waits_in_loop)
+{
+	using namespace coro;
+	int pipe_fds[2];
+	ASSERT_EQ(0, pipe(pipe_fds));
+	io_loop loop;
+	std::vector<std::string> events;
+	loop.spawn([&](io_loop::task::self &)
+	{
+		char buffer[16];
+		ssize_t num_read = cooperative_read(pipe_fds[0], buffer, sizeof(buffer));
+		ASSERT_EQ(5, num_read);
+		events.push_back("read " + std::string(buffer, num_read));
+	});
+	loop.spawn([&](io_loop::task::self &)
+	{
+		events.push_back("write");
+		EXPECT_EQ(5, cooperative_write(pipe_fds[1], "hello", 5));
+	});
+	loop.run();
+	ASSERT_EQ(2u, events.size());
+	EXPECT_EQ("write", events[0]);
+	EXPECT_EQ("read hello", events[1]);
+	// the pipe is blocking again
+	EXPECT_EQ(0, fcntl(pipe_fds[0], F_GETFL) & O_NONBLOCK);
+	// outside of a loop the shims just make the call
+	EXPECT_EQ(2, cooperative_write(pipe_fds[1], "hi", 2));
+	char buffer[2];
+	EXPECT_EQ(2, cooperative_read(pipe_fds[0], buffer, sizeof(buffer)));
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+}
+
+TEST(syscall_shims, socket_read_waits_in_loop)
+{
+	using namespace coro;
+	int sockets[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+	int non_blocking[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, non_blocking));
+	io_loop loop;
+	std::vector<std::string> events;
+	loop.spawn([&](io_loop::task::self &)
+	{
+		char buffer[16];
+		ssize_t num_read = cooperative_read(sockets[0], buffer, sizeof(buffer));
+		ASSERT_EQ(5, num_read);
+		events.push_back("read " + std::string(buffer, num_read));
+		// a socket that was made non-blocking by the caller doesn't wait
+		EXPECT_EQ(-1, cooperative_read(non_blocking[0], buffer, sizeof(buffer)));
+		EXPECT_TRUE(errno == EAGAIN || errno == EWOULDBLOCK);
+	});
+	loop.spawn([&](io_loop::task::self &)
+	{
+		events.push_back("write");
+		EXPECT_EQ(5, cooperative_write(sockets[1], "hello", 5));
+	});
+	loop.run();
+	EXPECT_EQ((std::vector<std::string>{ "write", "read hello" }), events);
+	// the flags of the socket were never changed
+	EXPECT_EQ(0, fcntl(sockets[0], F_GETFL) & O_NONBLOCK);
+	for (int fd : { sockets[0], sockets[1], non_blocking[0], non_blocking[1] })
+	{
+		close(fd);
+	}
+}
+
+TEST(syscall_shims, file_and_reused_fd)
+{
+	using namespace coro;
+	char file_name[] = "/tmp/syscall_shims_XXXXXX";
+	int file = mkstemp(file_name);
+	ASSERT_LE(0, file);
+	unlink(file_name);
+	int sockets[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+	int pipe_fds[2];
+	ASSERT_EQ(0, pipe(pipe_fds));
+	io_loop loop;
+	std::vector<std::string> events;
+	loop.spawn([&](io_loop::task::self &)
+	{
+		// a regular file is always ready
+		ASSERT_EQ(4, cooperative_write(file, "file", 4));
+		ASSERT_EQ(0, lseek(file, 0, SEEK_SET));
+		char buffer[16];
+		ASSERT_EQ(4, cooperative_read(file, buffer, sizeof(buffer)));
+		events.push_back("read file");
+		ASSERT_EQ(2, cooperative_write(sockets[1], "hi", 2));
+		ASSERT_EQ(2, cooperative_read(sockets[0], buffer, sizeof(buffer)));
+		// the number of the socket is reused for the pipe without telling
+		// the shims. the read still has to wait in the loop
+		ASSERT_EQ(sockets[0], dup2(pipe_fds[0], sockets[0]));
+		ssize_t num_read = cooperative_read(sockets[0], buffer, sizeof(buffer));
+		ASSERT_EQ(4, num_read);
+		events.push_back("read " + std::string(buffer, num_read));
+	});
+	loop.spawn([&](io_loop::task::self &)
+	{
+		events.push_back("write");
+		EXPECT_EQ(4, cooperative_write(pipe_fds[1], "pipe", 4));
+	});
+	loop.run();
+	EXPECT_EQ((std::vector<std::string>{ "read file", "write", "read pipe" }), events);
+	for (int fd : { file, sockets[0], sockets[1], pipe_fds[0], pipe_fds[1] })
+	{
+		cooperative_close(fd);
+	}
+}
+
+#if defined(CORO_INTERPOSE_SYSCALLS) || defined(CORO_WRAPPED_SYSCALLS)
+TEST(syscall_shims, plain_calls)
+{
+	using namespace coro;
+	int pipe_fds[2];
+	ASSERT_EQ(0, pipe(pipe_fds));
+	int sockets[2];
+	ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+	io_loop loop;
+	std::vector<std::string> events;
+	loop.spawn([&](io_loop::task::self &)
+	{
+		char buffer[16];
+		ssize_t num_read = read(pipe_fds[0], buffer, sizeof(buffer));
+		ASSERT_EQ(4, num_read);
+		events.push_back("read " + std::string(buffer, num_read));
+		num_read = read(sockets[0], buffer, sizeof(buffer));
+		ASSERT_EQ(6, num_read);
+		events.push_back("read " + std::string(buffer, num_read));
+	});
+	loop.spawn([&](io_loop::task::self &)
+	{
+		events.push_back("write pipe");
+		EXPECT_EQ(4, write(pipe_fds[1], "pipe", 4));
+		timespec duration = { 0, 1000 * 1000 };
+		EXPECT_EQ(0, nanosleep(&duration, nullptr));
+		events.push_back("write socket");
+		EXPECT_EQ(6, write(sockets[1], "socket", 6));
+	});
+	loop.run();
+	EXPECT_EQ((std::vector<std::string>{ "write pipe", "read pipe", "write socket", "read socket" }), events);
+	for (int fd : { pipe_fds[0], pipe_fds[1], sockets[0], sockets[1] })
+	{
+		close(fd);
+	}
+}
+#endif
+
+TEST(syscall_shims, nanosleep)
+{
+	using namespace coro;
+	io_loop loop;
+	std::vector<int> order;
+	loop.spawn([&](io_loop::task::self &)
+	{
+		timespec duration = { 0, 20 * 1000 * 1000 };
+		EXPECT_EQ(0, cooperative_nanosleep(&duration, nullptr));
+		order.push_back(20);
+	});
+	loop.spawn([&](io_loop::task::self &)
+	{
+		timespec duration = { 0, 1000 * 1000 };
+		timespec remaining = { 1, 1 };
+		EXPECT_EQ(0, cooperative_nanosleep(&duration, &remaining));
+		EXPECT_EQ(0, remaining.tv_sec);
+		EXPECT_EQ(0, remaining.tv_nsec);
+		order.push_back(1);
+	});
+	loop.run();
+	EXPECT_EQ((std::vector<int>{ 1, 20 }), order);
+}
+
+TEST(syscall_shims, sleep_forever)
+{
+	using namespace coro;
+	int pipe_fds[2];
+	ASSERT_EQ(0, pipe(pipe_fds));
+	io_loop loop;
+	bool woke_up = false;
+	bool read = false;
+	// as nanoseconds, the first of these wraps around to a negative number
+	time_t forever[] = { static_cast<time_t>(10000000000ll), std::numeric_limits<time_t>::max() };
+	for (time_t seconds : forever)
+	{
+		loop.spawn([&woke_up, seconds](io_loop::task::self &)
+		{
+			timespec duration = { seconds, 0 };
+			cooperative_nanosleep(&duration, nullptr);
+			woke_up = true;
+		});
+	}
+	loop.spawn([&](io_loop::task::self &)
+	{
+		// further out than the milliseconds of epoll_wait's int timeout
+		loop.sleep_until(io_loop::clock::now() + std::chrono::hours(24 * 365));
+		woke_up = true;
+	});
+	loop.spawn([&](io_loop::task::self &)
+	{
+		char buffer[16];
+		EXPECT_EQ(1, cooperative_read(pipe_fds[0], buffer, sizeof(buffer)));
+		read = true;
+	});
+	// all four wait now
+	for (int i = 0; i < 4; ++i)
+	{
+		ASSERT_TRUE(loop.run_one());
+	}
+	ASSERT_EQ(1, write(pipe_fds[1], "a", 1));
+	while (!read)
+	{
+		ASSERT_TRUE(loop.run_one());
+	}
+	// a timer that expired by mistake would wake its task before this
+	bool slept = false;
+	loop.spawn([&](io_loop::task::self &)
+	{
+		loop.sleep_until(io_loop::clock::now() + std::chrono::milliseconds(10));
+		slept = true;
+	});
+	while (!slept)
+	{
+		ASSERT_TRUE(loop.run_one());
+	}
+	EXPECT_FALSE(woke_up);
+	EXPECT_EQ(3u, loop.size());
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+}
+
+TEST(syscall_shims, connect_and_poll)
+{
+	using namespace coro;
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	ASSERT_LE(0, listener);
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	ASSERT_EQ(0, bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)));
+	socklen_t address_length = sizeof(address);
+	ASSERT_EQ(0, getsockname(listener, reinterpret_cast<sockaddr *>(&address), &address_length));
+	ASSERT_EQ(0, listen(listener, 16));
+	static const int NUM_CLIENTS = 10;
+	io_loop loop;
+	int num_served = 0;
+	loop.spawn([&](io_loop::task::self &)
+	{
+		for (int i = 0; i < NUM_CLIENTS; ++i)
+		{
+			pollfd to_accept = { listener, POLLIN, 0 };
+			ASSERT_EQ(1, cooperative_poll(&to_accept, 1, -1));
+			int connection = accept(listener, nullptr, nullptr);
+			ASSERT_LE(0, connection);
+			loop.spawn([&num_served, connection](io_loop::task::self &)
+			{
+				char received = 0;
+				ASSERT_EQ(1, cooperative_read(connection, &received, 1));
+				++received;
+				ASSERT_EQ(1, cooperative_write(connection, &received, 1));
+				++num_served;
+				close(connection);
+			});
+		}
+	});
+	for (int i = 0; i < NUM_CLIENTS; ++i)
+	{
+		loop.spawn([&address, i](io_loop::task::self &)
+		{
+			int client = socket(AF_INET, SOCK_STREAM, 0);
+			ASSERT_EQ(0, cooperative_connect(client, reinterpret_cast<sockaddr *>(&address), sizeof(address)));
+			char sent = static_cast<char>(i);
+			ASSERT_EQ(1, cooperative_write(client, &sent, 1));
+			// a timeout that is never hit
+			pollfd to_read = { client, POLLIN, 0 };
+			ASSERT_EQ(1, cooperative_poll(&to_read, 1, 10 * 1000));
+			char answer = 0;
+			ASSERT_EQ(1, cooperative_read(client, &answer, 1));
+			EXPECT_EQ(sent + 1, answer);
+			close(client);
+		});
+	}
+	loop.run();
+	EXPECT_EQ(NUM_CLIENTS, num_served);
+	close(listener);
+}
+#endif
+#endif
@@ -0,0 +1,53 @@
+#pragma once
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+
+namespace coro
+{
+/**
+ * versions of blocking system calls that suspend the running task of an
+ * io_loop instead of blocking the whole thread. outside of an io_loop task,
+ * and for file descriptors that were already non-blocking, they just make
+ * the system call.
+ *
+ * sockets are read and written with MSG_DONTWAIT, so if the data is there
+ * that is a single system call. regular files are read and written
+ * directly. for other files, like pipes, the loop waits until the file is
+ * ready and then makes the blocking call. so a
+ * write to a pipe that is larger than the free space in the pipe can still
+ * block. connect() has no flag like MSG_DONTWAIT, so it switches the socket
+ * to O_NONBLOCK until it is connected. that flag is shared with every copy
+ * of the file descriptor, even in other processes.
+ *
+ * which kind of file a file descriptor is gets looked up once and then
+ * remembered until cooperative_close. if a regular file is closed some
+ * other way, and its number is reused for a pipe or a socket, reading that
+ * in a task can block the thread.
+ *
+ * when you link with --wrap as below, define CORO_WRAPPED_SYSCALLS for
+ * syscall_shims.cpp, so that its tests also call the plain functions.
+ *
+ * to make code that calls the plain functions use these without changing
+ * it, link it with
+ *     -Wl,--wrap=read,--wrap=write,--wrap=connect,--wrap=poll,--wrap=nanosleep,--wrap=close
+ * which sends its calls to the __wrap_ functions defined in
+ * syscall_shims.cpp. or define CORO_INTERPOSE_SYSCALLS, which defines read,
+ * write, connect, poll, nanosleep and close themselves, so that they replace the
+ * functions of libc for the executable and the shared libraries that it
+ * loads. built into a shared library that way, the shims can also be
+ * loaded with LD_PRELOAD, as long as the io_loop comes from that same
+ * library. calls that libc makes internally, like nanosleep in sleep(),
+ * are not affected by either
+ */
+ssize_t cooperative_read(int fd, void * buffer, size_t count);
+ssize_t cooperative_write(int fd, const void * buffer, size_t count);
+int cooperative_connect(int fd, const sockaddr * address, socklen_t address_length);
+int cooperative_poll(pollfd * fds, nfds_t count, int timeout_milliseconds);
+int cooperative_nanosleep(const timespec * duration, timespec * remaining);
+int cooperative_close(int fd);
+}
+#endif
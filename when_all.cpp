@@ -0,0 +1,259 @@
+#include "when_all.h"
+
+namespace coro
+{
+void when_all(basic_coroutine & self, coroutine<void ()> * const * children, size_t count)
+{
+#	ifndef CORO_NO_EXCEPTIONS
+		try
+		{
+#	endif
+		for (;;)
+		{
+			// counted every round, so that children that had already
+			// finished before don't count
+			size_t unfinished = 0;
+			for (size_t i = 0; i < count; ++i)
+			{
+				if (!*children[i]) continue;
+				(*children[i])();
+				if (*children[i]) ++unfinished;
+			}
+			if (!unfinished) break;
+			self.yield();
+		}
+#	ifndef CORO_NO_EXCEPTIONS
+		}
+		catch(...)
+		{
+			detail::cancel_all(children, count);
+			throw;
+		}
+#	endif
+}
+
+size_t when_any(basic_coroutine & self, coroutine<void ()> * const * children, size_t count)
+{
+	size_t index = count;
+#	ifndef CORO_NO_EXCEPTIONS
+		try
+		{
+#	endif
+		for (;;)
+		{
+			bool any_unfinished = false;
+			for (size_t i = 0; i < count && index == count; ++i)
+			{
+				if (!*children[i]) continue;
+				any_unfinished = true;
+				(*children[i])();
+				if (!*children[i]) index = i;
+			}
+			if (index != count || !any_unfinished) break;
+			self.yield();
+		}
+#	ifndef CORO_NO_EXCEPTIONS
+		}
+		catch(...)
+		{
+			detail::cancel_all(children, count);
+			throw;
+		}
+#	endif
+	detail::cancel_all(children, count);
+	return index;
+}
+}
+
+
+#ifndef DISABLE_GTEST
+#include <gtest/gtest.h>
+#include <string>
+
+namespace
+{
+	// a child that needs the given number of rounds before it is done
+	std::function<int (coro::coroutine<int ()>::self &)> takes_rounds(int rounds, int result)
+	{
+		return [rounds, result](coro::coroutine<int ()>::self & self)
+		{
+			for (int i = 0; i < rounds; ++i)
+			{
+				self.yield(-1);
+			}
+			return result;
+		};
+	}
+}
+
+TEST(when_all, tuple)
+{
+	using namespace coro;
+	coroutine<int ()> first(takes_rounds(2, 1));
+	coroutine<std::string ()> second([](coroutine<std::string ()>::self &)
+	{
+		return std::string("two");
+	});
+	std::tuple<int, std::string> results;
+	int parent_rounds = 0;
+	coroutine<void ()> parent([&](coroutine<void ()>::self & self)
+	{
+		results = when_all(self, first, second);
+	});
+	while (parent)
+	{
+		parent();
+		++parent_rounds;
+	}
+	EXPECT_EQ(3, parent_rounds);
+	EXPECT_EQ(1, std::get<0>(results));
+	EXPECT_EQ("two", std::get<1>(results));
+}
+
+TEST(when_all, range)
+{
+	using namespace coro;
+	coroutine<int ()> a(takes_rounds(3, 10));
+	coroutine<int ()> b(takes_rounds(0, 20));
+	coroutine<int ()> c(takes_rounds(1, 30));
+	coroutine<int ()> * children[] = { &a, &b, &c };
+	std::vector<int> results;
+	coroutine<void ()> parent([&](coroutine<void ()>::self & self)
+	{
+		results = when_all(self, children, 3);
+	});
+	while (parent) parent();
+	ASSERT_EQ(3u, results.size());
+	EXPECT_EQ(10, results[0]);
+	EXPECT_EQ(20, results[1]);
+	EXPECT_EQ(30, results[2]);
+}
+
+TEST(when_all, already_finished)
+{
+	using namespace coro;
+	coroutine<int ()> a(takes_rounds(0, 10));
+	coroutine<int ()> b(takes_rounds(2, 20));
+	EXPECT_EQ(10, a());
+	coroutine<int ()> * children[] = { &a, &b };
+	std::vector<int> results;
+	coroutine<void ()> parent([&](coroutine<void ()>::self & self)
+	{
+		results = when_all(self, children, 2);
+	});
+	int parent_rounds = 0;
+	while (parent && parent_rounds < 10)
+	{
+		parent();
+		++parent_rounds;
+	}
+	EXPECT_EQ(3, parent_rounds);
+	ASSERT_EQ(2u, results.size());
+	// a already returned its 10 above
+	EXPECT_EQ(0, results[0]);
+	EXPECT_EQ(20, results[1]);
+
+	int void_rounds = 0;
+	coroutine<void ()> done([](coroutine<void ()>::self &){});
+	coroutine<void ()> one_round([](coroutine<void ()>::self & self){ self.yield(); });
+	done();
+	coroutine<void ()> * void_children[] = { &done, &one_round };
+	coroutine<void ()> void_parent([&](coroutine<void ()>::self & self)
+	{
+		when_all(self, void_children, 2);
+	});
+	while (void_parent && void_rounds < 10)
+	{
+		void_parent();
+		++void_rounds;
+	}
+	EXPECT_EQ(2, void_rounds);
+}
+
+TEST(when_any, cancels_losers)
+{
+	using namespace coro;
+	int destroyed = 0;
+	struct count_destruction
+	{
+		~count_destruction()
+		{
+			++destroyed;
+		}
+		int & destroyed;
+	};
+	coroutine<int ()> slow([&destroyed](coroutine<int ()>::self & self)
+	{
+		count_destruction on_stack = { destroyed };
+		for (;;) self.yield(-1);
+		return 0;
+	});
+	coroutine<int ()> fast(takes_rounds(2, 5));
+	coroutine<int ()> * children[] = { &slow, &fast };
+	when_any_result<int> result = { 0, 0 };
+	coroutine<void ()> parent([&](coroutine<void ()>::self & self)
+	{
+		result = when_any(self, children, 2);
+	});
+	while (parent) parent();
+	EXPECT_EQ(1u, result.index);
+	EXPECT_EQ(5, result.value);
+	EXPECT_FALSE(slow);
+#	ifndef CORO_NO_EXCEPTIONS
+		EXPECT_EQ(1, destroyed);
+#	endif
+}
+
+TEST(when_any, void)
+{
+	using namespace coro;
+	coroutine<void ()> a([](coroutine<void ()>::self & self)
+	{
+		self.yield();
+	});
+	coroutine<void ()> b([](coroutine<void ()>::self &)
+	{
+	});
+	coroutine<void ()> * children[] = { &a, &b };
+	size_t index = 5;
+	coroutine<void ()> parent([&](coroutine<void ()>::self & self)
+	{
+		index = when_any(self, children, 2);
+		// everything has finished now
+		EXPECT_EQ(2u, when_any(self, children, 2));
+	});
+	parent();
+	EXPECT_FALSE(parent);
+	EXPECT_EQ(1u, index);
+	EXPECT_FALSE(a);
+}
+
+#ifndef CORO_NO_EXCEPTIONS
+TEST(when_all, exception)
+{
+	using namespace coro;
+	coroutine<int ()> waits(takes_rounds(5, 1));
+	coroutine<int ()> throws([](coroutine<int ()>::self & self) -> int
+	{
+		self.yield(-1);
+		throw 3;
+	});
+	coroutine<int ()> * children[] = { &waits, &throws };
+	bool caught = false;
+	coroutine<void ()> parent([&](coroutine<void ()>::self & self)
+	{
+		try
+		{
+			when_all(self, children, 2);
+		}
+		catch(int)
+		{
+			caught = true;
+		}
+	});
+	while (parent) parent();
+	EXPECT_TRUE(caught);
+	EXPECT_FALSE(waits);
+}
+#endif
+#endif
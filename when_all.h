@@ -0,0 +1,184 @@
+#pragma once
+
+#include "coroutine.h"
+#include <cstddef>
+#include <tuple>
+#include <vector>
+
+namespace coro
+{
+/**
+ * when_all and when_any run several child coroutines from inside of a
+ * parent coroutine. a child that yields is not done yet, for example
+ * because it is waiting on something, and only the value that it returns
+ * counts. every round, each unfinished child is resumed once. if that
+ * didn't finish the children, the parent yields without a value and does
+ * the next round when it is resumed, like await() in stackless_bridge.h.
+ * the results are moved out of the children, never copied.
+ *
+ * if a child throws, the other children are cancelled and the exception
+ * is passed on. the results have to be default constructible, like all
+ * coroutine results
+ */
+
+namespace detail
+{
+	template<size_t Index, size_t Count>
+	struct when_all_step
+	{
+		// resumes the unfinished children once. returns how many of them
+		// are still unfinished
+		template<typename Results, typename Children>
+		static size_t resume(Results & results, Children & children)
+		{
+			size_t unfinished = 0;
+			typename std::tuple_element<Index, Children>::type child = std::get<Index>(children);
+			if (child)
+			{
+				std::get<Index>(results) = child();
+				if (child) ++unfinished;
+			}
+			return unfinished + when_all_step<Index + 1, Count>::resume(results, children);
+		}
+		template<typename Children>
+		static void cancel(Children & children)
+		{
+			std::get<Index>(children).cancel();
+			when_all_step<Index + 1, Count>::cancel(children);
+		}
+	};
+	template<size_t Count>
+	struct when_all_step<Count, Count>
+	{
+		template<typename Results, typename Children>
+		static size_t resume(Results &, Children &)
+		{
+			return 0;
+		}
+		template<typename Children>
+		static void cancel(Children &)
+		{
+		}
+	};
+
+	template<typename Coroutine>
+	void cancel_all(Coroutine * const * children, size_t count)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			children[i]->cancel();
+		}
+	}
+}
+
+// waits for all children and returns their results in order. a child that
+// had already finished before has nothing left to return, so its result
+// stays default constructed
+template<typename... Results>
+std::tuple<Results...> when_all(basic_coroutine & self, coroutine<Results ()> &... children)
+{
+	typedef std::tuple<coroutine<Results ()> &...> children_tuple;
+	typedef detail::when_all_step<0, sizeof...(Results)> step;
+	children_tuple all_children(children...);
+	std::tuple<Results...> results;
+#	ifndef CORO_NO_EXCEPTIONS
+		try
+		{
+#	endif
+		while (step::resume(results, all_children))
+		{
+			self.yield();
+		}
+#	ifndef CORO_NO_EXCEPTIONS
+		}
+		catch(...)
+		{
+			step::cancel(all_children);
+			throw;
+		}
+#	endif
+	return results;
+}
+
+// waits for all children. results[i] is the result of children[i], or
+// default constructed if children[i] had already finished before
+template<typename Result>
+std::vector<Result> when_all(basic_coroutine & self, coroutine<Result ()> * const * children, size_t count)
+{
+	std::vector<Result> results(count);
+#	ifndef CORO_NO_EXCEPTIONS
+		try
+		{
+#	endif
+		for (;;)
+		{
+			// counted every round, so that children that had already
+			// finished before don't count
+			size_t unfinished = 0;
+			for (size_t i = 0; i < count; ++i)
+			{
+				if (!*children[i]) continue;
+				results[i] = (*children[i])();
+				if (*children[i]) ++unfinished;
+			}
+			if (!unfinished) break;
+			self.yield();
+		}
+#	ifndef CORO_NO_EXCEPTIONS
+		}
+		catch(...)
+		{
+			detail::cancel_all(children, count);
+			throw;
+		}
+#	endif
+	return results;
+}
+void when_all(basic_coroutine & self, coroutine<void ()> * const * children, size_t count);
+
+template<typename Result>
+struct when_any_result
+{
+	// the child that finished first
+	size_t index;
+	Result value;
+};
+
+// waits until one child has finished and cancels the others. if several
+// children finish in the same round, the one that comes first wins. if all
+// children had already finished before, index is count
+template<typename Result>
+when_any_result<Result> when_any(basic_coroutine & self, coroutine<Result ()> * const * children, size_t count)
+{
+	when_any_result<Result> result = { count, Result() };
+#	ifndef CORO_NO_EXCEPTIONS
+		try
+		{
+#	endif
+		for (;;)
+		{
+			bool any_unfinished = false;
+			for (size_t i = 0; i < count && result.index == count; ++i)
+			{
+				if (!*children[i]) continue;
+				any_unfinished = true;
+				result.value = (*children[i])();
+				if (!*children[i]) result.index = i;
+			}
+			if (result.index != count || !any_unfinished) break;
+			self.yield();
+		}
+#	ifndef CORO_NO_EXCEPTIONS
+		}
+		catch(...)
+		{
+			detail::cancel_all(children, count);
+			throw;
+		}
+#	endif
+	detail::cancel_all(children, count);
+	return result;
+}
+// returns the index of the child that finished first, or count
+size_t when_any(basic_coroutine & self, coroutine<void ()> * const * children, size_t count);
+}